@@ -0,0 +1,351 @@
+/*
+ * Сравнение двух наборов результатов bench/run.sh с учетом шума.
+ *
+ * Прогоны группируются по параметрам (режим, длина сообщения, число
+ * соединений и т.д. - все поля, кроме метрик и служебных). Для каждой
+ * группы и метрики бутстрепом оценивается доверительный интервал
+ * относительного изменения среднего (new / old - 1).
+ *
+ * Регрессия засчитывается, только если изменение хуже порога
+ * И доверительный интервал целиком лежит по "плохую" сторону от нуля,
+ * то есть ухудшение не объясняется разбросом повторов.
+ *
+ * Компиляция:
+ *      make bench/compare
+ * Запуск:
+ *      bench/compare [-t pct] [-p pct] [-b iters] [-c level] old.jsonl new.jsonl
+ *
+ * Код возврата: 0 - регрессий нет, 1 - есть регрессия пропускной
+ * способности или p99, -1 - ошибка.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAXLINE 4096
+#define MAXFIELDS 64
+#define MAXKEY 512
+
+/*
+ * Метрики: имя и направление (1 - больше лучше, -1 - меньше лучше).
+ * gate - участвует ли метрика в коде возврата.
+ */
+static const struct metric {
+    const char* name;
+    int better;
+    int gate;
+} metrics[] = {
+    { "throughput_rps",        1,  1 },
+    { "throughput_mbps",       1,  0 },
+    { "p50_us",               -1,  0 },
+    { "p99_us",               -1,  1 },
+    { "p999_us",              -1,  0 },
+    { "client_cpu_us_per_msg", -1, 0 },
+    { "server_cpu_us_per_msg", -1, 0 },
+    { "ready_ms",             -1,  0 },
+};
+#define NMETRICS (sizeof(metrics) / sizeof(metrics[0]))
+
+/*
+ * Поля, которые не являются ни метриками, ни параметрами прогона.
+ * server_flags, tune и seed - сравниваемые варианты, как и build.
+ */
+static const char* ignored[] = {
+    "build", "server_flags", "tune", "seed", "rep", "duration_s", "requests", "errors", "bytes",
+    "mean_us", "p90_us", "max_us", NULL
+};
+
+static double tput_threshold = 5;   /* Порог регрессии пропускной способности, %. */
+static double p99_threshold = 10;   /* Порог регрессии p99, %. */
+static int iters = 10000;           /* Число бутстреп-выборок. */
+static double level = 0.95;         /* Доверительная вероятность. */
+
+void error(const char* s)
+{
+    perror(s);
+    exit(-1);
+}
+
+void* Malloc(size_t size)
+{
+    void* rc;
+
+    rc = malloc(size);
+    if (rc == NULL) error("malloc()");
+
+    return rc;
+}
+
+/*
+ * Группа прогонов с одинаковыми параметрами.
+ */
+struct group {
+    char key[MAXKEY];
+    double* v[2][NMETRICS];     /* Значения метрик: [набор][метрика][прогон]. */
+    int n[2], cap[2];
+};
+
+static struct group* groups;
+static int ngroups, capgroups;
+
+static struct group* find_group(const char* key)
+{
+    int i;
+
+    for (i = 0; i < ngroups; i++)
+        if (!strcmp(groups[i].key, key)) return &groups[i];
+    if (ngroups == capgroups) {
+        capgroups = capgroups ? capgroups * 2 : 64;
+        groups = realloc(groups, capgroups * sizeof(*groups));
+        if (groups == NULL) error("realloc()");
+    }
+    memset(&groups[ngroups], 0, sizeof(*groups));
+    snprintf(groups[ngroups].key, MAXKEY, "%s", key);
+    return &groups[ngroups++];
+}
+
+/*
+ * Разбор плоского объекта JSON: {"имя":число или "строка", ...}.
+ * Указатели names/values ссылаются внутрь line, которая портится.
+ */
+static int parse_line(char* line, char** names, char** values)
+{
+    char* p = line;
+    int n = 0;
+
+    while (*p && *p != '{') p++;
+    if (*p++ != '{') return -1;
+    for (;;) {
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == '}') return n;
+        if (*p++ != '"' || n == MAXFIELDS) return -1;
+        names[n] = p;
+        while (*p && *p != '"') p++;
+        if (!*p) return -1;
+        *p++ = 0;
+        while (*p == ' ' || *p == ':') p++;
+        if (*p == '"') {
+            values[n] = ++p;
+            while (*p && *p != '"') p++;
+            if (!*p) return -1;
+            *p++ = 0;
+        } else {
+            values[n] = p;
+            while (*p && *p != ',' && *p != '}') p++;
+            if (!*p) return -1;
+            if (*p == '}') {
+                *p = 0;
+                n++;
+                return n;
+            }
+            *p++ = 0;
+        }
+        n++;
+    }
+}
+
+static int is_ignored(const char* name)
+{
+    int i;
+
+    for (i = 0; ignored[i]; i++)
+        if (!strcmp(ignored[i], name)) return 1;
+    for (i = 0; i < (int)NMETRICS; i++)
+        if (!strcmp(metrics[i].name, name)) return 1;
+    return 0;
+}
+
+static void load(const char* path, int set)
+{
+    char line[MAXLINE], key[MAXKEY];
+    char* names[MAXFIELDS];
+    char* values[MAXFIELDS];
+    struct group* g;
+    FILE* f;
+    int n, i, m, lineno = 0;
+    size_t len;
+
+    f = fopen(path, "r");
+    if (f == NULL) error(path);
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (line[0] != '{') continue;
+        n = parse_line(line, names, values);
+        if (n < 0) {
+            fprintf(stderr, "%s:%d: malformed line\n", path, lineno);
+            exit(-1);
+        }
+        key[0] = 0;
+        len = 0;
+        for (i = 0; i < n; i++) {
+            if (is_ignored(names[i])) continue;
+            len += snprintf(key + len, len < MAXKEY ? MAXKEY - len : 0,
+                "%s%s=%s", len ? " " : "", names[i], values[i]);
+        }
+        g = find_group(key);
+        if (g->n[set] == g->cap[set]) {
+            g->cap[set] = g->cap[set] ? g->cap[set] * 2 : 8;
+            for (m = 0; m < (int)NMETRICS; m++) {
+                g->v[set][m] = realloc(g->v[set][m], g->cap[set] * sizeof(double));
+                if (g->v[set][m] == NULL) error("realloc()");
+            }
+        }
+        for (m = 0; m < (int)NMETRICS; m++) {
+            g->v[set][m][g->n[set]] = NAN;
+            for (i = 0; i < n; i++)
+                if (!strcmp(names[i], metrics[m].name))
+                    g->v[set][m][g->n[set]] = atof(values[i]);
+        }
+        g->n[set]++;
+    }
+    fclose(f);
+}
+
+/*
+ * Генератор псевдослучайных чисел xorshift64*: фиксированное начальное
+ * значение делает результат сравнения воспроизводимым.
+ */
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t rng(uint32_t n)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545f4914f6cdd1dULL) >> 32) % n;
+}
+
+static double mean(const double* v, int n)
+{
+    double s = 0;
+    int i;
+
+    for (i = 0; i < n; i++) s += v[i];
+    return s / n;
+}
+
+static double resampled_mean(const double* v, int n)
+{
+    double s = 0;
+    int i;
+
+    for (i = 0; i < n; i++) s += v[rng(n)];
+    return s / n;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Бутстреп-интервал относительного изменения среднего, в процентах.
+ */
+static void bootstrap(const double* a, int na, const double* b, int nb,
+    double* lo, double* hi)
+{
+    double* d = Malloc(iters * sizeof(double));
+    double ma;
+    int i;
+
+    for (i = 0; i < iters; i++) {
+        ma = resampled_mean(a, na);
+        d[i] = ma ? (resampled_mean(b, nb) / ma - 1) * 100 : 0;
+    }
+    qsort(d, iters, sizeof(double), cmp_double);
+    *lo = d[(int)((1 - level) / 2 * (iters - 1))];
+    *hi = d[(int)((1 + level) / 2 * (iters - 1))];
+    free(d);
+}
+
+/* Отбросить отсутствующие значения (NaN). */
+static int present(const double* v, int n, double* out)
+{
+    int i, k = 0;
+
+    for (i = 0; i < n; i++)
+        if (!isnan(v[i])) out[k++] = v[i];
+    return k;
+}
+
+static void show_usage(void)
+{
+    fprintf(stderr, "Usage: compare [-t pct] [-p pct] [-b iters] [-c level] old.jsonl new.jsonl\n"
+        "  -t PCT    throughput regression threshold, %% (default 5)\n"
+        "  -p PCT    p99 latency regression threshold, %% (default 10)\n"
+        "  -b N      bootstrap resamples (default 10000)\n"
+        "  -c LEVEL  confidence level (default 0.95)\n");
+    exit(-1);
+}
+
+int main(int argc, char** argv)
+{
+    struct group* g;
+    double *a, *b, lo, hi, change, threshold;
+    int c, i, m, na, nb, bad, regressions = 0;
+    const char* verdict;
+
+    while ((c = getopt(argc, argv, "t:p:b:c:")) != -1) {
+        switch (c) {
+        case 't': tput_threshold = atof(optarg); break;
+        case 'p': p99_threshold = atof(optarg); break;
+        case 'b': iters = atoi(optarg); break;
+        case 'c': level = atof(optarg); break;
+        default: show_usage();
+        }
+    }
+    if (argc - optind != 2 || iters < 1 || level <= 0 || level >= 1) show_usage();
+
+    load(argv[optind], 0);
+    load(argv[optind + 1], 1);
+
+    printf("%-22s %12s %12s %8s %20s  %s\n",
+        "metric", "old", "new", "change%", "ci%", "verdict");
+    for (i = 0; i < ngroups; i++) {
+        g = &groups[i];
+        printf("# %s (runs: %d old, %d new)\n", g->key, g->n[0], g->n[1]);
+        if (!g->n[0] || !g->n[1]) {
+            printf("  present in one set only, skipped\n");
+            continue;
+        }
+        a = Malloc(g->n[0] * sizeof(double));
+        b = Malloc(g->n[1] * sizeof(double));
+        for (m = 0; m < (int)NMETRICS; m++) {
+            na = present(g->v[0][m], g->n[0], a);
+            nb = present(g->v[1][m], g->n[1], b);
+            if (!na || !nb) continue;
+            change = mean(a, na) ? (mean(b, nb) / mean(a, na) - 1) * 100 : 0;
+            bootstrap(a, na, b, nb, &lo, &hi);
+
+            /* Ухудшение в "единицах лучше": положительное - хуже. */
+            threshold = metrics[m].better > 0 ? tput_threshold : p99_threshold;
+            bad = metrics[m].better > 0 ? hi < 0 && -change > threshold
+                                        : lo > 0 && change > threshold;
+            if (bad && metrics[m].gate) {
+                verdict = "REGRESSION";
+                regressions++;
+            } else if (bad) {
+                verdict = "worse";
+            } else if (metrics[m].better > 0 ? lo > 0 : hi < 0) {
+                verdict = "better";
+            } else {
+                verdict = "";
+            }
+            printf("  %-20s %12.2f %12.2f %+8.2f   [%+7.2f, %+7.2f]  %s\n",
+                metrics[m].name, mean(a, na), mean(b, nb), change, lo, hi, verdict);
+        }
+        free(a);
+        free(b);
+    }
+    printf("%d regression(s) beyond thresholds (throughput %.1f%%, p99 %.1f%%)\n",
+        regressions, tput_threshold, p99_threshold);
+
+    return regressions ? 1 : 0;
+}
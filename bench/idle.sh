@@ -0,0 +1,98 @@
+#!/bin/bash
+#
+# Память сервера на простаивающее соединение: server3 в каждом режиме,
+# client --idle открывает CONNS keep-alive соединений, делает на каждом
+# по одному запросу и держит их. RSS сервера снимается до соединений и
+# после того, как все они открыты; результат - по строке JSON на точку.
+#
+# Параметры задаются переменными окружения:
+#   LABEL      метка сборки в результатах (по умолчанию git describe)
+#   OUT        файл результатов (по умолчанию bench/results/idle-$LABEL.jsonl)
+#   MODES      режимы сервера; MODE:BYTES - с --stack BYTES
+#              ("thread thread:65536 coro event")
+#   CONCS      числа соединений ("10000 100000")
+#   PER_CLIENT соединений на процесс client (15000): у каждого процесса
+#              свой предел дескрипторов, а у каждого адреса 127.0.0.N -
+#              свои ~28 тысяч портов
+#   SIZE       длина сообщения (-s сервера, 64)
+#   BASE_PORT  порты прогонов берутся подряд начиная со следующего (21000)
+#
+# Соединений открывается столько, сколько сервер успевает обслужить:
+# поле opened в результате меньше conns, если уперлись в пределы
+# дескрипторов, потоков или памяти; rss_kb 0 - сервер при этом
+# завершился (режим thread выходит по ошибке accept(), coro не может
+# выделить столько стеков больше vm.max_map_count / 2).
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+LABEL=${LABEL:-$(git describe --always --dirty 2>/dev/null || echo unknown)}
+OUT=${OUT:-bench/results/idle-$LABEL.jsonl}
+MODES=${MODES:-thread thread:65536 coro event}
+CONCS=${CONCS:-10000 100000}
+PER_CLIENT=${PER_CLIENT:-15000}
+SIZE=${SIZE:-64}
+BASE_PORT=${BASE_PORT:-21000}
+
+make -s all
+mkdir -p "$(dirname "$OUT")"
+: > "$OUT"
+
+tmpd=$(mktemp -d)
+trap 'rm -rf "$tmpd"' EXIT
+port=$BASE_PORT
+
+# Поле /proc/PID/status; 0, если сервер уже завершился.
+status_kb() {
+	awk -v k="$2:" '$1 == k { print $2 }' "/proc/$1/status" 2>/dev/null || echo 0
+}
+
+for variant in $MODES; do
+for conns in $CONCS; do
+	mode=${variant%%:*}
+	sflag=
+	[ "$mode" != "$variant" ] && sflag="--stack ${variant#*:}"
+
+	port=$((port + 1))
+	./server3 -p "$port" -m "$mode" -k -s "$SIZE" -c "$conns" -b 4096 $sflag 2>"$tmpd/slog" &
+	spid=$!
+	for _ in $(seq 100); do
+		grep -q '^ready' "$tmpd/slog" && break
+		sleep 0.05
+	done
+	rss0=$(status_kb "$spid" VmRSS)
+
+	# Клиенты держат соединения, пока их не остановят.
+	pids=
+	left=$conns
+	n=0
+	while [ "$left" -gt 0 ]; do
+		k=$((left < PER_CLIENT ? left : PER_CLIENT))
+		n=$((n + 1))
+		./client --idle "$k" -k -d 3600 --bind "127.0.0.$n" -p "$port" 127.0.0.1 > "$tmpd/c$n" &
+		pids="$pids $!"
+		left=$((left - k))
+		# следующий процесс - после того, как этот открыл все
+		until [ -s "$tmpd/c$n" ]; do sleep 0.2; done
+		grep -q '"full":true' "$tmpd/c$n" && break
+	done
+	sleep 1
+
+	opened=$(cat "$tmpd"/c* | sed 's/.*"opened":\([0-9]*\).*/\1/' | awk '{ s += $1 } END { print s + 0 }')
+	rss1=$(status_kb "$spid" VmRSS)
+	threads=$(status_kb "$spid" Threads)
+
+	kill $pids 2>/dev/null || true
+	wait $pids 2>/dev/null || true
+	kill "$spid" 2>/dev/null || true
+	wait "$spid" 2>/dev/null || true
+	rm -f "$tmpd"/c*
+
+	per=$(awk -v a="$rss0" -v b="$rss1" -v n="$opened" 'BEGIN { printf "%.0f", n && b ? (b - a) * 1024 / n : 0 }')
+	echo "{\"build\":\"$LABEL\",\"mode\":\"$mode\",\"stack\":\"${sflag#--stack }\",\"conns\":$conns," \
+		"\"opened\":$opened,\"threads\":$threads,\"rss_base_kb\":$rss0,\"rss_kb\":$rss1," \
+		"\"rss_per_conn_bytes\":$per}" | tr -d ' ' >> "$OUT"
+	tail -n 1 "$OUT"
+done
+done
@@ -0,0 +1,357 @@
+/*
+ * Микробенчмарки примитивов сервера: reads(), writen() и splicen(),
+ * формирование случайного сообщения и Malloc() на каждое принятое
+ * соединение (и заменивший его пул соединений).
+ *
+ * Функции берутся из server3.c как есть: файл включается целиком,
+ * а его main() переименовывается, чтобы не конфликтовать с нашим.
+ *
+ * Каждый замер: прогрев, затем REPS повторов по BATCH операций;
+ * по повторам считаются медиана, MAD (медиана абсолютных отклонений)
+ * и минимум времени на одну операцию.
+ *
+ * Компиляция:
+ *      make micro
+ * Запуск:
+ *      bench/micro [-r reps] [-j] [filter]
+ *      -j - вывод строками JSON, filter - подстрока имени замера
+ */
+
+#define _GNU_SOURCE
+#define main server3_main
+#include "../server3.c"
+#undef main
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define WARMUP_REPS 5
+#define DEFAULT_REPS 31
+
+static int reps = DEFAULT_REPS;
+static int json = 0;
+static const char* filter = NULL;
+
+static int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double median(double* v, int n)
+{
+    qsort(v, n, sizeof(*v), cmp_double);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/*
+ * Замер: setup() готовит данные (не учитывается во времени),
+ * run() выполняет batch операций.
+ */
+struct bench {
+    const char* name;
+    long batch;
+    size_t arg;
+    void (*setup)(struct bench* b);
+    void (*run)(struct bench* b);
+    void (*teardown)(struct bench* b);
+    int fd[2];
+    char* buf;
+};
+
+static void print_result(struct bench* b, double* ns, int n)
+{
+    double med, mad, min, dev[n];
+    int i;
+
+    min = ns[0];
+    for (i = 0; i < n; i++) if (ns[i] < min) min = ns[i];
+    med = median(ns, n);
+    for (i = 0; i < n; i++) dev[i] = ns[i] > med ? ns[i] - med : med - ns[i];
+    mad = median(dev, n);
+
+    if (json) {
+        printf("{\"bench\":\"%s\",\"arg\":%zu,\"reps\":%d,\"batch\":%ld,"
+            "\"median_ns\":%.2f,\"mad_ns\":%.2f,\"min_ns\":%.2f}\n",
+            b->name, b->arg, n, b->batch, med, mad, min);
+    } else {
+        printf("%-24s %8zu %12.2f %10.2f %12.2f\n",
+            b->name, b->arg, med, mad, min);
+    }
+    fflush(stdout);
+}
+
+static void measure(struct bench* b)
+{
+    double ns[reps];
+    uint64_t t0;
+    int i;
+
+    if (filter && !strstr(b->name, filter)) return;
+    if (b->setup) b->setup(b);
+    for (i = -WARMUP_REPS; i < reps; i++) {
+        t0 = now_ns();
+        b->run(b);
+        if (i >= 0) ns[i] = (double)(now_ns() - t0) / b->batch;
+    }
+    if (b->teardown) b->teardown(b);
+    print_result(b, ns, reps);
+}
+
+/*
+ * Заполнить fd строками длины b->arg (с '\n') на batch операций reads().
+ */
+static void fill_lines(struct bench* b, int fd)
+{
+    size_t total = b->batch * (b->arg + 1);
+    char* p = Malloc(total);
+    long i;
+
+    for (i = 0; i < b->batch; i++) {
+        memset(p + i * (b->arg + 1), 'x', b->arg);
+        p[i * (b->arg + 1) + b->arg] = '\n';
+    }
+    writen(fd, p, total);
+    free(p);
+}
+
+/* reads() из сокета: данные уже лежат в буфере приема. */
+static void reads_socket_setup(struct bench* b)
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, b->fd) == -1) error("socketpair()");
+    b->buf = Malloc(MAXLINE);
+}
+
+static void reads_socket_run(struct bench* b)
+{
+    long i;
+
+    /* Порция строк не превышает буфер сокета, поэтому пишется за раз. */
+    fill_lines(b, b->fd[1]);
+    for (i = 0; i < b->batch; i++) reads(b->fd[0], b->buf, MAXLINE);
+}
+
+/* reads() из файла в памяти (memfd). */
+static void reads_memfd_setup(struct bench* b)
+{
+    b->fd[0] = memfd_create("micro", 0);
+    if (b->fd[0] == -1) error("memfd_create()");
+    b->fd[1] = -1;
+    fill_lines(b, b->fd[0]);
+    b->buf = Malloc(MAXLINE);
+}
+
+static void reads_memfd_run(struct bench* b)
+{
+    long i;
+
+    lseek(b->fd[0], 0, SEEK_SET);
+    for (i = 0; i < b->batch; i++) reads(b->fd[0], b->buf, MAXLINE);
+}
+
+/* writen() в файл в памяти. */
+static void writen_memfd_setup(struct bench* b)
+{
+    b->fd[0] = memfd_create("micro", 0);
+    if (b->fd[0] == -1) error("memfd_create()");
+    b->fd[1] = -1;
+    b->buf = Malloc(b->arg);
+    memset(b->buf, 'x', b->arg);
+}
+
+static void writen_memfd_run(struct bench* b)
+{
+    long i;
+
+    lseek(b->fd[0], 0, SEEK_SET);
+    for (i = 0; i < b->batch; i++) writen(b->fd[0], b->buf, b->arg);
+}
+
+/*
+ * writen() в сокет: отдельный поток вычитывает другой конец, как это
+ * делал бы клиент.
+ */
+static void* drain(void* arg)
+{
+    char buf[65536];
+    int fd = *(int*)arg;
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+static pthread_t drain_thread;
+
+static void writen_socket_setup(struct bench* b)
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, b->fd) == -1) error("socketpair()");
+    Pthread_create(&drain_thread, NULL, drain, &b->fd[0]);
+    b->buf = Malloc(b->arg);
+    memset(b->buf, 'x', b->arg);
+}
+
+static void writen_socket_run(struct bench* b)
+{
+    long i;
+
+    for (i = 0; i < b->batch; i++) writen(b->fd[1], b->buf, b->arg);
+}
+
+static void writen_socket_teardown(struct bench* b)
+{
+    shutdown(b->fd[1], SHUT_WR);
+    pthread_join(drain_thread, NULL);
+}
+
+/*
+ * writen() и splicen() в TCP через loopback: время на сообщение
+ * включает и чтение на другом конце, поэтому на одном CPU это
+ * процессорное время всего пути, а arg / время - байты в секунду.
+ */
+static void tcp_setup(struct bench* b)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int lsocket;
+
+    lsocket = Socket(PF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Bind(lsocket, (SA*)&addr, sizeof(addr));
+    Listen(lsocket, 1);
+    if (getsockname(lsocket, (SA*)&addr, &len) == -1) error("getsockname()");
+    b->fd[1] = Socket(PF_INET, SOCK_STREAM, 0);
+    if (connect(b->fd[1], (SA*)&addr, sizeof(addr)) == -1) error("connect()");
+    b->fd[0] = Accept(lsocket, NULL, NULL);
+    Close(lsocket);
+    Pthread_create(&drain_thread, NULL, drain, &b->fd[0]);
+    b->buf = Malloc(b->arg);
+    memset(b->buf, 'x', b->arg);
+}
+
+static void splicen_run(struct bench* b)
+{
+    struct iovec iov;
+    long i;
+
+    for (i = 0; i < b->batch; i++) {
+        iov.iov_base = b->buf;
+        iov.iov_len = b->arg;
+        splicen(b->fd[1], &iov, 1);
+    }
+}
+
+/* Формирование случайного сообщения длины arg. */
+static void message_setup(struct bench* b)
+{
+    b->fd[0] = b->fd[1] = -1;
+    b->buf = Malloc(b->arg + 1);
+}
+
+static struct rng message_rng;
+
+static void message_run(struct bench* b)
+{
+    long i;
+
+    for (i = 0; i < b->batch; i++) make_message(&message_rng, b->buf, b->arg);
+}
+
+/* Malloc()/free() аргумента потока, как в цикле accept в main(). */
+static void malloc_run(struct bench* b)
+{
+    long i;
+    int* volatile arg;
+
+    for (i = 0; i < b->batch; i++) {
+        arg = Malloc(sizeof(int));
+        *arg = i;
+        free(arg);
+    }
+}
+
+/* pool_get()/pool_put() соединения, заменившие Malloc() в main(). */
+static void pool_setup(struct bench* b)
+{
+    b->fd[0] = b->fd[1] = -1;
+    b->buf = NULL;
+    pool_init(&conn_pool, sizeof(struct conn), MAXCONN);
+}
+
+static void pool_run(struct bench* b)
+{
+    long i;
+    struct conn* volatile c;
+
+    for (i = 0; i < b->batch; i++) {
+        c = pool_get(&conn_pool);
+        c->fd = i;
+        pool_put(&conn_pool, c);
+    }
+}
+
+static void close_fds(struct bench* b)
+{
+    if (b->fd[0] != -1) Close(b->fd[0]);
+    if (b->fd[1] != -1) Close(b->fd[1]);
+    free(b->buf);
+}
+
+static struct bench benches[] = {
+    { "reads/socketpair",   256,   16, reads_socket_setup,  reads_socket_run,  NULL },
+    { "reads/socketpair",    64,  200, reads_socket_setup,  reads_socket_run,  NULL },
+    { "reads/memfd",        256,   16, reads_memfd_setup,   reads_memfd_run,   NULL },
+    { "reads/memfd",         64,  200, reads_memfd_setup,   reads_memfd_run,   NULL },
+    { "writen/memfd",      1024,   64, writen_memfd_setup,  writen_memfd_run,  NULL },
+    { "writen/memfd",        64, 65536, writen_memfd_setup, writen_memfd_run,  NULL },
+    { "writen/socketpair", 1024,   64, writen_socket_setup, writen_socket_run, writen_socket_teardown },
+    { "writen/socketpair",   64, 65536, writen_socket_setup, writen_socket_run, writen_socket_teardown },
+    { "writen/tcp",         256,  4096, tcp_setup,          writen_socket_run, writen_socket_teardown },
+    { "writen/tcp",          64, 65536, tcp_setup,          writen_socket_run, writen_socket_teardown },
+    { "writen/tcp",           8, 1048576, tcp_setup,        writen_socket_run, writen_socket_teardown },
+    { "splicen/tcp",        256,  4096, tcp_setup,          splicen_run,       writen_socket_teardown },
+    { "splicen/tcp",         64, 65536, tcp_setup,          splicen_run,       writen_socket_teardown },
+    { "splicen/tcp",          8, 1048576, tcp_setup,        splicen_run,       writen_socket_teardown },
+    { "make_message",      1024,   10, message_setup,       message_run,       NULL },
+    { "make_message",      1024,   64, message_setup,       message_run,       NULL },
+    { "make_message",        16, 65536, message_setup,      message_run,       NULL },
+    { "malloc_arg",        4096, sizeof(int), NULL,         malloc_run,        NULL },
+    { "pool_conn",         4096, sizeof(struct conn), pool_setup, pool_run,      NULL },
+};
+
+int main(int argc, char** argv)
+{
+    size_t i;
+    int c;
+
+    while ((c = getopt(argc, argv, "r:j")) != -1) {
+        switch (c) {
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: micro [-r reps] [-j] [filter]\n");
+            exit(-1);
+        }
+    }
+    if (optind < argc) filter = argv[optind];
+    if (reps < 1) reps = 1;
+
+    seed = 1;
+    rng_init(&message_rng, 0);
+    if (!json) printf("%-24s %8s %12s %10s %12s\n",
+        "bench", "arg", "median_ns", "mad_ns", "min_ns");
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        benches[i].fd[0] = benches[i].fd[1] = -1;
+        measure(&benches[i]);
+        if (benches[i].setup) close_fds(&benches[i]);
+    }
+
+    return 0;
+}
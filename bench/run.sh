@@ -0,0 +1,142 @@
+#!/bin/bash
+#
+# Сквозной прогон: server3 в каждом режиме обслуживания на loopback,
+# нагрузка - client -l. Перебираются число соединений, длина сообщения
+# и keep-alive/одно сообщение на соединение; каждый прогон повторяется
+# REPS раз. Результат - по одной строке JSON на прогон (JSON Lines).
+#
+# Параметры задаются переменными окружения:
+#   LABEL      метка сборки в результатах (по умолчанию git describe)
+#   OUT        файл результатов (по умолчанию bench/results/$LABEL.jsonl)
+#   MODES      режимы сервера              ("thread prefork coro")
+#   CONCS      числа соединений            ("1 8 64")
+#   SIZES      длины сообщений или их распределения (-s сервера,
+#              например "uniform:0:100 lognormal:512:1") ("10 1024 65536")
+#   KEEPALIVE  0 - одно сообщение, 1 - keep-alive ("0 1")
+#   REPS       повторов каждой точки       (3)
+#   DURATION   длительность измерения, с   (3)
+#   WARMUP     прогрев перед измерением, с (1)
+#   SERVER_CPUS, CLIENT_CPUS  списки CPU для taskset (не задано - без привязки)
+#   SERVER_FLAGS  дополнительные ключи server3 для всех прогонов (например,
+#              "-H" - пулы в больших страницах); сравнение вариантов -
+#              два прогона с разными LABEL и bench/compare
+#   TUNE       профиль настройки сокетов сервера и клиента (--tune, см.
+#              tune.h; "default"); сравнение профилей - make bench-tune
+#   SEED       --seed сервера: повторы видят одни и те же сообщения (1)
+#   BASE_PORT  порты прогонов берутся подряд начиная со следующего (20000)
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+LABEL=${LABEL:-$(git describe --always --dirty 2>/dev/null || echo unknown)}
+OUT=${OUT:-bench/results/$LABEL.jsonl}
+MODES=${MODES:-thread prefork coro}
+CONCS=${CONCS:-1 8 64}
+SIZES=${SIZES:-10 1024 65536}
+KEEPALIVE=${KEEPALIVE:-0 1}
+REPS=${REPS:-3}
+DURATION=${DURATION:-3}
+WARMUP=${WARMUP:-1}
+BASE_PORT=${BASE_PORT:-20000}
+TUNE=${TUNE:-default}
+SEED=${SEED:-1}
+
+make -s all
+mkdir -p "$(dirname "$OUT")"
+: > "$OUT"
+
+HZ=$(getconf CLK_TCK)
+slog=$(mktemp)
+trap 'rm -f "$slog"' EXIT
+port=$BASE_PORT
+
+pin() {
+	if [ -n "$1" ]; then echo "taskset -c $1"; fi
+}
+
+# Процессорное время процесса и его рабочих процессов (режим prefork)
+# в тиках: utime + stime.
+cpu_ticks() {
+	local p t=0
+	for p in $1 $(pgrep -P "$1"); do
+		t=$((t + $(awk '{ print $14 + $15 }' "/proc/$p/stat" 2>/dev/null || echo 0)))
+	done
+	echo $t
+}
+
+# Запустить сервер на очередном свободном порту: порты недавних прогонов
+# могут быть заняты соединениями в TIME_WAIT, тогда bind() не пройдет
+# и берется следующий. Устанавливает spid и port.
+start_server() {
+	local tries
+	for tries in $(seq 50); do
+		port=$((port + 1))
+		$(pin "$SERVER_CPUS") ./server3 -p "$port" "$@" 2>"$slog" &
+		spid=$!
+		for _ in $(seq 100); do
+			kill -0 "$spid" 2>/dev/null || break
+			if (exec 3<>"/dev/tcp/127.0.0.1/$port") 2>/dev/null; then
+				return 0
+			fi
+			sleep 0.05
+		done
+		# Жив, но так и не принял соединение: остановить, иначе wait
+		# ждет его без конца. Сервер, не вышедший по SIGTERM, убивается.
+		if kill "$spid" 2>/dev/null; then
+			sleep 0.5
+			kill -KILL "$spid" 2>/dev/null || true
+		fi
+		wait "$spid" 2>/dev/null || true
+	done
+	echo "server did not start" >&2
+	exit 1
+}
+
+for mode in $MODES; do
+for size in $SIZES; do
+for ka in $KEEPALIVE; do
+for conc in $CONCS; do
+for rep in $(seq "$REPS"); do
+	kflag=
+	[ "$ka" = 1 ] && kflag=-k
+
+	start_server -b 4096 -m "$mode" -s "$size" $kflag --tune "$TUNE" --seed "$SEED" $SERVER_FLAGS
+
+	# Процессорное время сервера снимается только за время измерения:
+	# клиент запускается в фоне, отсчет начинается после прогрева.
+	tmp=$(mktemp)
+	$(pin "$CLIENT_CPUS") ./client -l -p "$port" -c "$conc" \
+		-d "$DURATION" -w "$WARMUP" $kflag -t "$TUNE" 127.0.0.1 > "$tmp" &
+	cpid=$!
+	sleep "$WARMUP"
+	c0=$(cpu_ticks "$spid")
+	wait "$cpid"
+	c1=$(cpu_ticks "$spid")
+	res=$(cat "$tmp")
+	rm -f "$tmp"
+
+	kill "$spid"
+	wait "$spid" 2>/dev/null || true
+
+	# Время до готовности сервера, как он сам его сообщил.
+	ready=$(sed -n 's/^ready in \([0-9.]*\) ms.*/\1/p' "$slog")
+
+	reqs=$(echo "$res" | sed 's/.*"requests":\([0-9]*\).*/\1/')
+	scpu=$(awk -v d="$((c1 - c0))" -v hz="$HZ" -v n="$reqs" \
+		'BEGIN { printf "%.3f", n ? d * 1e6 / hz / n : 0 }')
+
+	# длина - число, распределение - строка
+	jsize=$size
+	case $size in *[!0-9]*) jsize="\"$size\"" ;; esac
+
+	echo "{\"build\":\"$LABEL\",\"server_flags\":\"$SERVER_FLAGS\",\"tune\":\"$TUNE\",\"seed\":$SEED,\"mode\":\"$mode\",\"size\":$jsize,\"rep\":$rep,${res#\{}" |
+		sed "s/}\$/,\"server_cpu_us_per_msg\":$scpu,\"ready_ms\":${ready:-0}}/" >> "$OUT"
+	tail -n 1 "$OUT"
+done
+done
+done
+done
+done
+
+echo "results: $OUT" >&2
@@ -0,0 +1,76 @@
+/*
+ * Формат журнала трафика server3 (--capture), общий для сервера и
+ * client --replay.
+ *
+ * Журнал - последовательность файлов-сегментов PATH.P.NNNN (P - номер
+ * процесса, в режиме prefork - рабочего; NNNN - номер сегмента).
+ * Рабочий, перезапущенный в R-й раз, пишет в PATH.P-R.NNNN.
+ * Сегмент создается сразу полного размера и отображается в память:
+ *
+ *      struct capture_file             заголовок сегмента
+ *      записи подряд до header.used    struct capture_rec + данные
+ *
+ * Данные записи - сами байты (CAP_PAYLOAD), если они не длиннее
+ * --capture-payload, иначе хэш FNV-1a их начала (CAP_HASH, 8 байтов)
+ * или ничего, если байтов под рукой нет (потоковая отправка).
+ * Каждая запись выровнена по 8 байтам.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC 0x50414333        /* "3CAP" */
+#define CAPTURE_VERSION 1
+
+struct capture_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;               /* sizeof(struct capture_file) */
+    uint32_t segment;                   /* Номер сегмента. */
+    uint64_t size;                      /* Размер файла. */
+    uint64_t used;                      /* Занято записями, от начала файла. */
+    uint64_t mono_start;                /* Начало записи по CLOCK_MONOTONIC, нс. */
+    uint64_t real_start;                /* То же по CLOCK_REALTIME, нс от эпохи. */
+} __attribute__((aligned(64)));
+
+/* Направление (событие) записи. */
+enum {
+    CAP_OPEN = 'O',                     /* Соединение принято. */
+    CAP_RECV = 'R',                     /* Получена строка запроса. */
+    CAP_SEND = 'S',                     /* Отправлено сообщение. */
+    CAP_CLOSE = 'C'                     /* Соединение закрыто. */
+};
+
+/* Что лежит за заголовком записи. */
+#define CAP_PAYLOAD 1
+#define CAP_HASH 2
+
+struct capture_rec {
+    uint64_t ts;                        /* нс от mono_start */
+    uint64_t conn;                      /* Номер соединения (у процессов - свои диапазоны). */
+    uint64_t len;                       /* Длина данных события. */
+    uint8_t dir;
+    uint8_t flags;
+    uint16_t data_len;                  /* Байтов данных за заголовком. */
+    uint32_t reserved;
+};
+
+static inline size_t capture_rec_size(const struct capture_rec* r)
+{
+    return sizeof(*r) + ((r->data_len + 7) & ~7);
+}
+
+static inline uint64_t capture_hash(const void* data, size_t len)
+{
+    const unsigned char* p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+#endif
@@ -2,24 +2,81 @@
  * Шаблон TCP клиента.
  *
  * Компиляция:
- *	cc -Wall -O2 -o client client.c
+ *	cc -Wall -O2 -o client client.c -lpthread
+ * (или просто make, см. Makefile)
  *
  * Завершение работы клиента: Ctrl+D.
+ *
+ * С ключом -l клиент работает как генератор нагрузки: открывает
+ * несколько соединений параллельно, измеряет задержку каждого запроса
+ * и печатает итог одной строкой JSON (см. bench/run.sh).
+ *
+ * С ключом -r клиент воспроизводит записанный трафик (server3 --capture
+ * или текстовый файл событий) в исходном, ускоренном или предельном темпе
+ * и сравнивает задержки ответов с записанными.
+ *
+ * Ключ -V добавляет к нагрузке проверку ответов (см. "Проверка ответов").
+ *
+ * Генератору нагрузки можно дать несколько серверов: запросы
+ * распределяются между ними, дублируются (-F) или дублируются с
+ * задержкой (-H), см. "Несколько серверов".
+ *
+ * С ключом -M клиент принимает рассылку server3 -m multicast и считает
+ * потери по номерам датаграмм, см. "Прием рассылки".
+ *
+ * С ключом --idle клиент держит открытыми простаивающие соединения
+ * (bench/idle.sh), см. "Простаивающие соединения".
+ *
+ * С ключом --uring генератор нагрузки ведет соединения через io_uring
+ * без системного вызова на операцию, см. "Движок io_uring".
  */
 
+/* ppoll() */
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <glob.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <limits.h>
 
+/* Движку --uring нужны multishot recv и кольцо буферов (заголовки от 6.0). */
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_URING 1
+#endif
+
+#include "tune.h"
+#include "capture.h"
+#include "message.h"
+#include "mcast.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define PORT 1027
@@ -27,6 +84,25 @@
 
 #define SA struct sockaddr 
 
+/*
+ * Параметры генератора нагрузки.
+ */
+static int port = PORT;
+static int load = 0;		/* Режим генератора нагрузки. */
+static int conc = 1;		/* Число параллельных соединений. */
+static long nreq = 0;		/* Всего запросов; 0 - ограничение по времени. */
+static double duration = 5;	/* Длительность измерения, с. */
+static double warmup = 0;	/* Прогрев без учета результатов, с. */
+static int keepalive = 0;	/* Много запросов в одном соединении. */
+static const struct tune_profile *tune = &tune_profiles[0];	/* Настройка сокетов. */
+static struct sockaddr_in *servers;	/* Адреса серверов из командной строки. */
+static int nservers;
+static int fanout = 1;		/* Серверов на запрос сразу. */
+static int hedge = 0;		/* Дублировать запрос после порога. */
+static double hedge_delay = 0;	/* Порог, мкс; 0 - 95-й перцентиль задержек. */
+static int pool_size = 0;	/* Соединений на сервер в пуле; 0 - без пула. */
+static long conn_requests = 0;	/* Запросов на соединение; 0 - без ограничения. */
+
 /*
  * Обработчик фатальных ошибок.
  */
@@ -158,9 +234,68 @@ size_t writen(int socket, const char *buf, size_t count)
 	return count;
 }
 
+void *Malloc(size_t size)
+{
+	void *rc;
+
+	rc = malloc(size);
+	if(rc == NULL) error("malloc()");
+
+	return rc;
+}
+
+void Pthread_create(pthread_t *thread, pthread_attr_t *attr,
+	void *(*start_routine)(void *), void *arg)
+{
+	int rc;
+
+	rc = pthread_create(thread, attr, start_routine, arg);
+	if(rc) {
+		errno = rc;
+		error("pthread_create()");
+	}
+}
+
 void show_usage()
 {
-	puts("Usage: client ip_address");	
+	puts("Usage: client [-p port] [-t profile] ip_address\n"
+		"       client -l [-c conc] [-n requests | -d seconds] [-w seconds] [-k] [-t profile]\n"
+		"                 [-p port] ip_address\n"
+		"                 [-V [-s size] [-S seed -R n]]\n"
+		"       client -l -k [-F k] [-H [--hedge-delay us]] ... ip_address[:port] ...\n"
+		"       client -l -k -P n [--conn-requests n] ... ip_address[:port] ...\n"
+		"       client -l -k --uring n [-c conc] ... ip_address\n"
+		"       client -r path [-x speed] [-c conc] [-o file] [-t profile] [-p port] ip_address\n"
+		"       client -M [--mc-if addr] [-n datagrams | -d seconds] [-V] [-p port] group[:port]\n"
+		"       client --idle n -k [-d seconds] [--bind addr] [-p port] ip_address\n"
+		"  -p, --port PORT        server port (default 1027)\n"
+		"  -l, --load             run as a load generator, print JSON summary\n"
+		"  -c, --concurrency N    parallel connections (default 1)\n"
+		"  -n, --requests N       stop after N requests\n"
+		"  -d, --duration SEC     measure for SEC seconds (default 5)\n"
+		"  -w, --warmup SEC       run SEC seconds before measuring (default 0)\n"
+		"  -k, --keepalive        many requests per connection\n"
+		"  -t, --tune PROFILE     socket options: default, latency, throughput, churn\n"
+		"  -F, --fanout K         send each request to K servers, take the first reply\n"
+		"  -H, --hedge            duplicate a request to one more server if it is slower\n"
+		"                         than the p95 of recent requests\n"
+		"  --hedge-delay US       hedge after US microseconds instead of p95\n"
+		"  -P, --pool N           keep N connections per server open in advance, pick\n"
+		"                         the least loaded server, reconnect in the background\n"
+		"  --conn-requests N      with -k: close a connection after N requests\n"
+		"  --uring N              with -k: drive the -c connections from N io_uring threads\n"
+		"  -V, --validate         check framing and the a..z charset of every reply\n"
+		"  -s, --size SPEC        with -V: check lengths against the server's -s\n"
+		"  -S, --seed N           with -V: the server's --seed, needed for -R\n"
+		"  -R, --reserve N        with -V: the server's -R; check contents against it\n"
+		"  -r, --replay PATH      replay a server3 --capture log (prefix) or an event file\n"
+		"  -x, --speed X          replay X times faster (default 1); 0 - as fast as possible,\n"
+		"                         at most -c connections open\n"
+		"  -o, --replay-log FILE  per-request replay results, CSV\n"
+		"  -M, --multicast        receive a server3 -m multicast stream, count lost datagrams\n"
+		"  --mc-if ADDR           join the group on the interface with ADDR\n"
+		"  --idle N               open N connections, one request each, hold them -d seconds\n"
+		"  --bind ADDR            with --idle: local address (spreads ports over 127.0.0.x)");	
 	exit(-1);
 }
 
@@ -197,32 +332,2401 @@ void do_work(int socket)
 	}
 }
 
-int main(int argc, char **argv)
+/*
+ * Генератор нагрузки.
+ */
+
+/* Текущее время по монотонным часам, нс. */
+static uint64_t now_ns(void)
 {
-	int socket;
-	struct sockaddr_in servaddr;
-	
-	if(argc != 2) show_usage();
-	//printf("main1 \n");
-	socket = Socket(PF_INET, SOCK_STREAM, 0);
-	//printf("main2 \n");
-	/* Инициализировать структуру адреса сокета. */
-	memset(&servaddr, 0, sizeof(servaddr));
-	//printf("main3 \n");
-	servaddr.sin_family = AF_INET;
-	//printf("main4 \n");
-	servaddr.sin_port = htons(PORT);
-	//printf("main5 \n");
-	//printf("%s", argv[1]);
-	//printf("\n");
-	Inet_aton(argv[1], &servaddr.sin_addr);
-	//printf("main6 \n");
-	//printf(argv[1]);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Проверка ответов (-V).
+ *
+ * Каждый ответ проверяется по мере чтения, без копирования: рамка
+ * (ровно одно сообщение, завершенное '\n', на запрос), алфавит (только
+ * 'a'..'z'), длина (в пределах распределения -s, если оно задано) и
+ * содержимое. Содержимое известно заранее, когда сервер отдает
+ * сообщения из запаса (server3 -R): клиент строит тот же запас по
+ * -S (--seed сервера), -R и -s, по первым 8 буквам ответа находит
+ * ожидаемое сообщение и дальше сравнивает ответ с ним побайтно.
+ *
+ * Буквы проверяются по 64 байта за раз (SSE2), сравнение - memcmp(),
+ * так что проверка успевает за потоком ответов и не занижает измерения.
+ */
+static int validate = 0;
+static const char *size_spec = NULL;	/* -s: распределение длин сервера. */
+static uint64_t seed;			/* -S: --seed сервера. */
+static int seeded = 0;
+static long reserve_n = 0;		/* -R: запас сервера; 0 - без проверки содержимого. */
+
+#define CHECK_HEAD 8		/* Букв, по которым ищется ожидаемое сообщение. */
+
+struct check {
+	uint64_t len;		/* Байтов текущего сообщения. */
+	uint64_t head;		/* Его первые буквы, пока их меньше CHECK_HEAD. */
+	const char *expect;	/* Ожидаемое сообщение из запаса, */
+	uint64_t expect_len;	/* его длина. */
+	int looked;		/* Ожидаемое уже искали. */
+	int bad;		/* Нарушения текущего сообщения. */
+	long messages, invalid;
+	long bad_frame, bad_length, bad_charset, bad_content;
+};
+
+enum { BAD_CHARSET = 1, BAD_LENGTH = 2, BAD_CONTENT = 4 };
+
+/* Число букв 'a'..'z' в начале p[0..n). */
+static size_t letters_prefix(const char *p, size_t n)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i a = _mm_set1_epi8('a'), z = _mm_set1_epi8('z' - 'a');
+	__m128i v0, v1, v2, v3;
+
+	/* Буква, если x - 'a' без знака не больше 25. */
+#define LETTERS(v) _mm_cmpeq_epi8(_mm_max_epu8(_mm_sub_epi8(v, a), z), z)
+	for(; i + 64 <= n; i += 64) {
+		v0 = LETTERS(_mm_loadu_si128((const __m128i *) (p + i)));
+		v1 = LETTERS(_mm_loadu_si128((const __m128i *) (p + i + 16)));
+		v2 = LETTERS(_mm_loadu_si128((const __m128i *) (p + i + 32)));
+		v3 = LETTERS(_mm_loadu_si128((const __m128i *) (p + i + 48)));
+		if(_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(v0, v1), _mm_and_si128(v2, v3))) != 0xffff)
+			break;
+	}
+	for(; i + 16 <= n; i += 16) {
+		int m = _mm_movemask_epi8(LETTERS(_mm_loadu_si128((const __m128i *) (p + i))));
+
+		if(m != 0xffff) return i + __builtin_ctz(~m);
+	}
+#undef LETTERS
+#endif
+	while(i < n && (unsigned char) (p[i] - 'a') <= 'z' - 'a') i++;
+	return i;
+}
+
+/*
+ * Запас сервера: сообщения подряд, как в server3, и открытая адресация
+ * по первым CHECK_HEAD буквам (у коротких - по всему сообщению и длине).
+ * Запас строится так же, как в server3 reserve_init().
+ */
+static char *reserve_base;
+static size_t *reserve_off;
+static long *reserve_slots;	/* Номер сообщения + 1; 0 - свободно. */
+static size_t reserve_mask;
+
+static uint64_t head_key(uint64_t head, uint64_t len)
+{
+	return splitmix64(head ^ (len < CHECK_HEAD ? len : CHECK_HEAD) << 56);
+}
+
+static uint64_t msg_head(const char *p, size_t len)
+{
+	uint64_t h = 0;
+
+	memcpy(&h, p, len < CHECK_HEAD ? len : CHECK_HEAD);
+	return h;
+}
+
+/* Ожидаемое сообщение по первым буквам; len - сколько их (не больше CHECK_HEAD). */
+static long reserve_find(uint64_t head, uint64_t len)
+{
+	size_t i, l;
+	long k;
+
+	for(i = head_key(head, len) & reserve_mask; (k = reserve_slots[i]); i = (i + 1) & reserve_mask) {
+		l = reserve_off[k] - reserve_off[k - 1] - 1;
+		if(msg_head(reserve_base + reserve_off[k - 1], l) == head &&
+			(l < CHECK_HEAD ? l : CHECK_HEAD) == len) return k - 1;
+	}
+	return -1;
+}
+
+static void reserve_build(void)
+{
+	struct rng r;
+	size_t total = 0, size, i, j, len;
+	uint64_t head;
+
+	rng_seed(&r, seed, ~0ULL);
+	reserve_off = Malloc(sizeof(size_t) * (reserve_n + 1));
+	for(i = 0; i < (size_t) reserve_n; i++) {
+		reserve_off[i] = total;
+		total += message_length(&r) + 1;
+	}
+	reserve_off[reserve_n] = total;
+	reserve_base = Malloc(total ? total : 1);
+	for(size = 2; size < 2 * (size_t) reserve_n; size *= 2);
+	reserve_slots = Malloc(size * sizeof(*reserve_slots));
+	memset(reserve_slots, 0, size * sizeof(*reserve_slots));
+	reserve_mask = size - 1;
+	for(i = 0; i < (size_t) reserve_n; i++) {
+		len = reserve_off[i + 1] - reserve_off[i] - 1;
+		make_message(&r, reserve_base + reserve_off[i], len);
+		/* Из совпадающих по началу остается первое. */
+		head = msg_head(reserve_base + reserve_off[i], len);
+		if(reserve_find(head, len < CHECK_HEAD ? len : CHECK_HEAD) != -1) continue;
+		for(j = head_key(head, len) & reserve_mask; reserve_slots[j]; j = (j + 1) & reserve_mask);
+		reserve_slots[j] = i + 1;
+	}
+}
+
+static void check_init(void)
+{
+	if(size_spec != NULL && size_parse(size_spec) == -1) show_usage();
+	if(reserve_n) reserve_build();
+}
+
+static void check_reset(struct check *c)
+{
+	c->len = 0;
+	c->head = 0;
+	c->expect = NULL;
+	c->looked = 0;
+	c->bad = 0;
+}
+
+/* Найти ожидаемое сообщение по прочитанному началу. */
+static void check_lookup(struct check *c)
+{
+	long k;
+
+	c->looked = 1;
+	k = reserve_find(c->head, c->len);
+	if(k == -1) {
+		c->bad |= BAD_CONTENT;
+		return;
+	}
+	c->expect = reserve_base + reserve_off[k];
+	c->expect_len = reserve_off[k + 1] - reserve_off[k] - 1;
+	if(c->len < CHECK_HEAD && c->len != c->expect_len) {
+		c->bad |= BAD_CONTENT;
+		c->expect = NULL;
+	}
+}
+
+/* Сообщение завершено '\n'. */
+static void check_end(struct check *c)
+{
+	if(reserve_n && !c->looked) check_lookup(c);
+	if(c->expect != NULL && c->len != c->expect_len) c->bad |= BAD_CONTENT;
+	if(size_spec != NULL && (c->len < size_dist.min || c->len > size_dist.max)) c->bad |= BAD_LENGTH;
+	c->messages++;
+	if(c->bad) {
+		c->invalid++;
+		if(c->bad & BAD_CHARSET) c->bad_charset++;
+		if(c->bad & BAD_LENGTH) c->bad_length++;
+		if(c->bad & BAD_CONTENT) c->bad_content++;
+	}
+	check_reset(c);
+}
+
+static void check_bytes(struct check *c, const char *p, size_t n)
+{
+	size_t k;
+
+	while(n) {
+		if(c->expect != NULL) {
+			/* Ожидаемое известно: сравнить с ним и проверить конец. */
+			k = c->expect_len - c->len;
+			if(k > n) k = n;
+			if(memcmp(p, c->expect + c->len, k)) {
+				c->bad |= BAD_CONTENT;
+				c->expect = NULL;
+				continue;
+			}
+			c->len += k;
+			p += k;
+			n -= k;
+			if(!n) break;
+			if(*p != '\n') {
+				c->bad |= BAD_CONTENT;
+				c->expect = NULL;
+				continue;
+			}
+			check_end(c);
+			p++;
+			n--;
+			continue;
+		}
+		/* Пока ожидаемое не найдено, первые буквы копятся в head. */
+		k = n;
+		if(reserve_n && !c->looked && k > CHECK_HEAD - c->len) k = CHECK_HEAD - c->len;
+		k = letters_prefix(p, k);
+		if(reserve_n && !c->looked) memcpy((char *) &c->head + c->len, p, k);
+		c->len += k;
+		p += k;
+		n -= k;
+		if(reserve_n && !c->looked && c->len == CHECK_HEAD) {
+			check_lookup(c);
+			continue;
+		}
+		if(!n) break;
+		if(*p == '\n') {
+			check_end(c);
+		} else {
+			c->len++;
+			c->bad |= BAD_CHARSET;
+			if(reserve_n && !c->looked) check_lookup(c);
+		}
+		p++;
+		n--;
+	}
+}
+
+/*
+ * Ответ на запрос прочитан целиком: в нем должно быть ровно одно
+ * сообщение и ничего после него. Иначе рамка нарушена, и проверка
+ * начинается заново со следующего ответа.
+ */
+static void check_reply(struct check *c, long before)
+{
+	if(c->messages - before == 1 && !c->len) return;
+	c->bad_frame++;
+	if(c->messages == before) c->invalid++;
+	check_reset(c);
+}
+
+static void check_add(struct check *sum, const struct check *c)
+{
+	sum->messages += c->messages;
+	sum->invalid += c->invalid;
+	sum->bad_frame += c->bad_frame;
+	sum->bad_length += c->bad_length;
+	sum->bad_charset += c->bad_charset;
+	sum->bad_content += c->bad_content;
+}
+
+/*
+ * Состояние одного потока нагрузки. Задержки копятся в собственном
+ * массиве потока и объединяются только после завершения измерения.
+ */
+struct loader {
+	pthread_t thread;
+	int id;
+	struct sockaddr_in *addr;
+	uint64_t *lat;		/* Задержки запросов, нс. */
+	size_t nlat, cap;
+	uint64_t bytes;
+	long errors;
+	struct check check;	/* Проверка ответов (-V). */
+	uint64_t *plat;		/* Несколько серверов: задержки без дублей, */
+	size_t nplat, pcap;
+	uint64_t *win;		/* окно для порога дублирования */
+	size_t nwin;
+	uint64_t delay;		/* и сам порог, нс. */
+	long hedged;		/* Отправлено дублей. */
+	struct rng rng;		/* Пул: разброс пауз переподключения. */
+	int conns;		/* --uring: соединений у потока */
+	long enters;		/* и его вызовов io_uring_enter(). */
+};
+
+static volatile int measuring;	/* 0 - прогрев, 1 - измерение, 2 - стоп. */
+static long requests_left;	/* Остаток запросов при заданном -n. */
+
+static int take_request(void)
+{
+	if(measuring == 2) return 0;
+	if(!nreq || !measuring) return 1;
+	return __atomic_sub_fetch(&requests_left, 1, __ATOMIC_RELAXED) >= 0;
+}
+
+static void record(struct loader *l, uint64_t lat, size_t bytes)
+{
+	if(measuring != 1) return;
+	if(l->nlat == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 4096;
+		l->lat = realloc(l->lat, l->cap * sizeof(*l->lat));
+		if(l->lat == NULL) error("realloc()");
+	}
+	l->lat[l->nlat++] = lat;
+	l->bytes += bytes;
+}
+
+/* Сокет генератора нагрузки с настройками -o. */
+static int load_socket(void)
+{
+	int s;
+
+	s = socket(PF_INET, SOCK_STREAM, 0);
+	if(s == -1) error("socket()");
+	/* Ответ без keep-alive читается до закрытия соединения сервером;
+	клиент закрывает соединение, только получив ответ. */
+	if(tune_apply(s, tune, (keepalive ? 0 : TUNE_READ_EOF) | TUNE_RESET_CLOSE) == -1)
+		error("setsockopt()");
+	return s;
+}
+
+/*
+ * Соединиться с сервером. Ошибки здесь не фатальны: генератор
+ * учитывает их и продолжает работу.
+ */
+static int load_connect(struct loader *l, struct sockaddr_in *addr)
+{
+	int s = load_socket();
+
+	if(connect(s, (SA *) addr, sizeof(*addr)) == -1) {
+		close(s);
+		if(measuring == 1) l->errors++;
+		return -1;
+	}
+	return s;
+}
+
+/*
+ * Прочитать ответ до завершающего '\n' (или до конца потока, если
+ * until_eof) и проверить его, если задано c. Возвращает число байтов
+ * ответа, -1 при ошибке.
+ */
+static ssize_t read_reply(int s, int until_eof, struct check *c)
+{
+	char buf[65536];
+	ssize_t rc, total = 0;
+	long before = c != NULL ? c->messages : 0;
 
+	for(;;) {
+		rc = read(s, buf, sizeof(buf));
+		if(rc == -1) {
+			if(errno == EINTR) continue;
+			break;
+		}
+		if(rc == 0) {
+			if(!until_eof || !total) break;
+			if(c != NULL) check_reply(c, before);
+			return total;
+		}
+		total += rc;
+		if(c != NULL) check_bytes(c, buf, rc);
+		if(!until_eof && buf[rc - 1] == '\n') {
+			if(c != NULL) check_reply(c, before);
+			return total;
+		}
+	}
+	if(c != NULL) check_reset(c);
+	return -1;
+}
+
+static void *load_thread(void *arg)
+{
+	struct loader *l = arg;
+	struct check *c = validate ? &l->check : NULL;
+	uint64_t t0;
+	ssize_t rc;
+	long uses = 0;
+	int s = -1;
+
+	while(take_request()) {
+		t0 = now_ns();
+		if(!keepalive) {
+			/* Одно сообщение на соединение: сервер закрывает его сам. */
+			s = load_connect(l, l->addr);
+			if(s == -1) continue;
+			rc = read_reply(s, 1, c);
+			close(s);
+			s = -1;
+		} else {
+			if(s == -1) {
+				if((s = load_connect(l, l->addr)) == -1) continue;
+				uses = 0;
+			}
+			rc = -1;
+			if(write(s, "\n", 1) == 1) rc = read_reply(s, 0, c);
+			/* --conn-requests без пула: новое соединение на пути запроса. */
+			if(rc == -1 || ++uses == conn_requests) {
+				close(s);
+				s = -1;
+			}
+		}
+		if(rc == -1) {
+			if(measuring == 1) l->errors++;
+			continue;
+		}
+		record(l, now_ns() - t0, rc);
+	}
+	if(s != -1) close(s);
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *v, size_t n, double q)
+{
+	size_t i;
+
+	if(!n) return 0;
+	i = (size_t) (q * (n - 1) + 0.5);
+	return v[i] / 1e3;
+}
+
+/* Тысячи соединений: предел дескрипторов - до жесткого. */
+static void raise_nofile(void)
+{
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * Несколько серверов (ip_address[:port] ...).
+ *
+ * Запрос уходит сразу на -F серверов (по умолчанию на один; первый
+ * сервер у запросов потока сменяется по кругу), засчитывается первый
+ * ответ. С -H запрос, на который нет ответа дольше порога, дублируется
+ * еще одному серверу. Порог - 95-й перцентиль последних задержек потока
+ * (или --hedge-delay): дубль получает примерно каждый двадцатый запрос,
+ * а хвост задержек определяется лучшим из двух ответов.
+ *
+ * Соединения постоянные (-k), ответы на каждом идут по порядку
+ * запросов, так что опоздавшие ответы просто дочитываются. Задержка
+ * ответа первого из выбранных серверов учитывается отдельно: это
+ * задержка, которая была бы без дублей, и отчет сравнивает ее хвост
+ * с итоговым.
+ */
+#define HEDGE_WINDOW 512	/* Задержек в окне для порога. */
+#define HEDGE_EVERY 64		/* Порог пересчитывается через столько ответов. */
+
+struct flight {
+	uint64_t seq;		/* Номер запроса в потоке. */
+	uint64_t t0;		/* Начало запроса. */
+	int primary;		/* Первый из выбранных серверов. */
+	int measured;		/* Запрос отправлен во время измерения. */
+};
+
+struct target {
+	int fd;
+	struct flight *q;	/* Запросы в полете, по порядку отправки. */
+	size_t head, n, cap;
+	struct check check;
+};
+
+static void record_primary(struct loader *l, uint64_t lat)
+{
+	if(l->nplat == l->pcap) {
+		l->pcap = l->pcap ? l->pcap * 2 : 4096;
+		l->plat = realloc(l->plat, l->pcap * sizeof(*l->plat));
+		if(l->plat == NULL) error("realloc()");
+	}
+	l->plat[l->nplat++] = lat;
+}
+
+/* Закрыть соединение; возвращает, сколько в нем было запросов cur. */
+static int target_close(struct target *t, uint64_t cur)
+{
+	int lost = 0;
+
+	for(; t->n; t->n--, t->head = (t->head + 1) % t->cap)
+		if(t->q[t->head].seq == cur) lost++;
+	close(t->fd);
+	t->fd = -1;
+	t->head = 0;
+	check_reset(&t->check);
+	return lost;
+}
+
+static int target_send(struct loader *l, struct target *t, int server, const struct flight *f)
+{
+	struct flight *q;
+	size_t i;
+
+	if(t->fd == -1) {
+		if((t->fd = load_connect(l, &servers[server])) == -1) return -1;
+		/* Запросы идут, пока на предыдущие нет ответа: без Nagle. */
+		if(tune_set(t->fd, IPPROTO_TCP, TCP_NODELAY, 1) == -1) error("setsockopt()");
+	}
+	if(write(t->fd, "\n", 1) != 1) {
+		target_close(t, 0);
+		if(measuring == 1) l->errors++;
+		return -1;
+	}
+	if(t->n == t->cap) {
+		q = Malloc((t->cap ? t->cap * 2 : 16) * sizeof(*q));
+		for(i = 0; i < t->n; i++) q[i] = t->q[(t->head + i) % t->cap];
+		free(t->q);
+		t->q = q;
+		t->head = 0;
+		t->cap = t->cap ? t->cap * 2 : 16;
+	}
+	t->q[(t->head + t->n++) % t->cap] = *f;
+	return 0;
+}
+
+/* Учесть задержку ответа в окне и, если пора, пересчитать порог. */
+static void hedge_update(struct loader *l, uint64_t lat)
+{
+	uint64_t v[HEDGE_WINDOW];
+	size_t n;
+
+	l->win[l->nwin++ % HEDGE_WINDOW] = lat;
+	if(hedge_delay > 0 || l->nwin % HEDGE_EVERY) return;
+	n = l->nwin < HEDGE_WINDOW ? l->nwin : HEDGE_WINDOW;
+	memcpy(v, l->win, n * sizeof(*v));
+	qsort(v, n, sizeof(*v), cmp_u64);
+	l->delay = v[n * 95 / 100];
+}
+
+/*
+ * Дождаться ответов (не дольше, чем до deadline, или секунды, если
+ * deadline 0) и разобрать их. live - число запросов cur в полете.
+ * Возвращает 1, если пришел первый ответ на cur.
+ */
+static int multi_poll(struct loader *l, struct target *ts, struct pollfd *pfd,
+	uint64_t deadline, uint64_t cur, int *live)
+{
+	char buf[65536], *p, *q, *end;
+	struct timespec tmo;
+	struct flight *f;
+	struct target *t;
+	uint64_t now, wait;
+	int i, n = 0, won = 0;
+	ssize_t rc;
+	long before;
+
+	for(i = 0; i < nservers; i++) {
+		if(ts[i].fd == -1 || !ts[i].n) continue;
+		pfd[n].fd = ts[i].fd;
+		pfd[n++].events = POLLIN;
+	}
+	if(!n) return 0;
+	now = now_ns();
+	wait = !deadline ? 1000000000 : deadline > now ? deadline - now : 0;
+	tmo.tv_sec = wait / 1000000000;
+	tmo.tv_nsec = wait % 1000000000;
+	if(ppoll(pfd, n, &tmo, NULL) <= 0) return 0;
+
+	now = now_ns();
+	for(i = 0, n = 0; i < nservers; i++) {
+		t = &ts[i];
+		if(t->fd == -1 || !t->n) continue;
+		if(!pfd[n++].revents) continue;
+		rc = read(t->fd, buf, sizeof(buf));
+		if(rc <= 0) {
+			if(rc == -1 && errno == EINTR) continue;
+			*live -= target_close(t, cur);
+			if(measuring == 1) l->errors++;
+			continue;
+		}
+		if(measuring == 1) l->bytes += rc;
+		end = buf + rc;
+		/* Каждый '\n' завершает ответ на очередной запрос; -V проверяет
+		рамку каждого ответа, как и в одиночном режиме. */
+		for(p = q = buf; t->n && (p = memchr(p, '\n', end - p)) != NULL; q = ++p) {
+			if(validate) {
+				before = t->check.messages;
+				check_bytes(&t->check, q, p + 1 - q);
+				check_reply(&t->check, before);
+			}
+			f = &t->q[t->head];
+			t->head = (t->head + 1) % t->cap;
+			t->n--;
+			if(f->primary && f->measured) record_primary(l, now - f->t0);
+			if(f->seq != cur) continue;
+			(*live)--;
+			if(!won) {
+				won = 1;
+				record(l, now - f->t0, 0);
+				if(hedge) hedge_update(l, now - f->t0);
+			}
+		}
+		if(validate && q < end) {
+			check_bytes(&t->check, q, end - q);
+			/* Байты сверх ответов на отправленные запросы. */
+			if(!t->n) check_reply(&t->check, t->check.messages);
+		}
+	}
+	return won;
+}
+
+static void *multi_thread(void *arg)
+{
+	struct loader *l = arg;
+	struct target *ts;
+	struct pollfd *pfd;
+	struct flight f;
+	uint64_t seq = 0, hedge_at, deadline;
+	int i, k, next, live, done, pending;
+
+	ts = Malloc(nservers * sizeof(*ts));
+	memset(ts, 0, nservers * sizeof(*ts));
+	pfd = Malloc(nservers * sizeof(*pfd));
+	for(i = 0; i < nservers; i++) {
+		ts[i].fd = -1;
+		check_reset(&ts[i].check);
+	}
+	l->win = Malloc(HEDGE_WINDOW * sizeof(*l->win));
+	l->delay = hedge_delay * 1e3;
+
+	while(take_request()) {
+		f.seq = ++seq;
+		f.t0 = now_ns();
+		f.measured = measuring == 1;
+		next = (l->id + seq) % nservers;
+		for(k = 0, live = 0; k < nservers && live < fanout; k++, next = (next + 1) % nservers) {
+			f.primary = !live;
+			if(target_send(l, &ts[next], next, &f) == 0) live++;
+		}
+		hedge_at = hedge && l->delay && k < nservers ? f.t0 + l->delay : 0;
+		for(done = 0; !done && live; ) {
+			if(hedge_at && now_ns() >= hedge_at) {
+				/* Дубль - следующему серверу, который примет запрос. */
+				hedge_at = 0;
+				f.primary = 0;
+				for(; k < nservers; k++, next = (next + 1) % nservers) {
+					if(target_send(l, &ts[next], next, &f) == -1) continue;
+					live++;
+					if(f.measured) l->hedged++;
+					break;
+				}
+			}
+			done = multi_poll(l, ts, pfd, hedge_at, f.seq, &live);
+			/* Не ждать без конца ответа, которого уже не будет. */
+			if(measuring == 2 && now_ns() - f.t0 > 1000000000) break;
+		}
+		if(!done && measuring == 1) l->errors++;
+	}
+
+	/* Дочитать опоздавшие ответы: они нужны для задержки без дублей. */
+	deadline = now_ns() + 1000000000;
+	for(;;) {
+		for(i = 0, pending = 0; i < nservers; i++) pending += ts[i].fd != -1 && ts[i].n;
+		if(!pending || now_ns() >= deadline) break;
+		multi_poll(l, ts, pfd, deadline, 0, &live);
+	}
+	for(i = 0; i < nservers; i++) {
+		if(ts[i].fd != -1) close(ts[i].fd);
+		check_add(&l->check, &ts[i].check);
+		free(ts[i].q);
+	}
+	free(l->win);
+	free(pfd);
+	free(ts);
+
+	return NULL;
+}
+
+/*
+ * Пул соединений (-P).
+ *
+ * Для каждого сервера пул держит -P открытых соединений. Запрос берет
+ * готовое соединение, а после ответа возвращает его в пул; соединение,
+ * отслужившее --conn-requests запросов, закрывается. Недостающие
+ * соединения открывает отдельный поток, так что установка соединения
+ * не попадает на путь запроса, пока в пуле есть готовые (иначе
+ * соединение открывается на месте и учитывается как промах, а лишнее
+ * после запроса закрывается).
+ *
+ * Сервер выбирается наименее загруженный: с наименьшим ожидаемым
+ * временем (запросов в полете + 1) * EWMA задержки. Сервер, к которому
+ * не удалось подключиться или запрос к которому не удался, считается
+ * недоступным: его готовые соединения закрываются, а поток пула
+ * пробует подключиться снова через экспоненциально растущую паузу со
+ * случайным разбросом, чтобы клиенты не ломились к серверу разом.
+ */
+#define POOL_BACKOFF_MIN 10000000ULL	/* Первая пауза, нс. */
+#define POOL_BACKOFF_MAX 1000000000ULL	/* Предел паузы, нс. */
+#define POOL_EWMA_SHIFT 3		/* Вес нового замера 1/8, как у RTT в TCP. */
+
+struct pooled {
+	int fd;
+	long uses;			/* Запросов через соединение. */
+};
+
+struct endpoint {
+	pthread_mutex_t lock;
+	struct pooled *idle;		/* Готовые соединения (стек). */
+	int nidle;
+	int open;			/* Открыто соединений пула, готовых и взятых. */
+	int inflight;			/* Взято соединений. */
+	uint64_t ewma;			/* Задержка, нс. */
+	int up;
+	int fails;			/* Неудач подряд. */
+	uint64_t retry_at;		/* Следующая попытка, если сервер недоступен. */
+	long requests, misses, connects, connect_fails;
+};
+
+static struct {
+	struct endpoint *ep;
+	pthread_t keeper;
+	pthread_mutex_t lock;		/* Для cond. */
+	pthread_cond_t cond;		/* Соединение закрыто, пул просит пополнения. */
+	int stop;
+	struct rng rng;			/* Разброс пауз; только у потока пула. */
+} pool;
+
+static void pool_kick(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* Сервер недоступен: закрыть готовые соединения и отложить попытки. */
+static void pool_down(struct endpoint *e, uint64_t now, uint64_t jitter)
+{
+	uint64_t d;
+
+	e->up = 0;
+	e->fails++;
+	d = e->fails > 7 ? POOL_BACKOFF_MAX : POOL_BACKOFF_MIN << (e->fails - 1);
+	if(d > POOL_BACKOFF_MAX) d = POOL_BACKOFF_MAX;
+	/* Половина паузы постоянна, половина случайна. */
+	e->retry_at = now + d / 2 + jitter % (d / 2 + 1);
+	while(e->nidle) {
+		close(e->idle[--e->nidle].fd);
+		e->open--;
+	}
+}
+
+static int pool_connect(struct sockaddr_in *addr)
+{
+	int s;
+
+	s = socket(PF_INET, SOCK_STREAM, 0);
+	if(s == -1) error("socket()");
+	if(tune_apply(s, tune, TUNE_RESET_CLOSE) == -1) error("setsockopt()");
+	if(connect(s, (SA *) addr, sizeof(*addr)) == -1) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/* Поток пула: пополнять пулы доступных серверов и проверять недоступные. */
+static void *pool_keeper(void *arg)
+{
+	struct endpoint *e;
+	struct timespec ts;
+	uint64_t now, wake;
+	int i, s, need;
+
+	(void) arg;
+	pthread_mutex_lock(&pool.lock);
+	while(!pool.stop) {
+		pthread_mutex_unlock(&pool.lock);
+		now = now_ns();
+		wake = now + 100000000;
+		for(i = 0; i < nservers; i++) {
+			e = &pool.ep[i];
+			pthread_mutex_lock(&e->lock);
+			if(!e->up && now < e->retry_at) {
+				if(e->retry_at < wake) wake = e->retry_at;
+				pthread_mutex_unlock(&e->lock);
+				continue;
+			}
+			need = pool_size - e->open;
+			pthread_mutex_unlock(&e->lock);
+			for(; need > 0; need--) {
+				s = pool_connect(&servers[i]);
+				pthread_mutex_lock(&e->lock);
+				if(s == -1) {
+					e->connect_fails++;
+					pool_down(e, now_ns(), rng_next(&pool.rng));
+					if(e->retry_at < wake) wake = e->retry_at;
+					pthread_mutex_unlock(&e->lock);
+					break;
+				}
+				e->connects++;
+				e->open++;
+				e->up = 1;
+				e->fails = 0;
+				e->idle[e->nidle].fd = s;
+				e->idle[e->nidle++].uses = 0;
+				pthread_mutex_unlock(&e->lock);
+			}
+		}
+		/* Проснуться к ближайшей попытке или по просьбе о пополнении. */
+		ts.tv_sec = wake / 1000000000;
+		ts.tv_nsec = wake % 1000000000;
+		pthread_mutex_lock(&pool.lock);
+		if(!pool.stop) pthread_cond_timedwait(&pool.cond, &pool.lock, &ts);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+static void pool_start(void)
+{
+	pthread_condattr_t ca;
+	uint64_t deadline;
+	int i, ready;
+
+	pool.ep = Malloc(nservers * sizeof(*pool.ep));
+	memset(pool.ep, 0, nservers * sizeof(*pool.ep));
+	for(i = 0; i < nservers; i++) {
+		pthread_mutex_init(&pool.ep[i].lock, NULL);
+		/* Вернуть соединения могут все потоки сразу. */
+		pool.ep[i].idle = Malloc((pool_size + conc) * sizeof(struct pooled));
+		pool.ep[i].up = 1;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	/* Таймер потока пула - по монотонным часам, как now_ns(). */
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool.cond, &ca);
+	rng_seed(&pool.rng, now_ns(), getpid());
+	Pthread_create(&pool.keeper, NULL, pool_keeper, NULL);
+
+	/* Дождаться, пока пулы наполнятся (или серверы окажутся недоступны). */
+	deadline = now_ns() + 1000000000;
+	do {
+		usleep(1000);
+		for(i = 0, ready = 0; i < nservers; i++)
+			ready += pool.ep[i].nidle >= pool_size || !pool.ep[i].up;
+	} while(ready < nservers && now_ns() < deadline);
+}
+
+static void pool_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+	pthread_join(pool.keeper, NULL);
+	for(i = 0; i < nservers; i++)
+		while(pool.ep[i].nidle) close(pool.ep[i].idle[--pool.ep[i].nidle].fd);
+}
+
+/*
+ * Взять соединение у наименее загруженного доступного сервера.
+ * Возвращает номер сервера, -1 - если доступных нет.
+ */
+static int pool_acquire(struct loader *l, uint64_t seq, struct pooled *c)
+{
+	struct endpoint *e;
+	uint64_t score, best_score = 0;
+	int i, k, best = -1, spare = 0;
+
+	/*
+	 * Оценка без блокировок: поля читаются на ходу, неточность
+	 * только сдвигает выбор. Поровну - по кругу, чтобы потоки не
+	 * выбирали один и тот же сервер.
+	 */
+	for(k = 0; k < nservers; k++) {
+		i = (l->id + seq + k) % nservers;
+		e = &pool.ep[i];
+		if(!e->up) continue;
+		score = (e->inflight + 1) * (e->ewma + 1);
+		/* Сервер с готовым соединением лучше сервера без него. */
+		if(best == -1 || (e->nidle > 0) > spare || ((e->nidle > 0) == spare && score < best_score)) {
+			best = i;
+			best_score = score;
+			spare = e->nidle > 0;
+		}
+	}
+	if(best == -1) return -1;
+
+	e = &pool.ep[best];
+	pthread_mutex_lock(&e->lock);
+	e->inflight++;
+	if(e->nidle) {
+		*c = e->idle[--e->nidle];
+		pthread_mutex_unlock(&e->lock);
+		return best;
+	}
+	e->misses++;
+	e->open++;
+	pthread_mutex_unlock(&e->lock);
+
+	/* Пул пуст: соединение открывается на пути запроса. */
+	c->fd = pool_connect(&servers[best]);
+	c->uses = 0;
+	if(c->fd != -1) return best;
+	pthread_mutex_lock(&e->lock);
+	e->inflight--;
+	e->open--;
+	e->connect_fails++;
+	pthread_mutex_unlock(&e->lock);
+	return -1;
+}
+
+/* Вернуть соединение; lat - задержка запроса, -1 - запрос не удался. */
+static void pool_release(struct loader *l, int i, struct pooled *c, int64_t lat)
+{
+	struct endpoint *e = &pool.ep[i];
+
+	pthread_mutex_lock(&e->lock);
+	e->inflight--;
+	if(lat < 0) {
+		close(c->fd);
+		e->open--;
+		if(e->up) pool_down(e, now_ns(), rng_next(&l->rng));
+		pthread_mutex_unlock(&e->lock);
+		pool_kick();
+		return;
+	}
+	e->requests++;
+	/* ewma += (lat - ewma) / 8 */
+	e->ewma = e->ewma ? e->ewma + ((int64_t) (lat - e->ewma) >> POOL_EWMA_SHIFT) : (uint64_t) lat;
+	if(++c->uses == conn_requests || !e->up || e->open > pool_size) {
+		close(c->fd);
+		e->open--;
+		pthread_mutex_unlock(&e->lock);
+		pool_kick();
+		return;
+	}
+	e->idle[e->nidle++] = *c;
+	pthread_mutex_unlock(&e->lock);
+}
+
+static void *pool_thread(void *arg)
+{
+	struct loader *l = arg;
+	struct check *chk = validate ? &l->check : NULL;
+	struct pooled c;
+	uint64_t seq = 0, t0;
+	ssize_t rc;
+	int i;
+
+	rng_seed(&l->rng, now_ns(), l->id);
+	while(take_request()) {
+		t0 = now_ns();
+		i = pool_acquire(l, ++seq, &c);
+		if(i == -1) {
+			if(measuring == 1) l->errors++;
+			/* Все серверы недоступны: не крутиться вхолостую. */
+			usleep(1000);
+			continue;
+		}
+		rc = -1;
+		if(write(c.fd, "\n", 1) == 1) rc = read_reply(c.fd, 0, chk);
+		pool_release(l, i, &c, rc == -1 ? -1 : (int64_t) (now_ns() - t0));
+		if(rc == -1) {
+			if(measuring == 1) l->errors++;
+			continue;
+		}
+		record(l, now_ns() - t0, rc);
+	}
+
+	return NULL;
+}
+
+/* Итог пула по серверам - в stderr, JSON получает суммы. */
+static void pool_report(long *misses, long *reconnects)
+{
+	struct endpoint *e;
+	int i;
+
+	for(i = 0; i < nservers; i++) {
+		e = &pool.ep[i];
+		fprintf(stderr, "pool: %s:%d requests %ld ewma %.1f us misses %ld connects %ld failed %ld%s\n",
+			inet_ntoa(servers[i].sin_addr), ntohs(servers[i].sin_port), e->requests,
+			e->ewma / 1e3, e->misses, e->connects, e->connect_fails, e->up ? "" : " (down)");
+		*misses += e->misses;
+		/* Сверх начального наполнения. */
+		*reconnects += e->connects > pool_size ? e->connects - pool_size : 0;
+	}
+}
+
+/*
+ * Движок io_uring (--uring N): N потоков, у каждого свое кольцо и своя
+ * доля из -c постоянных соединений. Поток не делает системного вызова
+ * на операцию:
+ *  - прием - multishot recv, один на соединение на все время: ядро само
+ *    берет буфер из зарегистрированного кольца предоставленных буферов
+ *    (IORING_REGISTER_PBUF_RING) и пишет CQE на каждую порцию данных,
+ *    а буфер возвращается в кольцо простой записью в память;
+ *  - запросы всех соединений, дочитавших ответ, копятся в SQ и уходят
+ *    одним io_uring_enter(), который тут же ждет следующих завершений;
+ *    успешная отправка CQE не дает (IOSQE_CQE_SKIP_SUCCESS);
+ *  - каждое соединение - автомат "connect -> запрос -> ответ -> запрос",
+ *    который двигают только завершения; соединение открывается заново
+ *    после ошибки тоже через кольцо (IORING_OP_CONNECT), так что
+ *    медленный connect() не задерживает остальные. Одновременных
+ *    connect() не больше URING_CONNECTS, остальные ждут в очереди:
+ *    тысяча SYN разом переполняет очередь listen() сервера, и
+ *    отброшенные соединения открываются секундами.
+ * Системные вызовы считаются: в итоге есть enters_per_req.
+ *
+ * Движок собирается, только если <linux/io_uring.h> знает multishot
+ * recv; ядро без него (до 6.0) отвечает на прием EINVAL, и клиент
+ * завершается с сообщением, а не считает каждый прием ошибкой.
+ */
+static int uring_rings = 0;	/* --uring; 0 - поток на соединение. */
+
+#ifdef HAVE_URING
+#define URING_BUF_MEM (64 << 20)	/* Буферы приема одного кольца. */
+#define URING_BGID 0			/* Группа предоставленных буферов. */
+#define URING_WAIT_MS 100		/* Наибольшее ожидание завершений. */
+#define URING_CONNECTS 4		/* connect() кольца в полете. */
+
+enum { UOP_RECV = 1, UOP_SEND, UOP_CONNECT };
+
+struct uconn {
+	int fd;			/* -1 - соединение нужно открыть заново. */
+	uint32_t gen;		/* Растет при закрытии: CQE прежнего сокета - мимо. */
+	int armed;		/* Multishot recv действует. */
+	int busy;		/* Запрос отправлен, ответ не дочитан. */
+	uint64_t t0;		/* Отправка запроса. */
+	size_t got;		/* Байтов ответа. */
+	long before;		/* Сообщений проверки до ответа. */
+	struct check check;
+};
+
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, sq_mask;
+	unsigned *cq_head, *cq_tail, cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned tail;		/* Следующий свободный SQE. */
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	unsigned nbufs, buf_size;
+	unsigned short br_tail;
+	char *ring;		/* Отображения колец SQ/CQ и SQE. */
+	size_t ring_size, sqes_size;
+	struct loader *l;
+	struct uconn *conns;
+	int *fresh, nfresh;	/* Соединения, чьи запросы еще не отправлены. */
+	int *waitq;		/* Очередь на connect(). */
+	unsigned wq_head, wq_tail;
+	int nconnecting;
+	int nbusy;
+	long enters;		/* Вызовов io_uring_enter(). */
+};
+
+static void uring_buf_put(struct uring *u, unsigned bid)
+{
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->nbufs - 1)];
+
+	b->addr = (uintptr_t) (u->bufs + (size_t) bid * u->buf_size);
+	b->len = u->buf_size;
+	b->bid = bid;
+	u->br_tail++;
+}
+
+/* Возвращенные буферы становятся видны ядру. */
+static void uring_buf_publish(struct uring *u)
+{
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_init(struct uring *u, int conns)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	unsigned entries = 8, i, *array;
+
+	while(entries < 2U * conns && entries < 32768) entries *= 2;
+	u->fd = -1;
+	errno = EINVAL;
+#ifdef IORING_SETUP_DEFER_TASKRUN
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	p.cq_entries = 4 * entries;
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+#endif
+	if(u->fd == -1 && errno == EINVAL) {
+		/* До 6.1: завершения доставляются без отложенной работы. */
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = 4 * entries;
+		u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	}
+	if(u->fd == -1) error("io_uring_setup()");
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_CQE_SKIP) ||
+		!(p.features & IORING_FEAT_EXT_ARG)) {
+		fprintf(stderr, "io_uring: kernel too old\n");
+		exit(-1);
+	}
+
+	u->ring_size = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+		p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		u->fd, IORING_OFF_SQ_RING);
+	if(u->ring == MAP_FAILED) error("mmap()");
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		u->fd, IORING_OFF_SQES);
+	if(u->sqes == MAP_FAILED) error("mmap()");
+	u->sq_head = (unsigned *) (u->ring + p.sq_off.head);
+	u->sq_tail = (unsigned *) (u->ring + p.sq_off.tail);
+	u->sq_mask = *(unsigned *) (u->ring + p.sq_off.ring_mask);
+	array = (unsigned *) (u->ring + p.sq_off.array);
+	for(i = 0; i < p.sq_entries; i++) array[i] = i;
+	u->cq_head = (unsigned *) (u->ring + p.cq_off.head);
+	u->cq_tail = (unsigned *) (u->ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned *) (u->ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) (u->ring + p.cq_off.cqes);
+	u->tail = *u->sq_tail;
+
+	/* По два буфера на соединение, всего не больше URING_BUF_MEM. */
+	u->nbufs = 64;
+	while(u->nbufs < 2U * conns && u->nbufs < 32768) u->nbufs *= 2;
+	u->buf_size = URING_BUF_MEM / u->nbufs;
+	if(u->buf_size > 65536) u->buf_size = 65536;
+	if(u->buf_size < 4096) u->buf_size = 4096;
+	u->br = mmap(NULL, u->nbufs * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	u->bufs = mmap(NULL, (size_t) u->nbufs * u->buf_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(u->br == MAP_FAILED || u->bufs == MAP_FAILED) error("mmap()");
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) u->br;
+	reg.ring_entries = u->nbufs;
+	reg.bgid = URING_BGID;
+	if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		error("io_uring_register()");
+	u->br_tail = 0;
+	for(i = 0; i < u->nbufs; i++) uring_buf_put(u, i);
+	uring_buf_publish(u);
+}
+
+/*
+ * Отдать ядру накопленные SQE и, если wait, дождаться хотя бы одного
+ * завершения - все одним вызовом. Ожидание ограничено URING_WAIT_MS,
+ * чтобы поток заметил конец замера, даже если все его соединения
+ * застряли в connect(). Запросы засекаются здесь, перед самой
+ * отправкой.
+ */
+static void uring_submit(struct uring *u, int wait)
+{
+	struct __kernel_timespec ts = { 0, URING_WAIT_MS * 1000000L };
+	struct io_uring_getevents_arg arg = { 0, 0, 0, (uintptr_t) &ts };
+	unsigned n, flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+	uint64_t t = now_ns();
+	int i;
+
+	for(i = 0; i < u->nfresh; i++) u->conns[u->fresh[i]].t0 = t;
+	u->nfresh = 0;
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	n = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	u->enters++;
+	while(syscall(__NR_io_uring_enter, u->fd, n, wait, flags, wait ? &arg : NULL, sizeof(arg)) == -1) {
+		/* EBUSY: CQ переполнена, сначала надо разобрать завершения. */
+		if(errno == EBUSY || errno == EAGAIN || errno == ETIME) break;
+		if(errno != EINTR) error("io_uring_enter()");
+	}
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *u, int i, int op)
+{
+	struct io_uring_sqe *sqe;
+
+	/* SQ заполнена: отдать ее ядру, не дожидаясь завершений. */
+	if(u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > u->sq_mask) uring_submit(u, 0);
+	sqe = &u->sqes[u->tail++ & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = u->conns[i].fd;
+	sqe->user_data = (uint64_t) u->conns[i].gen << 32 | (uint64_t) i << 8 | op;
+	return sqe;
+}
+
+static void uring_arm(struct uring *u, int i)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u, i, UOP_RECV);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	u->conns[i].armed = 1;
+}
+
+static void uring_send(struct uring *u, int i)
+{
+	struct io_uring_sqe *sqe;
+
+	if(!u->conns[i].armed) uring_arm(u, i);
+	sqe = uring_sqe(u, i, UOP_SEND);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->addr = (uintptr_t) "\n";
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+}
+
+static void uring_connect(struct uring *u, int i)
+{
+	struct io_uring_sqe *sqe;
+
+	u->conns[i].fd = load_socket();
+	sqe = uring_sqe(u, i, UOP_CONNECT);
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->addr = (uintptr_t) u->l->addr;
+	sqe->off = sizeof(*u->l->addr);
+	u->nconnecting++;
+}
+
+/*
+ * Следующий запрос соединения i; без запросов соединение простаивает.
+ * Закрытое соединение сначала открывается: запрос уйдет по завершении
+ * connect(), и его задержка, как в load_thread, включает соединение.
+ */
+static void uring_request(struct uring *u, int i)
+{
+	struct uconn *c = &u->conns[i];
+
+	if(!take_request()) return;
+	if(c->fd != -1) uring_send(u, i);
+	else if(u->nconnecting < URING_CONNECTS) uring_connect(u, i);
+	else u->waitq[u->wq_tail++ % u->l->conns] = i;
+	c->busy = 1;
+	c->got = 0;
+	c->before = c->check.messages;
+	u->fresh[u->nfresh++] = i;
+	u->nbusy++;
+}
+
+/* Ошибка соединения: закрыть его и начать следующий запрос с нового. */
+static void uring_fail(struct uring *u, int i)
+{
+	struct uconn *c = &u->conns[i];
+
+	if(measuring == 1) u->l->errors++;
+	if(validate) check_reset(&c->check);
+	/* Прием в кольце держит сокет: shutdown() завершает его. */
+	shutdown(c->fd, SHUT_RDWR);
+	close(c->fd);
+	c->fd = -1;
+	c->gen++;
+	c->armed = 0;
+	if(c->busy) {
+		c->busy = 0;
+		u->nbusy--;
+	}
+	uring_request(u, i);
+}
+
+static void uring_complete(struct uring *u, const struct io_uring_cqe *cqe)
+{
+	int i = (cqe->user_data >> 8) & 0xffffff;
+	struct uconn *c = &u->conns[i];
+	unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	const char *p = u->bufs + (size_t) bid * u->buf_size;
+	char last;
+
+	if((uint32_t) (cqe->user_data >> 32) != c->gen) {
+		if(cqe->flags & IORING_CQE_F_BUFFER) uring_buf_put(u, bid);
+		return;
+	}
+	/* Успешная отправка CQE не дает. */
+	if((cqe->user_data & 0xff) == UOP_SEND) {
+		uring_fail(u, i);
+		return;
+	}
+	if((cqe->user_data & 0xff) == UOP_CONNECT) {
+		u->nconnecting--;
+		if(u->wq_head != u->wq_tail) uring_connect(u, u->waitq[u->wq_head++ % u->l->conns]);
+		if(cqe->res < 0) uring_fail(u, i);
+		else uring_send(u, i);
+		return;
+	}
+	if(!(cqe->flags & IORING_CQE_F_MORE)) c->armed = 0;
+	if(cqe->res == -EINVAL) {
+		fprintf(stderr, "io_uring: multishot recv is not supported by the kernel\n");
+		exit(-1);
+	}
+	if(cqe->res == -ENOBUFS) {
+		/* Буферы кончились: прием снова, когда они вернутся. */
+		uring_arm(u, i);
+		return;
+	}
+	if(cqe->res <= 0 || !c->busy) {
+		if(cqe->flags & IORING_CQE_F_BUFFER) uring_buf_put(u, bid);
+		uring_fail(u, i);
+		return;
+	}
+	c->got += cqe->res;
+	if(validate) check_bytes(&c->check, p, cqe->res);
+	last = p[cqe->res - 1];
+	uring_buf_put(u, bid);
+	if(last != '\n') {
+		if(!c->armed) uring_arm(u, i);
+		return;
+	}
+	c->busy = 0;
+	u->nbusy--;
+	if(validate) check_reply(&c->check, c->before);
+	record(u->l, now_ns() - c->t0, c->got);
+	uring_request(u, i);
+}
+
+static void *uring_thread(void *arg)
+{
+	struct uring u;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	int i;
+
+	memset(&u, 0, sizeof(u));
+	u.l = arg;
+	u.conns = Malloc(u.l->conns * sizeof(*u.conns));
+	memset(u.conns, 0, u.l->conns * sizeof(*u.conns));
+	u.fresh = Malloc(u.l->conns * sizeof(*u.fresh));
+	u.waitq = Malloc(u.l->conns * sizeof(*u.waitq));
+	uring_init(&u, u.l->conns);
+
+	/* Первые запросы всех соединений уходят одним вызовом. */
+	for(i = 0; i < u.l->conns; i++) {
+		u.conns[i].fd = -1;
+		check_reset(&u.conns[i].check);
+		uring_request(&u, i);
+	}
+	/* Конец замера по -d не ждет ответов: они уже не учитываются. */
+	while(u.nbusy && measuring != 2) {
+		uring_submit(&u, 1);
+		head = *u.cq_head;
+		tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++) {
+			cqe = &u.cqes[head & u.cq_mask];
+			uring_complete(&u, cqe);
+		}
+		__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+		uring_buf_publish(&u);
+	}
+
+	/* Закрытие кольца отменяет прием на всех сокетах. */
+	close(u.fd);
+	for(i = 0; i < u.l->conns; i++) {
+		if(u.conns[i].fd != -1) close(u.conns[i].fd);
+		check_add(&u.l->check, &u.conns[i].check);
+	}
+	u.l->enters = u.enters;
+	munmap(u.ring, u.ring_size);
+	munmap(u.sqes, u.sqes_size);
+	munmap(u.bufs, (size_t) u.nbufs * u.buf_size);
+	munmap(u.br, u.nbufs * sizeof(struct io_uring_buf));
+	free(u.waitq);
+	free(u.fresh);
+	free(u.conns);
+	return NULL;
+}
+#else
+/* Не вызывается: без движка --uring отвергается при разборе ключей. */
+static void *uring_thread(void *arg)
+{
+	return arg;
+}
+#endif
+
+void run_load(struct sockaddr_in *addr)
+{
+	struct loader *ls;
+	uint64_t *all, *prim, bytes = 0, sum = 0, t0, t1;
+	size_t n = 0, np = 0, i, k;
+	long errors = 0, hedged = 0, misses = 0, reconnects = 0, enters = 0;
+	double cpu0, cpu1, elapsed, delay = 0;
+	int multi = !pool_size && (nservers > 1 || hedge);
+	/* С --uring поток ведет не одно соединение, а свою долю из -c. */
+	size_t nthreads = uring_rings ? (size_t) uring_rings : (size_t) conc;
+	struct check total;
+
+	memset(&total, 0, sizeof(total));
+	ls = Malloc(nthreads * sizeof(*ls));
+	memset(ls, 0, nthreads * sizeof(*ls));
+	if(validate) {
+		check_init();
+		for(i = 0; i < nthreads; i++) check_reset(&ls[i].check);
+	}
+	if(uring_rings) raise_nofile();
+	requests_left = nreq;
+	measuring = warmup > 0 ? 0 : 1;
+	if(pool_size) pool_start();
+
+	for(i = 0; i < nthreads; i++) {
+		ls[i].id = i;
+		ls[i].addr = addr;
+		ls[i].conns = conc / nthreads + (i < conc % nthreads);
+		Pthread_create(&ls[i].thread, NULL, uring_rings ? uring_thread :
+			pool_size ? pool_thread : multi ? multi_thread : load_thread, &ls[i]);
+	}
+	if(warmup > 0) {
+		usleep(warmup * 1e6);
+		measuring = 1;
+	}
+	t0 = now_ns();
+	cpu0 = cpu_seconds();
+	if(!nreq) {
+		usleep(duration * 1e6);
+		measuring = 2;
+	}
+	for(i = 0; i < nthreads; i++) pthread_join(ls[i].thread, NULL);
+	t1 = now_ns();
+	cpu1 = cpu_seconds();
+	if(pool_size) {
+		pool_stop();
+		pool_report(&misses, &reconnects);
+	}
+
+	for(i = 0; i < nthreads; i++) n += ls[i].nlat;
+	all = Malloc((n ? n : 1) * sizeof(*all));
+	for(i = 0, k = 0; i < nthreads; i++) {
+		memcpy(all + k, ls[i].lat, ls[i].nlat * sizeof(*all));
+		k += ls[i].nlat;
+		bytes += ls[i].bytes;
+		errors += ls[i].errors;
+		check_add(&total, &ls[i].check);
+		np += ls[i].nplat;
+		hedged += ls[i].hedged;
+		delay += ls[i].delay;
+		enters += ls[i].enters;
+		free(ls[i].lat);
+	}
+	qsort(all, n, sizeof(*all), cmp_u64);
+	for(i = 0; i < n; i++) sum += all[i];
+	elapsed = (t1 - t0) / 1e9;
+	prim = Malloc((np ? np : 1) * sizeof(*prim));
+	for(i = 0, k = 0; i < nthreads; i++) {
+		memcpy(prim + k, ls[i].plat, ls[i].nplat * sizeof(*prim));
+		k += ls[i].nplat;
+		free(ls[i].plat);
+	}
+	qsort(prim, np, sizeof(*prim), cmp_u64);
+
+	printf("{\"conc\":%d,\"keepalive\":%d,\"duration_s\":%.3f,"
+		"\"requests\":%zu,\"errors\":%ld,\"bytes\":%llu,"
+		"\"throughput_rps\":%.1f,\"throughput_mbps\":%.3f,"
+		"\"mean_us\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+		"\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+		"\"client_cpu_us_per_msg\":%.3f",
+		conc, keepalive, elapsed, n, errors, (unsigned long long) bytes,
+		n / elapsed, bytes / elapsed / 1e6,
+		n ? sum / 1e3 / n : 0, percentile(all, n, 0.50),
+		percentile(all, n, 0.90), percentile(all, n, 0.99),
+		percentile(all, n, 0.999), n ? all[n - 1] / 1e3 : 0,
+		n ? (cpu1 - cpu0) * 1e6 / n : 0);
+	if(validate) {
+		printf(",\"validated\":%ld,\"invalid\":%ld,\"bad_frame\":%ld,\"bad_length\":%ld,"
+			"\"bad_charset\":%ld,\"bad_content\":%ld",
+			total.messages, total.invalid, total.bad_frame, total.bad_length,
+			total.bad_charset, total.bad_content);
+	}
+	if(multi) {
+		/* Выигрыш хвоста против задержки без дублей. */
+		printf(",\"servers\":%d,\"fanout\":%d,\"hedged\":%ld,\"hedge_delay_us\":%.1f,"
+			"\"primary_p99_us\":%.1f,\"primary_p999_us\":%.1f,"
+			"\"p99_gain_pct\":%.1f,\"p999_gain_pct\":%.1f",
+			nservers, fanout, hedged, delay / conc / 1e3,
+			percentile(prim, np, 0.99), percentile(prim, np, 0.999),
+			np && n ? 100 * (1 - percentile(all, n, 0.99) / percentile(prim, np, 0.99)) : 0,
+			np && n ? 100 * (1 - percentile(all, n, 0.999) / percentile(prim, np, 0.999)) : 0);
+	}
+	if(pool_size) printf(",\"servers\":%d,\"pool\":%d,\"pool_misses\":%ld,\"reconnects\":%ld",
+		nservers, pool_size, misses, reconnects);
+	if(uring_rings) printf(",\"engine\":\"uring\",\"rings\":%d,\"enters_per_req\":%.3f",
+		uring_rings, n ? (double) enters / n : 0);
+	printf("}\n");
+	fflush(stdout);
+	free(prim);
+	free(all);
+	free(ls);
+}
+
+/*
+ * Воспроизведение записанного трафика (-r).
+ *
+ * Источник - журнал server3 --capture (префикс PATH: читаются все
+ * сегменты PATH.*.*) или текстовый файл со строками
+ *	время_мкс соединение событие [длина]
+ * где событие - O (открыть), R (запрос), S (ответ), C (закрыть), как в
+ * capture.h; '#' - комментарий.
+ *
+ * Каждое записанное соединение открывается, шлет запросы и
+ * закрывается в записанные моменты, деленные на -x (1 - исходный темп,
+ * 2 - вдвое быстрее). При -x 0 паузы убираются: соединения открываются,
+ * как только среди -c одновременно открытых есть место, а следующий
+ * запрос уходит сразу после ответа на предыдущий. Соединение без
+ * запросов (сервер без keep-alive) ждет ответа на само соединение.
+ *
+ * Все соединения обслуживает один поток: неблокирующие сокеты в epoll,
+ * моменты событий - по таймеру timerfd с точностью до наносекунд.
+ * Для каждого запроса считается задержка ответа, ее отклонение от
+ * записанной (от запроса до ответа на стороне сервера) и опоздание
+ * отправки против расписания; -o выводит их построчно (CSV).
+ */
+struct rec {
+	uint64_t ts;		/* нс от начала записи */
+	uint64_t conn;
+	char dir;
+};
+
+struct rconn {
+	uint64_t id;
+	int fd;
+	int oneshot;		/* Нет запросов: ответ - на открытие. */
+	uint64_t t_open, t_close;
+	uint64_t *req;		/* Моменты запросов по записи. */
+	uint64_t *orig;		/* Записанные задержки; 0 - неизвестна. */
+	uint64_t *sent;		/* Фактические моменты отправки. */
+	size_t nreq, nsent, nreplied;
+	int state;		/* Ближайшее действие, см. ниже. */
+	size_t heap;		/* Позиция в куче; -1 - не в куче. */
+	uint64_t due;
+};
+
+enum { RC_OPEN, RC_SEND, RC_WAIT, RC_CLOSE, RC_DONE };
+
+#define REPLAY_BATCH 64		/* Действий между опросами сокетов. */
+
+static const char *replay_path = NULL;
+static double speed = 1;
+static const char *replay_log = NULL;
+
+static struct rec *recs;
+static size_t nrecs, caprecs;
+
+static void add_rec(uint64_t ts, uint64_t conn, char dir)
+{
+	if(nrecs == caprecs) {
+		caprecs = caprecs ? caprecs * 2 : 4096;
+		recs = realloc(recs, caprecs * sizeof(*recs));
+		if(recs == NULL) error("realloc()");
+	}
+	recs[nrecs].ts = ts;
+	recs[nrecs].conn = conn;
+	recs[nrecs++].dir = dir;
+}
+
+/*
+ * Прочитать сегмент журнала. Возвращает 0, если это не журнал.
+ * Время записей - по CLOCK_REALTIME, чтобы совместить процессы prefork.
+ */
+static int load_segment(const char *path)
+{
+	struct capture_file *h;
+	struct capture_rec *r;
+	struct stat st;
+	size_t off;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) error(path);
+	if(fstat(fd, &st) == -1) error("fstat()");
+	if((size_t) st.st_size < sizeof(*h)) {
+		close(fd);
+		return 0;
+	}
+	h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(h == MAP_FAILED) error("mmap()");
+	close(fd);
+	if(h->magic != CAPTURE_MAGIC) {
+		munmap(h, st.st_size);
+		return 0;
+	}
+	if(h->version != CAPTURE_VERSION || h->header_size != sizeof(*h) ||
+		h->used > (uint64_t) st.st_size) {
+		fprintf(stderr, "%s: unsupported capture segment\n", path);
+		exit(-1);
+	}
+	for(off = h->header_size; off + sizeof(*r) <= h->used; off += capture_rec_size(r)) {
+		r = (struct capture_rec *) ((char *) h + off);
+		add_rec(h->real_start + r->ts, r->conn, r->dir);
+	}
+	munmap(h, st.st_size);
+
+	return 1;
+}
+
+static void load_text(const char *path)
+{
+	FILE *f;
+	char line[256], dir;
+	double us;
+	unsigned long long conn;
+
+	f = fopen(path, "r");
+	if(f == NULL) error(path);
+	while(fgets(line, sizeof(line), f) != NULL) {
+		if(line[0] == '#') continue;
+		if(sscanf(line, "%lf %llu %c", &us, &conn, &dir) != 3) continue;
+		add_rec(us * 1e3, conn, dir);
+	}
+	fclose(f);
+}
+
+static int cmp_rec(const void *a, const void *b)
+{
+	const struct rec *x = a, *y = b;
+
+	if(x->conn != y->conn) return x->conn < y->conn ? -1 : 1;
+	return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+static int cmp_open(const void *a, const void *b)
+{
+	const struct rconn *x = a, *y = b;
+
+	return x->t_open < y->t_open ? -1 : x->t_open > y->t_open;
+}
+
+/*
+ * Загрузить запись и разложить ее по соединениям, упорядоченным по
+ * моменту открытия. Время - от первого события.
+ */
+static struct rconn *load_replay(size_t *nconns)
+{
+	char pattern[PATH_MAX];
+	struct rconn *cs, *c;
+	glob_t g;
+	uint64_t t0 = UINT64_MAX, last_req;
+	size_t i, j, m, n = 0, k;
+
+	snprintf(pattern, sizeof(pattern), "%s.*.*", replay_path);
+	if(glob(pattern, 0, NULL, &g) == 0) {
+		for(i = 0; i < g.gl_pathc; i++) load_segment(g.gl_pathv[i]);
+		globfree(&g);
+	} else if(!load_segment(replay_path)) {
+		load_text(replay_path);
+	}
+	if(!nrecs) {
+		fprintf(stderr, "%s: nothing to replay\n", replay_path);
+		exit(-1);
+	}
+
+	qsort(recs, nrecs, sizeof(*recs), cmp_rec);
+	for(i = 0; i < nrecs; i++) {
+		if(recs[i].ts < t0) t0 = recs[i].ts;
+		if(!i || recs[i].conn != recs[i - 1].conn) n++;
+	}
+	cs = Malloc(n * sizeof(*cs));
+	memset(cs, 0, n * sizeof(*cs));
+
+	for(i = 0, k = 0; i < nrecs; i = j, k++) {
+		c = &cs[k];
+		c->id = recs[i].conn;
+		c->fd = -1;
+		c->heap = -1;
+		for(j = i; j < nrecs && recs[j].conn == c->id; j++)
+			if(recs[j].dir == CAP_RECV) c->nreq++;
+		c->oneshot = !c->nreq;
+		if(c->oneshot) c->nreq = 1;
+		c->req = Malloc(c->nreq * sizeof(uint64_t));
+		c->orig = Malloc(c->nreq * sizeof(uint64_t));
+		c->sent = Malloc(c->nreq * sizeof(uint64_t));
+		memset(c->orig, 0, c->nreq * sizeof(uint64_t));
+
+		/* Без записи открытия соединение открывается к первому событию. */
+		c->t_open = c->t_close = recs[i].ts - t0;
+		last_req = c->t_open;
+		if(c->oneshot) c->req[0] = c->t_open;
+		for(j = i, m = 0; j < nrecs && recs[j].conn == c->id; j++) {
+			switch(recs[j].dir) {
+			case CAP_RECV:
+				last_req = c->req[m++] = recs[j].ts - t0;
+				break;
+			case CAP_SEND:
+				/* Ответ - на последний запрос до него. */
+				if(m || c->oneshot) c->orig[c->oneshot ? 0 : m - 1] = recs[j].ts - t0 - last_req;
+				break;
+			}
+			c->t_close = recs[j].ts - t0;
+		}
+	}
+	qsort(cs, k, sizeof(*cs), cmp_open);
+	free(recs);
+	*nconns = k;
+
+	return cs;
+}
+
+/* Куча ближайших действий соединений по due. */
+static struct rconn **heap;
+static size_t nheap;
+
+static void heap_swap(size_t a, size_t b)
+{
+	struct rconn *t = heap[a];
+
+	heap[a] = heap[b];
+	heap[b] = t;
+	heap[a]->heap = a;
+	heap[b]->heap = b;
+}
+
+static void heap_push(struct rconn *c, uint64_t due, int state)
+{
+	size_t i = nheap++, p;
+
+	c->due = due;
+	c->state = state;
+	heap[i] = c;
+	c->heap = i;
+	while(i && heap[p = (i - 1) / 2]->due > heap[i]->due) {
+		heap_swap(i, p);
+		i = p;
+	}
+}
+
+static struct rconn *heap_pop(void);
+
+/* Убрать соединение из кучи: поднять в голову и вынуть. */
+static void heap_remove(struct rconn *c)
+{
+	size_t i = c->heap;
+
+	if(i == (size_t) -1) return;
+	for(; i; i = (i - 1) / 2) heap_swap(i, (i - 1) / 2);
+	heap_pop();
+}
+
+static struct rconn *heap_pop(void)
+{
+	struct rconn *top = heap[0];
+	size_t i = 0, l, m;
+
+	heap_swap(0, --nheap);
+	for(;;) {
+		l = 2 * i + 1;
+		m = i;
+		if(l < nheap && heap[l]->due < heap[m]->due) m = l;
+		if(l + 1 < nheap && heap[l + 1]->due < heap[m]->due) m = l + 1;
+		if(m == i) break;
+		heap_swap(i, m);
+		i = m;
+	}
+	top->heap = -1;
+
+	return top;
+}
+
+/* Результаты по запросам. */
+static uint64_t *lat, *dev_abs, *late;
+static int64_t *dev;
+static size_t nres;
+static long rerrors;
+static FILE *rlog;
+
+static uint64_t scaled(uint64_t t)
+{
+	return speed > 0 ? t / speed : 0;
+}
+
+static void replay_fail(struct rconn *c, int epfd)
+{
+	rerrors++;
+	if(c->fd != -1) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+		close(c->fd);
+		c->fd = -1;
+	}
+	c->state = RC_DONE;
+}
+
+/* Ответ на очередной запрос соединения c получен в момент now. */
+static void replied(struct rconn *c, uint64_t now)
+{
+	size_t i = c->nreplied++;
+	uint64_t l = now - c->sent[i];
+	int64_t d = (int64_t) (l - c->orig[i]);
+
+	lat[nres] = l;
+	dev[nres] = d;
+	dev_abs[nres] = d < 0 ? -d : d;
+	late[nres++] = speed > 0 && c->sent[i] > scaled(c->req[i]) ? c->sent[i] - scaled(c->req[i]) : 0;
+	if(rlog != NULL) {
+		fprintf(rlog, "%llu,%zu,%.3f,%.3f,%.3f,%.3f,%.3f\n", (unsigned long long) c->id, i,
+			scaled(c->req[i]) / 1e3, c->sent[i] / 1e3, l / 1e3, c->orig[i] / 1e3, d / 1e3);
+	}
+}
+
+static int replay_open(struct rconn *c, struct sockaddr_in *addr, int epfd)
+{
+	struct epoll_event ev;
+
+	c->fd = socket(PF_INET, SOCK_STREAM, 0);
+	if(c->fd == -1) error("socket()");
+	if(tune_apply(c->fd, tune, (c->oneshot ? TUNE_READ_EOF : 0) | TUNE_RESET_CLOSE) == -1)
+		error("setsockopt()");
+	/* На loopback connect() завершается сразу; неблокирующим сокет становится после. */
+	if(connect(c->fd, (SA *) addr, sizeof(*addr)) == -1) return -1;
+	if(fcntl(c->fd, F_SETFL, O_NONBLOCK) == -1) error("fcntl()");
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) error("epoll_ctl()");
+
+	return 0;
+}
+
+/* Следующее действие после отправки или ответа. */
+static void replay_next(struct rconn *c, uint64_t now)
+{
+	if(c->nsent < c->nreq) {
+		if(speed > 0) heap_push(c, scaled(c->req[c->nsent]), RC_SEND);
+		else if(c->nreplied == c->nsent) heap_push(c, now, RC_SEND);
+		else c->state = RC_WAIT;
+	} else if(c->nreplied < c->nreq) {
+		c->state = RC_WAIT;
+	} else {
+		heap_push(c, now > scaled(c->t_close) ? now : scaled(c->t_close), RC_CLOSE);
+	}
+}
+
+void run_replay(struct sockaddr_in *addr)
+{
+	struct rconn *cs, *c;
+	struct epoll_event ev, evs[256];
+	struct itimerspec its;
+	struct rlimit rl;
+	size_t ncs, i, next = 0, k, total = 0;
+	uint64_t start, now, sum = 0;
+	int epfd, tfd, open_now = 0, n;
+	char buf[65536];
+	ssize_t rc;
+	double elapsed;
+
+	cs = load_replay(&ncs);
+	/* При исходном темпе открытых соединений может быть сколько угодно. */
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	for(i = 0; i < ncs; i++) total += cs[i].nreq;
+	heap = Malloc(ncs * sizeof(*heap));
+	lat = Malloc(total * sizeof(*lat));
+	dev_abs = Malloc(total * sizeof(*dev_abs));
+	late = Malloc(total * sizeof(*late));
+	dev = Malloc(total * sizeof(*dev));
+	if(replay_log != NULL) {
+		rlog = fopen(replay_log, "w");
+		if(rlog == NULL) error(replay_log);
+		fprintf(rlog, "conn,seq,scheduled_us,sent_us,latency_us,recorded_us,deviation_us\n");
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(epfd == -1 || tfd == -1) error("epoll/timerfd");
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) == -1) error("epoll_ctl()");
+
+	start = now_ns();
+	for(;;) {
+		now = now_ns() - start;
+
+		/*
+		 * Открытия - по порядку записи; при -x 0 не больше conc сразу.
+		 * При отставании от расписания действия идут порциями, чтобы
+		 * пришедшие ответы не ждали и не портили задержки.
+		 */
+		for(k = 0; k < REPLAY_BATCH && next < ncs &&
+			(speed > 0 ? scaled(cs[next].t_open) <= now : open_now < conc); k++) {
+			c = &cs[next++];
+			open_now++;
+			if(replay_open(c, addr, epfd) == -1) {
+				replay_fail(c, epfd);
+				open_now--;
+				continue;
+			}
+			if(c->oneshot) {
+				c->sent[0] = now_ns() - start;
+				c->nsent = 1;
+				c->state = RC_WAIT;
+			} else {
+				replay_next(c, now);
+			}
+		}
+
+		for(k = 0; k < REPLAY_BATCH && nheap && heap[0]->due <= now; k++) {
+			c = heap_pop();
+			if(c->state == RC_SEND) {
+				c->sent[c->nsent] = now_ns() - start;
+				if(write(c->fd, "\n", 1) != 1) {
+					replay_fail(c, epfd);
+					open_now--;
+					continue;
+				}
+				c->nsent++;
+				replay_next(c, now);
+			} else if(c->state == RC_CLOSE) {
+				epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+				close(c->fd);
+				c->fd = -1;
+				c->state = RC_DONE;
+				open_now--;
+			}
+		}
+		if(next == ncs && !open_now) break;
+
+		/* Таймер - на ближайшее действие или открытие. */
+		memset(&its, 0, sizeof(its));
+		now = UINT64_MAX;
+		if(nheap) now = heap[0]->due;
+		if(next < ncs && speed > 0 && scaled(cs[next].t_open) < now) now = scaled(cs[next].t_open);
+		if(now != UINT64_MAX) {
+			now += start;
+			its.it_value.tv_sec = now / 1000000000;
+			its.it_value.tv_nsec = now % 1000000000;
+			if(!its.it_value.tv_sec && !its.it_value.tv_nsec) its.it_value.tv_nsec = 1;
+		}
+		timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+		n = epoll_wait(epfd, evs, 256, -1);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			error("epoll_wait()");
+		}
+		for(i = 0; i < (size_t) n; i++) {
+			c = evs[i].data.ptr;
+			if(c == NULL) {
+				uint64_t ticks;
+
+				if(read(tfd, &ticks, sizeof(ticks)) == -1 && errno != EAGAIN) error("read(timerfd)");
+				continue;
+			}
+			if(c->fd == -1) continue;
+			rc = read(c->fd, buf, sizeof(buf));
+			now = now_ns() - start;
+			if(rc == -1 && errno == EAGAIN) continue;
+			if(rc <= 0) {
+				/*
+				 * Без keep-alive конец потока и есть конец ответа;
+				 * закрытие сервером после всех ответов - не ошибка.
+				 */
+				if(rc == 0 && c->oneshot && c->nreplied == 0) replied(c, now);
+				heap_remove(c);
+				if(rc == 0 && c->nreplied == c->nreq) {
+					epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+					close(c->fd);
+					c->fd = -1;
+					c->state = RC_DONE;
+				} else {
+					replay_fail(c, epfd);
+				}
+				open_now--;
+				continue;
+			}
+			if(c->oneshot) continue;
+			for(k = 0; k < (size_t) rc; k++) {
+				if(buf[k] != '\n' || c->nreplied == c->nsent) continue;
+				replied(c, now);
+				if(c->state == RC_WAIT) replay_next(c, now);
+			}
+		}
+	}
+	elapsed = (now_ns() - start) / 1e9;
+	if(rlog != NULL) fclose(rlog);
+
+	qsort(lat, nres, sizeof(*lat), cmp_u64);
+	qsort(dev_abs, nres, sizeof(*dev_abs), cmp_u64);
+	qsort(late, nres, sizeof(*late), cmp_u64);
+	for(i = 0; i < nres; i++) sum += lat[i];
+
+	printf("{\"replay\":\"%s\",\"speed\":%g,\"conns\":%zu,\"duration_s\":%.3f,"
+		"\"requests\":%zu,\"errors\":%ld,\"throughput_rps\":%.1f,"
+		"\"mean_us\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+		"\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+		"\"dev_p50_us\":%.1f,\"dev_p99_us\":%.1f,"
+		"\"late_p50_us\":%.1f,\"late_p99_us\":%.1f}\n",
+		replay_path, speed, ncs, elapsed, nres, rerrors, nres / elapsed,
+		nres ? sum / 1e3 / nres : 0, percentile(lat, nres, 0.50),
+		percentile(lat, nres, 0.90), percentile(lat, nres, 0.99),
+		percentile(lat, nres, 0.999), nres ? lat[nres - 1] / 1e3 : 0,
+		percentile(dev_abs, nres, 0.50), percentile(dev_abs, nres, 0.99),
+		percentile(late, nres, 0.50), percentile(late, nres, 0.99));
+	fflush(stdout);
+}
+
+/*
+ * Прием рассылки server3 -m multicast (-M).
+ *
+ * Клиент вступает в группу ip_address[:port] и принимает датаграммы
+ * пачками через recvmmsg(). Потери считаются по разрывам в номерах
+ * seq отдельно для каждого сеанса (каждого запуска сервера). Датаграмма
+ * с номером меньше ожидаемого считается опоздавшей: ее уже записали в
+ * потерянные, и она оттуда вычитается (дублей в одном сегменте не
+ * бывает, и отдельно они не различаются). Для сверки печатается и
+ * число датаграмм, отброшенных ядром из-за переполнения буфера сокета
+ * (SO_RXQ_OVFL).
+ *
+ * Задержка - от метки сервера до приема по CLOCK_REALTIME; между
+ * разными машинами она верна с точностью синхронизации их часов.
+ */
+#define MC_BATCH 64		/* Датаграмм на один recvmmsg(). */
+#define MC_SESSIONS 16		/* Одновременно различаемых сеансов. */
+
+static int multicast = 0;	/* Режим приема рассылки. */
+static struct in_addr mc_if;	/* Интерфейс приема; INADDR_ANY - выбор ядра. */
+
+struct mc_session {
+	uint64_t id;
+	uint64_t next;		/* Ожидаемый номер. */
+};
+
+static uint64_t realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int mc_join(struct sockaddr_in *group)
+{
+	struct ip_mreq mreq;
+	struct timeval tv = { 0, 100000 };
+	int fd, on = 1, rcvbuf = 4 << 20;
+
+	fd = Socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	/* Несколько получателей одной группы на одной машине. */
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) error("setsockopt()");
+	/* Пачки sendmmsg() приходят подряд; ядро урежет размер до rmem_max. */
+	if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1) error("setsockopt()");
+	if(setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1) error("setsockopt()");
+	/* Чтобы -d соблюдался и тогда, когда рассылка остановилась. */
+	if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) error("setsockopt()");
+	/* Привязка к адресу группы: другие датаграммы на этот порт не попадут. */
+	if(bind(fd, (SA *) group, sizeof(*group)) == -1) error("bind()");
+
+	mreq.imr_multiaddr = group->sin_addr;
+	mreq.imr_interface = mc_if;
+	if(setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1)
+		error("setsockopt(IP_ADD_MEMBERSHIP)");
+
+	return fd;
+}
+
+void run_multicast(struct sockaddr_in *group)
+{
+	struct mmsghdr msgs[MC_BATCH];
+	struct iovec iov[MC_BATCH];
+	struct mc_session sess[MC_SESSIONS];
+	struct mc_header h;
+	struct cmsghdr *cm;
+	char (*ctl)[CMSG_SPACE(sizeof(uint32_t))];
+	char *bufs;
+	uint64_t *lat = NULL, start, first = 0, last = 0, deadline, now, bytes = 0;
+	size_t nlat = 0, cap = 0;
+	long received = 0, lost = 0, gaps = 0, late = 0, invalid = 0;
+	uint32_t ovfl = 0;
+	int fd, n, i, k, nsess = 0;
+	double elapsed;
+
+	fd = mc_join(group);
+	bufs = Malloc((size_t) MC_BATCH * MC_DATAGRAM_MAX);
+	ctl = Malloc(sizeof(*ctl) * MC_BATCH);
+
+	start = now_ns();
+	deadline = start + duration * 1e9;
+	while(nreq ? received < nreq : now_ns() < deadline) {
+		for(i = 0; i < MC_BATCH; i++) {
+			iov[i].iov_base = bufs + (size_t) i * MC_DATAGRAM_MAX;
+			iov[i].iov_len = MC_DATAGRAM_MAX;
+			memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = ctl[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(ctl[i]);
+		}
+		/* Ждать только первую датаграмму, остальные - сколько уже есть. */
+		n = recvmmsg(fd, msgs, MC_BATCH, MSG_WAITFORONE, NULL);
+		if(n == -1) {
+			if(errno == EAGAIN || errno == EINTR) continue;
+			error("recvmmsg()");
+		}
+		now = realtime_ns();
+		for(i = 0; i < n; i++) {
+			char *p = iov[i].iov_base;
+			size_t len = msgs[i].msg_len;
+
+			for(cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm != NULL; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+				if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL)
+					memcpy(&ovfl, CMSG_DATA(cm), sizeof(ovfl));
+			}
+			if(len < sizeof(h)) {
+				invalid++;
+				continue;
+			}
+			memcpy(&h, p, sizeof(h));
+			if(h.magic != MC_MAGIC || len != sizeof(h) + h.len ||
+				(validate && letters_prefix(p + sizeof(h), h.len) != h.len)) {
+				invalid++;
+				continue;
+			}
+
+			for(k = 0; k < nsess && sess[k].id != h.session; k++)
+				;
+			if(k == nsess) {
+				/* Вступили посреди потока: прежние номера не потеряны. */
+				if(nsess == MC_SESSIONS) k = nsess - 1;
+				else nsess++;
+				sess[k].id = h.session;
+				sess[k].next = h.seq;
+			}
+			if(h.seq >= sess[k].next) {
+				if(h.seq > sess[k].next) {
+					lost += h.seq - sess[k].next;
+					gaps++;
+				}
+				sess[k].next = h.seq + 1;
+			} else {
+				lost--;
+				late++;
+			}
+
+			if(!received) first = now_ns();
+			received++;
+			bytes += len;
+			if(nlat == cap) {
+				cap = cap ? cap * 2 : 65536;
+				lat = realloc(lat, cap * sizeof(*lat));
+				if(lat == NULL) error("realloc()");
+			}
+			lat[nlat++] = now > h.ts ? now - h.ts : 0;
+		}
+		last = now_ns();
+	}
+	Close(fd);
+
+	elapsed = received > 1 ? (last - first) / 1e9 : 0;
+	qsort(lat, nlat, sizeof(*lat), cmp_u64);
+	printf("{\"multicast\":\"%s:%d\",\"duration_s\":%.3f,\"datagrams\":%ld,\"bytes\":%llu,"
+		"\"sessions\":%d,\"lost\":%ld,\"gaps\":%ld,\"late\":%ld,\"invalid\":%ld,"
+		"\"kernel_drops\":%u,\"loss_pct\":%.3f,\"throughput_dps\":%.1f,\"throughput_mbps\":%.3f,"
+		"\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+		inet_ntoa(group->sin_addr), ntohs(group->sin_port), elapsed, received,
+		(unsigned long long) bytes, nsess, lost, gaps, late, invalid, ovfl,
+		received + lost ? 100.0 * lost / (received + lost) : 0,
+		elapsed > 0 ? received / elapsed : 0, elapsed > 0 ? bytes * 8 / elapsed / 1e6 : 0,
+		percentile(lat, nlat, 0.50), percentile(lat, nlat, 0.99),
+		percentile(lat, nlat, 0.999), nlat ? lat[nlat - 1] / 1e3 : 0);
+	fflush(stdout);
+	free(lat);
+}
+
+/*
+ * Простаивающие соединения (--idle).
+ *
+ * Клиент открывает n соединений, на каждом делает один запрос (-k) и
+ * читает ответ, а затем держит их открытыми -d секунд, ничего не
+ * посылая. Как только все открыты, печатается строка JSON: по ней
+ * bench/idle.sh снимает память сервера на простаивающее соединение.
+ * Открытие останавливается на первом соединении, которое сервер не
+ * обслужил за секунду: значит, места у него кончились.
+ */
+static long idle_conns = 0;		/* --idle */
+static struct in_addr bind_addr;	/* --bind; INADDR_ANY - выбор ядра. */
+
+void run_idle(struct sockaddr_in *addr)
+{
+	struct sockaddr_in local;
+	struct timeval tv = { 1, 0 };
+	struct timespec hold;
+	uint64_t t0;
+	long opened = 0;
+	int *fds, s, failed = 0;
+
+	raise_nofile();
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr = bind_addr;
+	fds = Malloc(idle_conns * sizeof(*fds));
+
+	t0 = now_ns();
+	while(opened < idle_conns) {
+		s = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(s == -1) break;
+		/* Таймауты действуют и на connect(). */
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		if((bind_addr.s_addr != htonl(INADDR_ANY) && bind(s, (SA *) &local, sizeof(local)) == -1) ||
+			connect(s, (SA *) addr, sizeof(*addr)) == -1 ||
+			write(s, "\n", 1) != 1 || read_reply(s, 0, NULL) == -1) {
+			failed = 1;
+			close(s);
+			break;
+		}
+		fds[opened++] = s;
+	}
+	printf("{\"idle\":%ld,\"opened\":%ld,\"full\":%s,\"open_s\":%.3f}\n",
+		idle_conns, opened, failed ? "true" : "false", (now_ns() - t0) / 1e9);
+	fflush(stdout);
+
+	hold.tv_sec = (time_t) duration;
+	hold.tv_nsec = (duration - hold.tv_sec) * 1e9;
+	while(nanosleep(&hold, &hold) == -1 && errno == EINTR)
+		;
+	while(opened) close(fds[--opened]);
+	free(fds);
+}
+
+/*
+ * Адрес сервера: ip_address[:port], порт по умолчанию - -p.
+ */
+void parse_server(const char *arg, struct sockaddr_in *addr)
+{
+	char host[64];
+	const char *colon = strchr(arg, ':');
+	size_t n = colon != NULL ? (size_t) (colon - arg) : strlen(arg);
+
+	if(n >= sizeof(host)) show_usage();
+	memcpy(host, arg, n);
+	host[n] = 0;
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(colon != NULL ? atoi(colon + 1) : port);
+	Inet_aton(host, &addr->sin_addr);
+}
+
+/* Длинные ключи без коротких. */
+enum { OPT_HEDGE_DELAY = 256, OPT_CONN_REQUESTS, OPT_MC_IF, OPT_IDLE, OPT_BIND, OPT_URING };
+
+/*
+ * Разбор аргументов командной строки.
+ */
+void parse_args(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "port",        required_argument, NULL, 'p' },
+		{ "load",        no_argument,       NULL, 'l' },
+		{ "concurrency", required_argument, NULL, 'c' },
+		{ "requests",    required_argument, NULL, 'n' },
+		{ "duration",    required_argument, NULL, 'd' },
+		{ "warmup",      required_argument, NULL, 'w' },
+		{ "keepalive",   no_argument,       NULL, 'k' },
+		{ "tune",        required_argument, NULL, 't' },
+		{ "fanout",      required_argument, NULL, 'F' },
+		{ "hedge",       no_argument,       NULL, 'H' },
+		{ "hedge-delay", required_argument, NULL, OPT_HEDGE_DELAY },
+		{ "pool",        required_argument, NULL, 'P' },
+		{ "conn-requests", required_argument, NULL, OPT_CONN_REQUESTS },
+		{ "validate",    no_argument,       NULL, 'V' },
+		{ "size",        required_argument, NULL, 's' },
+		{ "seed",        required_argument, NULL, 'S' },
+		{ "reserve",     required_argument, NULL, 'R' },
+		{ "replay",      required_argument, NULL, 'r' },
+		{ "speed",       required_argument, NULL, 'x' },
+		{ "replay-log",  required_argument, NULL, 'o' },
+		{ "multicast",   no_argument,       NULL, 'M' },
+		{ "mc-if",       required_argument, NULL, OPT_MC_IF },
+		{ "idle",        required_argument, NULL, OPT_IDLE },
+		{ "bind",        required_argument, NULL, OPT_BIND },
+		{ "uring",       required_argument, NULL, OPT_URING },
+		{ "help",        no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int c;
+
+	while((c = getopt_long(argc, argv, "p:lc:n:d:w:kt:F:HP:Vs:S:R:r:x:o:Mh", opts, NULL)) != -1) {
+		switch(c) {
+		case 'p': port = atoi(optarg); break;
+		case 'l': load = 1; break;
+		case 'c': conc = atoi(optarg); break;
+		case 'n': nreq = atol(optarg); break;
+		case 'd': duration = atof(optarg); break;
+		case 'w': warmup = atof(optarg); break;
+		case 'k': keepalive = 1; break;
+		case 't':
+			tune = tune_find(optarg);
+			if(tune == NULL) show_usage();
+			break;
+		case 'F': fanout = atoi(optarg); break;
+		case 'H': hedge = 1; break;
+		case OPT_HEDGE_DELAY:
+			hedge = 1;
+			hedge_delay = atof(optarg);
+			break;
+		case 'P': pool_size = atoi(optarg); break;
+		case OPT_CONN_REQUESTS: conn_requests = atol(optarg); break;
+		case 'V': validate = 1; break;
+		case 's': size_spec = optarg; break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			seeded = 1;
+			break;
+		case 'R': reserve_n = atol(optarg); break;
+		case 'r': replay_path = optarg; break;
+		case 'x': speed = atof(optarg); break;
+		case 'o': replay_log = optarg; break;
+		case 'M': multicast = 1; break;
+		case OPT_MC_IF: Inet_aton(optarg, &mc_if); break;
+		case OPT_IDLE: idle_conns = atol(optarg); break;
+		case OPT_BIND: Inet_aton(optarg, &bind_addr); break;
+		case OPT_URING:
+#ifndef HAVE_URING
+			fprintf(stderr, "client: built without io_uring support for --uring\n");
+			exit(-1);
+#endif
+			uring_rings = atoi(optarg);
+			break;
+		default: show_usage();
+		}
+	}
+	nservers = argc - optind;
+	if(nservers < 1 || conc < 1 || speed < 0 || reserve_n < 0) show_usage();
+	/* Серверов больше одного - только у генератора нагрузки. */
+	if(nservers > 1 && (!load || replay_path != NULL)) show_usage();
+	/* Рассылка принимается из одной группы, без запросов. */
+	if(multicast && (load || replay_path != NULL || nservers > 1)) show_usage();
+	/* Простаивающее соединение - keep-alive после одного запроса. */
+	if(idle_conns < 0 || (idle_conns && (!keepalive || load || multicast || replay_path != NULL ||
+		nservers > 1))) show_usage();
+	/* Опоздавшие ответы дочитываются из постоянных соединений. */
+	if((nservers > 1 || hedge) && !keepalive) show_usage();
+	if(fanout < 1 || fanout + hedge > nservers || hedge_delay < 0) show_usage();
+	/*
+	 * Пул - для постоянных соединений: без keep-alive ответ server3
+	 * уходит сразу при соединении, и заранее открытое соединение было
+	 * бы заранее отправленным запросом.
+	 */
+	if(pool_size < 0 || conn_requests < 0 || (pool_size && (!keepalive || fanout > 1 || hedge)))
+		show_usage();
+	if(conn_requests && (!keepalive || (nservers > 1 && !pool_size))) show_usage();
+	/* Кольца ведут постоянные соединения с одним сервером. */
+	if(uring_rings < 0 || (uring_rings && (!load || !keepalive || nservers > 1 || pool_size ||
+		conn_requests || replay_path != NULL))) show_usage();
+	if(uring_rings > conc) uring_rings = conc;
+	/* Запас сервера зависит от его --seed. */
+	if(reserve_n && !seeded) show_usage();
+}
+
+int main(int argc, char **argv)
+{
+	int socket, i;
+	struct sockaddr_in servaddr;
+	
+	parse_args(argc, argv);
+	/* Инициализировать структуры адресов серверов. */
+	servers = Malloc(nservers * sizeof(*servers));
+	for(i = 0; i < nservers; i++) parse_server(argv[optind + i], &servers[i]);
+	servaddr = servers[0];
+
+	if(multicast) {
+		if(!IN_MULTICAST(ntohl(servaddr.sin_addr.s_addr))) show_usage();
+		run_multicast(&servaddr);
+		return 0;
+	}
+	if(idle_conns) {
+		run_idle(&servaddr);
+		return 0;
+	}
+	if(replay_path != NULL) {
+		run_replay(&servaddr);
+		return 0;
+	}
+	if(load) {
+		run_load(&servaddr);
+		return 0;
+	}
+
+	socket = Socket(PF_INET, SOCK_STREAM, 0);
+	if(tune_apply(socket, tune, 0) == -1) error("setsockopt()");
 	Connect(socket, (SA *) &servaddr, sizeof(servaddr));
-	//printf("main7 \n");
 	do_work(socket);
-	//printf("\n main8 \n");
 	Close(socket);
 	
 	return 0;
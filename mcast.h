@@ -0,0 +1,31 @@
+/*
+ * Формат датаграмм server3 -m multicast, общий для сервера и клиента
+ * (client -M).
+ *
+ * Сервер рассылает в группу поток сообщений, по одному в датаграмме:
+ * заголовок и len строчных латинских букв без '\n' (границу сообщения
+ * задает сама датаграмма). Номера seq идут подряд с нуля в пределах
+ * сеанса session - случайного числа, выбираемого при запуске сервера,
+ * так что получатель по разрывам в seq видит потерянные датаграммы, а
+ * по смене session - перезапуск сервера.
+ */
+
+#ifndef MCAST_H
+#define MCAST_H
+
+#include <stdint.h>
+
+#define MC_MAGIC 0x4d433353             /* "S3CM" */
+#define MC_DATAGRAM_MAX 65507           /* Наибольшая датаграмма UDP по IPv4. */
+
+struct mc_header {
+    uint32_t magic;
+    uint32_t len;                       /* Букв после заголовка. */
+    uint64_t session;
+    uint64_t seq;
+    uint64_t ts;                        /* Отправка, нс от эпохи (CLOCK_REALTIME). */
+};
+
+#define MC_PAYLOAD_MAX (MC_DATAGRAM_MAX - sizeof(struct mc_header))
+
+#endif
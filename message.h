@@ -0,0 +1,216 @@
+/*
+ * Содержимое сообщений server3: генератор случайных чисел, буквы и
+ * распределение длин (-s). Общий для сервера и клиента: клиент по тем
+ * же --seed и -s воспроизводит сообщения сервера, чтобы проверять ответы.
+ *
+ * Генератор - xorshift64*, начальное состояние каждого потока выводится
+ * из seed и номера потока через splitmix64.
+ */
+
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void error(const char* s);      /* Определяется программой: сообщить и выйти. */
+
+struct rng {
+    uint64_t s;
+};
+
+static inline uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Поток stream генератора с начальным числом seed. */
+static inline void rng_seed(struct rng* r, uint64_t seed, uint64_t stream)
+{
+    r->s = splitmix64(seed ^ splitmix64(stream));
+    if (!r->s) r->s = 1;
+}
+
+static inline uint64_t rng_next(struct rng* r)
+{
+    uint64_t x = r->s;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    r->s = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* Число от 0 до n - 1 (умножение вместо деления, смещение < n / 2^64). */
+static inline uint64_t rng_below(struct rng* r, uint64_t n)
+{
+    return (uint64_t)(((unsigned __int128)rng_next(r) * n) >> 64);
+}
+
+/* Число из [0, 1). */
+static inline double rng_unit(struct rng* r)
+{
+    return (rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+/*
+ * Заполнить buf len случайными строчными латинскими буквами.
+ */
+static inline void make_letters(struct rng* r, char* buf, size_t len)
+{
+    unsigned __int128 m;
+    uint64_t x = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        //из 64 случайных битов берется 8 букв: умножение на 26 выдвигает
+        //очередную букву в старшее слово, младшее остается для следующих
+        if (!(i & 7)) x = rng_next(r);
+        m = (unsigned __int128)x * ('z' - 'a' + 1);
+        buf[i] = 'a' + (char)(m >> 64);
+        x = (uint64_t)m;
+    }
+}
+
+/*
+ * Сформировать случайное сообщение из строчных латинских букв.
+ * В buf должно помещаться len + 1 байт: сообщение завершается '\n',
+ * по которому клиент определяет его границу.
+ */
+static inline size_t make_message(struct rng* r, char* buf, size_t len)
+{
+    make_letters(r, buf, len);
+    buf[len] = '\n';
+
+    return len + 1;
+}
+
+/*
+ * Распределение длины сообщения (-s):
+ *      N                       всегда N букв
+ *      uniform:A:B             равномерно от A до B включительно
+ *      lognormal:MEDIAN:SIGMA[:MAX]  логнормальное с медианой MEDIAN и
+ *                              sigma логарифма; длиннее MAX (по умолчанию
+ *                              99.99-й перцентиль) не бывает
+ *      hist:FILE               эмпирическое: строки "длина [вес]" в FILE,
+ *                              '#' - комментарий
+ * По умолчанию, как и раньше, равномерно от 0 до 10.
+ */
+enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_LOGNORMAL, SIZE_HIST };
+
+static struct {
+    int kind;
+    size_t min, max;        /* Пределы длины; max - размер буферов. */
+    double mu, sigma;       /* lognormal: параметры логарифма длины. */
+    size_t n;               /* hist: число строк */
+    size_t* sizes;          /*       длины */
+    double* cdf;            /*       и накопленные веса. */
+} size_dist = { SIZE_UNIFORM, 0, 10 };
+
+/* Прочитать гистограмму длин; 0 при успехе. */
+static inline int size_hist_load(const char* path)
+{
+    FILE* f;
+    char line[256];
+    size_t cap = 0, len;
+    double w, total = 0;
+    int n;
+
+    f = fopen(path, "r");
+    if (f == NULL) error(path);
+    size_dist.n = 0;
+    size_dist.max = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#') continue;
+        w = 1;
+        n = sscanf(line, "%zu %lf", &len, &w);
+        if (n < 1) continue;
+        if (w < 0) return -1;
+        if (size_dist.n == cap) {
+            cap = cap ? cap * 2 : 64;
+            size_dist.sizes = realloc(size_dist.sizes, cap * sizeof(size_t));
+            size_dist.cdf = realloc(size_dist.cdf, cap * sizeof(double));
+            if (size_dist.sizes == NULL || size_dist.cdf == NULL) error("realloc()");
+        }
+        total += w;
+        size_dist.sizes[size_dist.n] = len;
+        size_dist.cdf[size_dist.n++] = total;
+        if (len > size_dist.max) size_dist.max = len;
+    }
+    fclose(f);
+
+    return size_dist.n && total > 0 ? 0 : -1;
+}
+
+/* Разобрать -s; 0 при успехе. */
+static inline int size_parse(const char* spec)
+{
+    char* end;
+    long a, b;
+    double median, sigma, max = 0;
+
+    if (!strncmp(spec, "uniform:", 8)) {
+        if (sscanf(spec + 8, "%ld:%ld", &a, &b) != 2 || a < 0 || b < a) return -1;
+        size_dist.kind = SIZE_UNIFORM;
+        size_dist.min = a;
+        size_dist.max = b;
+    } else if (!strncmp(spec, "lognormal:", 10)) {
+        if (sscanf(spec + 10, "%lf:%lf:%lf", &median, &sigma, &max) < 2 || median < 1 || sigma < 0 ||
+            max < 0) return -1;
+        size_dist.kind = SIZE_LOGNORMAL;
+        size_dist.mu = log(median);
+        size_dist.sigma = sigma;
+        size_dist.min = 0;
+        //z(0.9999) = 3.719
+        size_dist.max = max ? max : exp(size_dist.mu + 3.719 * sigma);
+    } else if (!strncmp(spec, "hist:", 5)) {
+        size_dist.kind = SIZE_HIST;
+        return size_hist_load(spec + 5);
+    } else {
+        a = strtol(spec, &end, 10);
+        if (end == spec || *end || a < 0) return -1;
+        size_dist.kind = SIZE_FIXED;
+        size_dist.min = size_dist.max = a;
+    }
+
+    return 0;
+}
+
+/*
+ * Длина очередного сообщения без завершающего '\n'.
+ */
+static inline size_t message_length(struct rng* r)
+{
+    double x;
+    size_t lo, hi, mid;
+
+    switch (size_dist.kind) {
+    case SIZE_FIXED:
+        return size_dist.min;
+    case SIZE_UNIFORM:
+        return size_dist.min + rng_below(r, size_dist.max - size_dist.min + 1);
+    case SIZE_LOGNORMAL:
+        //нормальная величина по Боксу - Мюллеру
+        x = sqrt(-2 * log(1 - rng_unit(r))) * cos(2 * M_PI * rng_unit(r));
+        x = exp(size_dist.mu + size_dist.sigma * x);
+        return x < size_dist.max ? (size_t)x : size_dist.max;
+    default:
+        //первая строка, накопленный вес которой больше случайного
+        x = rng_unit(r) * size_dist.cdf[size_dist.n - 1];
+        for (lo = 0, hi = size_dist.n - 1; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (size_dist.cdf[mid] > x) hi = mid;
+            else lo = mid + 1;
+        }
+        return size_dist.sizes[lo];
+    }
+}
+
+#endif
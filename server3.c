@@ -1,385 +1,3748 @@
-﻿/*
- * Шаблон параллельного эхо-сервера TCP, работающего по модели
- * "один клиент - один поток".
- *
- * Компиляция:
- *      gcc -Wall -O2 -lpthread -o server3 server3.c
-
-    -Wall - сообщения о предупреждениях и ошибках
-    -O2 - уровень оптимизации (безопасная оптимизация всего)
-    -lpthread - связывание с многопоточной библиотекой pthread -> link pthread
-    -o имя исполняемого файла (без флага создаст a.out)
-
- */
-
-#include <errno.h>
-#include <netinet/in.h>
-#include <pthread.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/socket.h>
-#include <unistd.h>
-#include <assert.h>
-#include <time.h>
-
- /*
-  * Конфигурация сервера.
-  */
-#define PORT 1027
-#define BACKLOG 5
-#define MAXLINE 256
-
-#define SA struct sockaddr
-
-  /*
-   * Обработчик фатальных ошибок.
-   */
-void error(const char* s)
-{
-    perror(s);
-    exit(-1);
-}
-
-/*
- * Функции-обёртки.
- */
-/*
-* Socket() создаёт конечную точку соединения и возвращает файловый дескриптор, указывающий на эту точку.
-* Параметр domain задает домен соединения:
-* выбирает семейство протоколов, которое будет использоваться для создания соединения.
-*/
-//Параметр domain задает домен соединения: выбирает семейство протоколов,
-//которое будет использоваться для создания соединения.
-//Сокет имеет тип type, задающий семантику соединения.
-//В protocol задаётся определённый протокол, используемый с сокетом.
-//Обычно, только единственный протокол существует для поддержи определённого типа сокета с заданным семейством
-//протоколов, в этом случае в protocol можно указать 0.
-int Socket(int domain, int type, int protocol)
-{
-    int rc;
-
-    rc = socket(domain, type, protocol);
-    if (rc == -1) error("socket()");
-
-    return rc;
-}
-
-//После создания с помощью socket(2), сокет появляется в адресном пространстве(семействе адресов),
-//но без назначенного адреса.bind() назначает адрес, заданный в addr, сокету, указываемому дескриптором файла sockfd.
-//В аргументе addrlen задаётся размер структуры адреса(в байтах), на которую указывает addr.
-//В силу традиции, эта операция называется «присваивание сокету имени».
-//Обычно, сокету типа SOCK_STREAM нужно назначить локальный адрес с помощью bind() до того,
-//как он сможет принимать соединения.
-//При успешном выполнении возвращается 0. В случае ошибки возвращается -1,
-//а errno устанавливается в соответствующее значение.
-int Bind(int socket, struct sockaddr* addr, socklen_t addrlen)
-{
-    int rc;
-
-    rc = bind(socket, addr, addrlen);
-    if (rc == -1) error("bind()");
-
-    return rc;
-}
-
-//Вызов listen() помечает сокет, указанный в sockfd как пассивный, то есть как сокет,
-//который будет использоваться для приёма запросов входящих соединений с помощью accept(2).
-//Аргумент sockfd является файловым дескриптором, который ссылается на сокет типа SOCK_STREAM или SOCK_SEQPACKET.
-//Аргумент backlog задает максимальный размер, до которого может расти очередь ожидающих соединений у sockfd.
-//Если приходит запрос на соединение, а очередь полна, то клиент может получить ошибку с указание ECONNREFUSED или,
-//если низлежащий протокол поддерживает повторную передачу, запрос может быть игнорирован,
-//чтобы попытаться соединиться позднее.
-int Listen(int socket, int backlog)
-{
-    int rc;
-
-    rc = listen(socket, backlog);
-    if (rc == -1) error("listen()");
-
-    return rc;
-}
-
-//Системный вызов accept() используется с сокетами, ориентированными на установление соединения
-//(SOCK_STREAM, SOCK_SEQPACKET). Она извлекает первый запрос на соединение из очереди ожидающих
-//соединений прослушивающего сокета, sockfd, создаёт новый подключенный сокет и и возвращает новый
-//файловый дескриптор, указывающий на сокет. Новый сокет более не находится в слушающем состоянии.
-//Исходный сокет sockfd не изменяется при этом вызове.
-
-//Аргумент addr --- это указатель на структуру sockaddr. В эту структуру помещается адрес ответной стороны
-//в том виде, в каком он известен на коммуникационном уровне. Точный формат адреса, возвращаемого в параметре addr,
-//определяется семейством адресов сокета (см. socket(2) и справочную страницу по соответствующему протоколу).
-//Если addr равен NULL, то ничего не помещается; в этом случае addrlen не используется и также должен быть NULL.
-
-//Через аргумент addrlen осуществляется возврат результата : вызывающая сторона должна указать в нём
-//размер(в байтах) структуры, на которую указывает addr; при возврате он будет содержать реальный
-//размер адреса ответной стороны.
-int Accept(int socket, struct sockaddr* addr, socklen_t* addrlen)
-{
-    int rc;
-
-    for (;;) {
-        rc = accept(socket, addr, addrlen);
-        if (rc != -1) break;
-        //EINTR - Системный вызов прервал сигналом, который поступил до момента прихода допустимого соединения
-        //ECONNABORTED - Соединение было прервано
-        if (errno == EINTR || errno == ECONNABORTED) continue;
-        error("accept()");
-    }
-
-    return rc;
-}
-
-//Закрывает файловый дескриптор, который после этого не ссылается ни на один и файл и может быть использован повторно.
-void Close(int fd)
-{
-    int rc;
-
-    for (;;) {
-        rc = close(fd);
-        if (!rc) break;
-        if (errno == EINTR) continue;
-        error("close()");
-    }
-}
-
-//Вызов read() пытается прочитать count байт из файлового дескриптора fd в буфер, начинающийся по адресу buf.
-size_t Read(int fd, void* buf, size_t count)
-{
-    ssize_t rc;
-
-    for (;;) {
-        //количество успешно прочитанных байтов (не более count)
-        rc = read(fd, buf, count);
-        if (rc != -1) break;
-        if (errno == EINTR) continue;
-        error("read()");
-    }
-
-    return rc;
-}
-
-//Пишет до count байт из буфера, на который указывает buf, в файле, на который ссылается файловый дескриптор fd.
-size_t Write(int fd, const void* buf, size_t count)
-{
-    ssize_t rc;
-
-    for (;;) {
-        //В случае успеха возвращается количество записанных байтов.
-        rc = write(fd, buf, count);
-        if (rc != -1) break;
-        //EINTR - Системный вызов прервал сигналом, который поступил до момента прихода допустимого соединения
-        if (errno == EINTR) continue;
-        error("write()");
-    }
-    //сколько записали (не более count)
-    return rc;
-}
-
-//Распределяет size байтов и возвращает указатель на распределенную память. Память при этом не "очищается".
-void* Malloc(size_t size)
-{
-    void* rc;
-
-    rc = malloc(size);
-    if (rc == NULL) error("malloc()");
-
-    return rc;
-}
-
-//Функция получает в качестве аргументов указатель на поток, переменную типа pthread_t, в которую,
-//в случае удачного завершения сохраняет id потока. pthread_attr_t – атрибуты потока.
-//В случае если используются атрибуты по умолчанию, то можно передавать NULL.
-//start_routin – это непосредственно та функция, которая будет выполняться в новом потоке.
-//arg – это аргументы, которые будут переданы функции.
-//Поток может выполнять много разных дел и получать разные аргументы.Для этого функция,
-//которая будет запущена в новом потоке, принимает аргумент типа void*.
-//За счёт этого можно обернуть все передаваемые аргументы в структуру.
-//Возвращать значение можно также через передаваемый аргумент.
-
-//В случае успешного выполнения функция возвращает 0.
-//Если произошли ошибки, то могут быть возвращены следующие значения
-//EAGAIN – у системы нет ресурсов для создания нового потока, или система не может больше создавать потоков,
-// так как количество потоков превысило значение PTHREAD_THREADS_MAX(например, на одной из машин,
-// которые используются для тестирования, это магическое число равно 2019)
-//EINVAL – неправильные атрибуты потока(переданные аргументом attr)
-//EPERM – Вызывающий поток не имеет должных прав для того, чтобы задать нужные параметры или политики планировщика.
-void Pthread_create(pthread_t* thread, pthread_attr_t* attr,
-    void* (*start_routine)(void*), void* arg)
-{
-    int rc;
-
-    rc = pthread_create(thread, attr, start_routine, arg);
-    if (rc) {
-        errno = rc;
-        error("pthread_create()");
-    }
-}
-
-/*
- * Чтение строки из сокета.
- */
- //откуда + куда + сколько 
-size_t reads(int socket, char* s, size_t size)
-{
-    char* p;
-    size_t n, rc;
-
-    /* Проверить корректность переданных аргументов. */
-    if (s == NULL) {
-        errno = EFAULT; //неверный адрес
-        error("reads()");
-    }
-    //если хотели считать 0, ничего читать не нужно, уходим
-    if (!size) return 0;
-
-    p = s;
-    size--;
-    n = 0;
-    while (n < size) {
-        //читаем по одному байту
-        rc = Read(socket, p, 1);
-        if (rc == 0) break;
-        //с новой строки не читаем
-        if (*p == '\n') {
-            p++;
-            n++;
-            break;
-        }
-        p++;
-        n++;
-    }
-    *p = 0;
-
-    return n;
-}
-
-/*
- * Запись count байтов в сокет.
- */
- //куда + откуда + сколько записывать
-size_t writen(int socket, const char* buf, size_t count)
-{
-    const char* p;
-    size_t n, rc;
-
-    /* Проверить корректность переданных аргументов. */
-    if (buf == NULL) {
-        errno = EFAULT; //неверный адрес
-        error("writen()");
-    }
-
-    //теперь указываем на переданное "откуда"
-    p = buf;
-    //переданное "сколько"
-    n = count;
-    while (n) {
-        rc = Write(socket, p, count);
-        //отнимает количество байт, которое удалось записать
-        n -= rc;
-        //сдвигаем указатель на начало незаписанных байтов
-        p += rc;
-    }
-
-    return count;
-}
-
-void* serve_client(void* arg)
-{
-    int socket;
-    //char s[MAXLINE];
-    //ssize_t rc;
-
-    /* Перевести поток в отсоединенное (detached) состояние. */
-// когда он завершается, все занимаемые им ресурсы освобождаются и мы не можем отслеживать его завершение
-//pthread_self - получение потоком своего идентификатора
-    pthread_detach(pthread_self());
-
-    //забираем дескриптор сокета из аргумента
-    socket = *((int*)arg);
-    free(arg);
-
-    char *random_message = malloc(sizeof(char) * (rand() % 11 + 1));
-    for (int i = 0; i < rand() % 11; i++) {
-    	random_message[i] = 'a' + rand() % ('z' - 'a' + 1);
-    }
-    random_message[rand() % 10] = '\0';
-
-
-    writen(socket, random_message, 64);
-
-    Close(socket);
-
-    return NULL;
-}
-
-int main(void)
-{
-    srand(time(NULL));
-
-    //прослушивающий сокет ждет запроса на соединение, ни с кем не соединен
-    int lsocket;    /* Дескриптор прослушиваемого сокета. */
-
-    //активный сокет, соединен с удаленным активным сокетом через открытое соединение данных
-    //уничтожится при закрытии соединения
-    int csocket;    /* Дескриптор присоединенного сокета. */
-
-    //adress_family + sin_port + sin_addr + sin_zero (не используется)
-    struct sockaddr_in servaddr;
-
-    int* arg;
-
-    //идентификатор потока (по сути число)
-    pthread_t thread;
-
-    /* Создать сокет. */
-//PF_INET - IP версии 4 (PF_UNIX, PF_LOCAL - протокол Unix для локального взаимодействия)
-//SOCK_STREAM - надежный двусторонний обмен потоками байтов 
-//(SOCK_DGRAM - ненадежный обмен на основе передачи датаграмм без установления соединения)
-//Третий параметр указывает номер конкретного протокола в рамках указанного семейства для указанного типа сокета. 
-//Как правило, существует единственный протокол для каждого типа сокета внутри каждого семейства.
-
-//Вернет дескриптор сокета (некоторый идентификатор, например, номер записи в системной таблице)
-    //PF_INET - Протоколы Интернет IPv4
-    //SOCK_STREAM - jбеспечивает создание двусторонних, надёжных потоков байтов на основе установления соединения.
-    //Может также поддерживаться механизм внепоточных данных.
-    lsocket = Socket(PF_INET, SOCK_STREAM, 0);
-
-    /* Инициализировать структуру адреса сокета сервера. */
-//заполняем нулями
-    memset(&servaddr, 0, sizeof(servaddr));
-    //AF_INET соответствует Internet-домену (AF -> address family) 
-    //(AF_UNIX для передачи данных используется файловая система ввода/вывода Unix)
-    servaddr.sin_family = AF_INET;
-    //htons преобразует u_short из хоста в сетевой порядок байтов TCP/IP (сетевой - человеческий, в памяти - обратный).
-    servaddr.sin_port = htons(PORT);
-    //аналогично для целого
-    //INADDR_ANY - любой локальный интерфейс (= 0)
-    //если нужен конкретный адрес = inet_addr ("192.168.78.2")
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    /* Связать сокет с локальным адресом протокола. */
-//После создания с помощью socket(2), сокет появляется в адресном пространстве (семействе адресов), но без назначенного адреса. 
-//bind() назначает адрес, заданный в addr, сокету, указываемому дескриптором файла sockfd.
-    Bind(lsocket, (SA*)&servaddr, sizeof(servaddr));
-
-    /* Преобразовать неприсоединенный сокет в пассивный. */
-//Вызов listen() помечает сокет, указанный в sockfd как пассивный,
-//то есть как сокет, который будет использоваться для приёма запросов входящих соединений
-    Listen(lsocket, BACKLOG);
-
-    for (;;) {
-
-        //извлекает первый запрос на соединение из очереди ожидающих соединений прослушивающего сокета,
-        //создаёт новый подключенный сокет и и возвращает новый файловый дескриптор, указывающий на сокет
-        csocket = Accept(lsocket, NULL, 0);
-
-        arg = Malloc(sizeof(int));
-        *arg = csocket;
-
-        //указатель на поток + атрибуты потока + функция для выполнения + аргументы для функции
-        Pthread_create(&thread, NULL, serve_client, arg);
-    }
-
-    return 0;
-}
+﻿/*
+ * Шаблон параллельного эхо-сервера TCP, работающего по модели
+ * "один клиент - один поток".
+ *
+ * Компиляция:
+ *      gcc -Wall -O2 -o server3 server3.c -lpthread -lm
+ * (или просто make, см. Makefile)
+
+    -Wall - сообщения о предупреждениях и ошибках
+    -O2 - уровень оптимизации (безопасная оптимизация всего)
+    -lpthread - связывание с многопоточной библиотекой pthread -> link pthread
+    -lm - математическая библиотека (log, exp для распределения длин сообщений)
+    -o имя исполняемого файла (без флага создаст a.out)
+
+ */
+
+//accept4()
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <linux/perf_event.h>
+
+#include "shmstats.h"
+#include "tune.h"
+#include "capture.h"
+#include "message.h"
+#include "mcast.h"
+#include <assert.h>
+#include <time.h>
+
+ /*
+  * Конфигурация сервера.
+  */
+#define PORT 1027
+#define BACKLOG 5
+#define MAXLINE 256
+#define MAXCONN 1024
+#define HUGE_PAGE (2UL << 20)
+#define CORO_STACK (64UL << 10)    /* Стек сопрограммы в режиме coro. */
+
+#define SA struct sockaddr
+
+/*
+ * Режимы обслуживания (-m).
+ */
+enum {
+    MODE_THREAD,    /* "один клиент - один поток" */
+    MODE_PREFORK,   /* несколько процессов, каждый со своим циклом accept() */
+    MODE_CORO,      /* сопрограммы на нескольких потоках-планировщиках */
+    MODE_MULTICAST, /* рассылка потока сообщений в группу multicast, без соединений */
+    MODE_EVENT      /* соединения в epoll без потоков и буферов, пока молчат */
+};
+
+/*
+ * Параметры, задаваемые из командной строки (см. show_usage()).
+ * Значения по умолчанию повторяют исходное поведение сервера.
+ */
+static int port = PORT;         /* Порт прослушиваемого сокета. */
+static int backlog = BACKLOG;   /* Длина очереди ожидающих соединений. */
+static int keepalive = 0;       /* Отвечать на каждую строку запроса, а не один раз. */
+static int max_conns = MAXCONN; /* Одновременно обслуживаемых соединений. */
+static int mode = MODE_THREAD;  /* Режим обслуживания. */
+static int nprocs = 0;          /* Процессов prefork (потоков coro); 0 - по числу CPU. */
+static int hugepages = 0;       /* Пулы в страницах по 2 МБ. */
+static int perf_counters = 0;   /* Считать промахи dTLB. */
+static long self_requests = 0;  /* Запросов самому себе при прогреве. */
+static const char* handoff_path = NULL;   /* Ждать смены процесса на этом сокете. */
+static const char* takeover_path = NULL;  /* Забрать порт у работающего процесса. */
+static int takeover_conns = 0;  /* Забрать и простаивающие соединения. */
+static int drain_timeout = 10;  /* --drain-timeout, с: срок простоя соединений после передачи порта. */
+static const struct tune_profile* tune = &tune_profiles[0];  /* Настройка сокетов (--tune). */
+
+/* Запрошена остановка сервера (SIGINT, SIGTERM). */
+static volatile sig_atomic_t stop = 0;
+
+/*
+ * В режиме coro обертки ввода-вывода не ждут в ядре, а уступают поток
+ * другим сопрограммам (см. coro_wait_io()). Вне сопрограмм - 0.
+ */
+int coro_active(void);
+int coro_wait_io(void);
+
+  /*
+   * Обработчик фатальных ошибок.
+   */
+void error(const char* s)
+{
+    perror(s);
+    exit(-1);
+}
+
+/*
+ * Функции-обёртки.
+ */
+/*
+* Socket() создаёт конечную точку соединения и возвращает файловый дескриптор, указывающий на эту точку.
+* Параметр domain задает домен соединения:
+* выбирает семейство протоколов, которое будет использоваться для создания соединения.
+*/
+//Параметр domain задает домен соединения: выбирает семейство протоколов,
+//которое будет использоваться для создания соединения.
+//Сокет имеет тип type, задающий семантику соединения.
+//В protocol задаётся определённый протокол, используемый с сокетом.
+//Обычно, только единственный протокол существует для поддержи определённого типа сокета с заданным семейством
+//протоколов, в этом случае в protocol можно указать 0.
+int Socket(int domain, int type, int protocol)
+{
+    int rc;
+
+    rc = socket(domain, type, protocol);
+    if (rc == -1) error("socket()");
+
+    return rc;
+}
+
+//После создания с помощью socket(2), сокет появляется в адресном пространстве(семействе адресов),
+//но без назначенного адреса.bind() назначает адрес, заданный в addr, сокету, указываемому дескриптором файла sockfd.
+//В аргументе addrlen задаётся размер структуры адреса(в байтах), на которую указывает addr.
+//В силу традиции, эта операция называется «присваивание сокету имени».
+//Обычно, сокету типа SOCK_STREAM нужно назначить локальный адрес с помощью bind() до того,
+//как он сможет принимать соединения.
+//При успешном выполнении возвращается 0. В случае ошибки возвращается -1,
+//а errno устанавливается в соответствующее значение.
+int Bind(int socket, struct sockaddr* addr, socklen_t addrlen)
+{
+    int rc;
+
+    rc = bind(socket, addr, addrlen);
+    if (rc == -1) error("bind()");
+
+    return rc;
+}
+
+//Вызов listen() помечает сокет, указанный в sockfd как пассивный, то есть как сокет,
+//который будет использоваться для приёма запросов входящих соединений с помощью accept(2).
+//Аргумент sockfd является файловым дескриптором, который ссылается на сокет типа SOCK_STREAM или SOCK_SEQPACKET.
+//Аргумент backlog задает максимальный размер, до которого может расти очередь ожидающих соединений у sockfd.
+//Если приходит запрос на соединение, а очередь полна, то клиент может получить ошибку с указание ECONNREFUSED или,
+//если низлежащий протокол поддерживает повторную передачу, запрос может быть игнорирован,
+//чтобы попытаться соединиться позднее.
+int Listen(int socket, int backlog)
+{
+    int rc;
+
+    rc = listen(socket, backlog);
+    if (rc == -1) error("listen()");
+
+    return rc;
+}
+
+//Системный вызов accept() используется с сокетами, ориентированными на установление соединения
+//(SOCK_STREAM, SOCK_SEQPACKET). Она извлекает первый запрос на соединение из очереди ожидающих
+//соединений прослушивающего сокета, sockfd, создаёт новый подключенный сокет и и возвращает новый
+//файловый дескриптор, указывающий на сокет. Новый сокет более не находится в слушающем состоянии.
+//Исходный сокет sockfd не изменяется при этом вызове.
+
+//Аргумент addr --- это указатель на структуру sockaddr. В эту структуру помещается адрес ответной стороны
+//в том виде, в каком он известен на коммуникационном уровне. Точный формат адреса, возвращаемого в параметре addr,
+//определяется семейством адресов сокета (см. socket(2) и справочную страницу по соответствующему протоколу).
+//Если addr равен NULL, то ничего не помещается; в этом случае addrlen не используется и также должен быть NULL.
+
+//Через аргумент addrlen осуществляется возврат результата : вызывающая сторона должна указать в нём
+//размер(в байтах) структуры, на которую указывает addr; при возврате он будет содержать реальный
+//размер адреса ответной стороны.
+int Accept(int socket, struct sockaddr* addr, socklen_t* addrlen)
+{
+    int rc;
+
+    for (;;) {
+        //сокет сопрограммы должен быть неблокирующим с самого начала
+        rc = coro_active() ? accept4(socket, addr, addrlen, SOCK_NONBLOCK) : accept(socket, addr, addrlen);
+        if (rc != -1) break;
+        //EINTR - Системный вызов прервал сигналом, который поступил до момента прихода допустимого соединения
+        //ECONNABORTED - Соединение было прервано
+        //если сигнал означал остановку сервера, сообщаем об этом вызывающему
+        if (errno == EINTR && stop) return -1;
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        //в сопрограмме: очередь пуста, ждем, пропуская вперед другие
+        if (errno == EAGAIN && coro_wait_io()) continue;
+        error("accept()");
+    }
+
+    return rc;
+}
+
+//Закрывает файловый дескриптор, который после этого не ссылается ни на один и файл и может быть использован повторно.
+void Close(int fd)
+{
+    int rc;
+
+    for (;;) {
+        rc = close(fd);
+        if (!rc) break;
+        if (errno == EINTR) continue;
+        error("close()");
+    }
+}
+
+//Вызов read() пытается прочитать count байт из файлового дескриптора fd в буфер, начинающийся по адресу buf.
+size_t Read(int fd, void* buf, size_t count)
+{
+    ssize_t rc;
+
+    for (;;) {
+        //количество успешно прочитанных байтов (не более count)
+        rc = read(fd, buf, count);
+        if (rc != -1) break;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN && coro_wait_io()) continue;
+        //клиент закрыл соединение сбросом (SO_LINGER 0): для чтения это конец потока
+        if (errno == ECONNRESET) return 0;
+        error("read()");
+    }
+
+    return rc;
+}
+
+//Пишет до count байт из буфера, на который указывает buf, в файле, на который ссылается файловый дескриптор fd.
+size_t Write(int fd, const void* buf, size_t count)
+{
+    ssize_t rc;
+
+    for (;;) {
+        //В случае успеха возвращается количество записанных байтов.
+        rc = write(fd, buf, count);
+        if (rc != -1) break;
+        //EINTR - Системный вызов прервал сигналом, который поступил до момента прихода допустимого соединения
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN && coro_wait_io()) continue;
+        error("write()");
+    }
+    //сколько записали (не более count)
+    return rc;
+}
+
+//Распределяет size байтов и возвращает указатель на распределенную память. Память при этом не "очищается".
+void* Malloc(size_t size)
+{
+    void* rc;
+
+    rc = malloc(size);
+    if (rc == NULL) error("malloc()");
+
+    return rc;
+}
+
+#ifdef ALLOC_TRACE
+/*
+ * Отладочная сборка (make server3-alloc): malloc() и free() подменяются
+ * своими, которые считают выделения по фазам обработки соединения.
+ * После прогрева (ALLOC_WARM_CONNS соединений) сервер должен работать
+ * без выделений памяти; каждое такое выделение сообщается в stderr.
+ */
+#include <malloc.h>
+
+#define ALLOC_WARM_CONNS 16
+#define ALLOC_MAX_REPORTS 20
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+enum alloc_phase { PHASE_STARTUP, PHASE_ACCEPT, PHASE_SERVE, PHASE_CLOSE, NPHASES };
+
+static const char* phase_names[NPHASES] = { "startup", "accept", "serve", "close" };
+
+static struct {
+    unsigned long allocs, frees;
+    unsigned long alloc_bytes, free_bytes;
+} alloc_stats[NPHASES];
+
+static __thread int alloc_phase = PHASE_STARTUP;
+static __thread int alloc_busy;         /* Защита от рекурсии при выводе. */
+static unsigned long alloc_conns;       /* Принято соединений. */
+static unsigned long steady_allocs;     /* Выделений после прогрева. */
+
+#define alloc_set_phase(p) (alloc_phase = (p))
+
+static void alloc_note(void* p, size_t size)
+{
+    char msg[128];
+    int n, ph = alloc_phase;
+
+    if (p == NULL) return;
+    size = malloc_usable_size(p);
+    __atomic_add_fetch(&alloc_stats[ph].allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_stats[ph].alloc_bytes, size, __ATOMIC_RELAXED);
+    if (ph == PHASE_STARTUP || alloc_conns <= ALLOC_WARM_CONNS || alloc_busy) return;
+
+    //выделение в установившемся режиме
+    if (__atomic_add_fetch(&steady_allocs, 1, __ATOMIC_RELAXED) > ALLOC_MAX_REPORTS) return;
+    alloc_busy = 1;
+    n = snprintf(msg, sizeof(msg), "alloc: %zu bytes in steady state, phase %s, connection %lu\n",
+        size, phase_names[ph], alloc_conns);
+    if (n > 0) write(STDERR_FILENO, msg, n);
+    alloc_busy = 0;
+}
+
+void* malloc(size_t size)
+{
+    void* p = __libc_malloc(size);
+
+    alloc_note(p, size);
+    return p;
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    void* p = __libc_calloc(nmemb, size);
+
+    alloc_note(p, nmemb * size);
+    return p;
+}
+
+static void free_note(size_t size)
+{
+    __atomic_add_fetch(&alloc_stats[alloc_phase].frees, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_stats[alloc_phase].free_bytes, size, __ATOMIC_RELAXED);
+}
+
+void free(void* ptr)
+{
+    if (ptr == NULL) return;
+    free_note(malloc_usable_size(ptr));
+    __libc_free(ptr);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    size_t old = ptr != NULL ? malloc_usable_size(ptr) : 0;
+    void* p;
+
+    p = __libc_realloc(ptr, size);
+    if (p != NULL && ptr != NULL) free_note(old);
+    alloc_note(p, size);
+    return p;
+}
+
+/*
+ * Итог по фазам: сколько выделено и освобождено, утечка на соединение.
+ */
+void alloc_report(void)
+{
+    unsigned long allocs = 0, frees = 0, bytes = 0, freed = 0;
+    int i;
+
+    alloc_busy = 1;
+    fprintf(stderr, "alloc: %-8s %10s %12s %10s %12s\n",
+        "phase", "allocs", "bytes", "frees", "bytes");
+    for (i = 0; i < NPHASES; i++) {
+        fprintf(stderr, "alloc: %-8s %10lu %12lu %10lu %12lu\n", phase_names[i],
+            alloc_stats[i].allocs, alloc_stats[i].alloc_bytes,
+            alloc_stats[i].frees, alloc_stats[i].free_bytes);
+        if (i == PHASE_STARTUP) continue;
+        allocs += alloc_stats[i].allocs;
+        frees += alloc_stats[i].frees;
+        bytes += alloc_stats[i].alloc_bytes;
+        freed += alloc_stats[i].free_bytes;
+    }
+    fprintf(stderr, "alloc: %lu connections, %lu steady-state allocations, "
+        "%.1f bytes leaked per connection\n", alloc_conns, steady_allocs,
+        alloc_conns ? ((double)bytes - freed) / alloc_conns : 0);
+}
+#else
+#define alloc_set_phase(p) ((void)0)
+#endif
+
+/*
+ * Память под пулы.
+ *
+ * С ключом -H пулы размещаются в страницах по 2 МБ, чтобы тысячи
+ * соединений и их буферы укладывались в немногие записи TLB. Сначала
+ * пробуется MAP_HUGETLB (нужны заранее зарезервированные страницы,
+ * vm.nr_hugepages); если их нет - обычная память, выровненная по 2 МБ,
+ * с madvise(MADV_HUGEPAGE) для прозрачных больших страниц (THP).
+ * В обоих случаях память заполняется страницами сразу при запуске,
+ * а не по первому обращению во время обслуживания.
+ */
+static size_t hugetlb_bytes;    /* Выделено в MAP_HUGETLB. */
+static size_t thp_bytes;        /* Выделено с MADV_HUGEPAGE. */
+
+void* region_alloc(size_t size)
+{
+    char *p, *aligned;
+    size_t i;
+
+    if (!hugepages) return Malloc(size);
+
+    size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (p != MAP_FAILED) {
+        hugetlb_bytes += size;
+        return p;
+    }
+
+    //выравниваем по 2 МБ вручную: берем с запасом и отрезаем лишнее
+    p = mmap(NULL, size + HUGE_PAGE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) error("mmap()");
+    aligned = (char*)(((uintptr_t)p + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+    if (aligned != p) munmap(p, aligned - p);
+    munmap(aligned + size, p + HUGE_PAGE - aligned);
+    madvise(aligned, size, MADV_HUGEPAGE);
+    for (i = 0; i < size; i += 4096) aligned[i] = 0;
+    thp_bytes += size;
+
+    return aligned;
+}
+
+/*
+ * Счетчики промахов dTLB (чтение и запись) для всего процесса,
+ * включая потоки, созданные после открытия. Если ядро или виртуальная
+ * машина их не поддерживают, сервер работает без них.
+ */
+static int tlb_fd[2] = { -1, -1 };
+
+void tlb_counters_open(void)
+{
+    struct perf_event_attr attr;
+    int i, op[2] = { PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_OP_WRITE };
+
+    for (i = 0; i < 2; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (op[i] << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.exclude_kernel = 1;
+        attr.inherit = 1;
+        tlb_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (tlb_fd[0] == -1) perror("perf_event_open(dTLB)");
+}
+
+/*
+ * Итоговый отчет сервера в stderr при штатном завершении.
+ */
+void report(unsigned long nconns)
+{
+    unsigned long long v[2] = { 0, 0 };
+    int i;
+
+    if (hugepages) {
+        fprintf(stderr, "pools: %zu MB in hugetlb pages, %zu MB with THP advice\n",
+            hugetlb_bytes >> 20, thp_bytes >> 20);
+    }
+    if (perf_counters && tlb_fd[0] != -1) {
+        for (i = 0; i < 2; i++) {
+            if (tlb_fd[i] == -1 || read(tlb_fd[i], &v[i], sizeof(v[i])) != sizeof(v[i])) v[i] = 0;
+        }
+        fprintf(stderr, "dTLB: %llu load misses, %llu store misses, %.1f per connection\n",
+            v[0], v[1], nconns ? (double)(v[0] + v[1]) / nconns : 0);
+    }
+#ifdef ALLOC_TRACE
+    alloc_report();
+#endif
+}
+
+/*
+ * Счетчики обслуживания (см. shmstats.h). Лежат в общей памяти: в
+ * режиме prefork главный процесс видит счетчики рабочих и после их
+ * перезапуска, а с ключом --stats - в файле в /dev/shm, который
+ * читает shmstat без обращений к серверу.
+ *
+ * Каждый поток пишет в свою ячейку процесса (при числе потоков
+ * больше числа ячеек - в общую с другими, seqlock это допускает).
+ */
+#define STATS_SLOTS 16
+
+static const char* stats_name = NULL;   /* Файл статистики (--stats). */
+static struct stats_header* stats;
+static int stats_proc = 0;              /* Номер текущего процесса. */
+static unsigned stats_gen = 0;          /* Его поколение: перезапусков ячейки до него. */
+static unsigned stats_next_slot;        /* Раздача ячеек потокам. */
+static struct stats_counters* stats_base;   /* Ячейки процесса до прогрева. */
+static __thread struct stats_slot* my_slot;
+
+void stats_init(int nprocs, int per_proc)
+{
+    size_t size = stats_file_size(nprocs, per_proc);
+    char path[PATH_MAX];
+    struct timespec ts;
+    int fd = -1, flags = MAP_SHARED | MAP_ANONYMOUS;
+
+    if (stats_name != NULL) {
+        //имя без '/' - файл в /dev/shm
+        snprintf(path, sizeof(path), "%s%s", strchr(stats_name, '/') ? "" : "/dev/shm/", stats_name);
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) error(path);
+        if (ftruncate(fd, size) == -1) error("ftruncate()");
+        flags = MAP_SHARED;
+    }
+    stats = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (stats == MAP_FAILED) error("mmap()");
+    if (fd != -1) Close(fd);
+
+    stats->header_size = sizeof(struct stats_header);
+    stats->proc_size = sizeof(struct stats_proc);
+    stats->slot_size = sizeof(struct stats_slot);
+    stats->hist_buckets = STATS_HIST_BUCKETS;
+    stats->nprocs = nprocs;
+    stats->slots_per_proc = per_proc;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    stats->start_time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    stats->pid = getpid();
+    stats->version = STATS_VERSION;
+    //magic последним: читатель, увидевший его, видит и остальной заголовок
+    __atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* Захватить ячейку для записи (сторона писателя seqlock). */
+void stats_lock(struct stats_slot* s)
+{
+    uint32_t seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+        if (!(seq & 1) && __atomic_compare_exchange_n(&s->seq, &seq, seq + 1, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        stats_cpu_relax();
+    }
+}
+
+/* Захватить ячейку текущего потока. */
+struct stats_slot* stats_begin(void)
+{
+    struct stats_slot* s = my_slot;
+
+    if (s == NULL) {
+        s = my_slot = stats_slots(stats) + stats_proc * stats->slots_per_proc +
+            __atomic_fetch_add(&stats_next_slot, 1, __ATOMIC_RELAXED) % stats->slots_per_proc;
+    }
+    stats_lock(s);
+
+    return s;
+}
+
+void stats_end(struct stats_slot* s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+void stats_conn(void)
+{
+    struct stats_slot* s = stats_begin();
+
+    s->c.conns++;
+    stats_end(s);
+}
+
+/*
+ * Учесть отправленное сообщение длины len, обслуженное за ns наносекунд.
+ */
+void stats_request(size_t len, uint64_t ns)
+{
+    struct stats_slot* s = stats_begin();
+    int b = ns ? 63 - __builtin_clzll(ns) : 0;
+
+    s->c.requests++;
+    s->c.bytes += len;
+    s->c.hist[b < STATS_HIST_BUCKETS ? b : STATS_HIST_BUCKETS - 1]++;
+    stats_end(s);
+}
+
+/* Учесть байты длинного сообщения, отправленные до его окончания. */
+void stats_bytes(size_t len)
+{
+    struct stats_slot* s = stats_begin();
+
+    s->c.bytes += len;
+    stats_end(s);
+}
+
+/*
+ * Запомнить ячейки текущего процесса перед прогревом. Потоков у
+ * процесса еще нет, так что нечетный seq оставил писатель, умерший
+ * вместе с прежним рабочим prefork: ячейка открывается снова, иначе
+ * ни писатели, ни читатели ее больше не дождутся.
+ */
+void stats_mark(void)
+{
+    struct stats_slot* s = stats_slots(stats) + stats_proc * stats->slots_per_proc;
+    uint32_t i;
+
+    stats_base = Malloc(sizeof(*stats_base) * stats->slots_per_proc);
+    for (i = 0; i < stats->slots_per_proc; i++) {
+        if (__atomic_load_n(&s[i].seq, __ATOMIC_RELAXED) & 1) stats_end(&s[i]);
+        stats_snapshot(&s[i], &stats_base[i]);
+    }
+}
+
+/*
+ * Убрать прогрев из ячеек текущего процесса: вернуть их к отметке
+ * stats_mark(). У перезапущенного рабочего prefork там остаются
+ * счетчики его предшественников.
+ */
+void stats_reset(void)
+{
+    struct stats_slot* s = stats_slots(stats) + stats_proc * stats->slots_per_proc;
+    uint32_t i;
+
+    for (i = 0; i < stats->slots_per_proc; i++) {
+        stats_lock(&s[i]);
+        s[i].c = stats_base[i];
+        stats_end(&s[i]);
+    }
+    free(stats_base);
+    stats_base = NULL;
+}
+
+/* Сумма по всем ячейкам. */
+void stats_total(struct stats_counters* sum)
+{
+    struct stats_slot* s = stats_slots(stats);
+    struct stats_counters c;
+    uint32_t i;
+
+    memset(sum, 0, sizeof(*sum));
+    for (i = 0; i < stats->nprocs * stats->slots_per_proc; i++) {
+        stats_snapshot(&s[i], &c);
+        stats_accumulate(sum, &c);
+    }
+}
+
+/* Текущее время по монотонным часам, нс. */
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Итог по отправленным данным: средняя скорость с момента готовности
+ * (для потоковой отправки длинных сообщений - устойчивая скорость).
+ */
+static uint64_t ready_ns;       /* Момент готовности (notify_ready()). */
+
+void traffic_report(void)
+{
+    struct stats_counters total;
+    double sec = (now_ns() - ready_ns) / 1e9;
+
+    stats_total(&total);
+    fprintf(stderr, "sent: %llu requests, %.3f GB in %.1f s, %.3f GB/s\n",
+        (unsigned long long)total.requests, total.bytes / 1e9, sec,
+        sec > 0 ? total.bytes / 1e9 / sec : 0);
+}
+
+/*
+ * Пул объектов фиксированного размера. Память под все объекты выделяется
+ * один раз при запуске, дальше объекты только берутся и возвращаются,
+ * так что обслуживание соединений не обращается к malloc().
+ * Если свободных объектов нет, pool_get() ждет возврата.
+ */
+struct pool {
+    char* base;             /* Память под объекты. */
+    size_t size;            /* Размер объекта. */
+    size_t count;           /* Число объектов. */
+    void** free;            /* Стек свободных объектов. */
+    size_t nfree;
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+};
+
+void pool_init(struct pool* p, size_t size, size_t count)
+{
+    size_t i;
+
+    p->size = size;
+    p->count = count;
+    p->base = region_alloc(size * count);
+    p->free = region_alloc(sizeof(void*) * count);
+    for (i = 0; i < count; i++) p->free[i] = p->base + (count - 1 - i) * size;
+    p->nfree = count;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->nonempty, NULL);
+}
+
+void* pool_get(struct pool* p)
+{
+    void* obj;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->nfree) pthread_cond_wait(&p->nonempty, &p->lock);
+    obj = p->free[--p->nfree];
+    pthread_mutex_unlock(&p->lock);
+
+    return obj;
+}
+
+void pool_put(struct pool* p, void* obj)
+{
+    pthread_mutex_lock(&p->lock);
+    p->free[p->nfree++] = obj;
+    pthread_cond_signal(&p->nonempty);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Дождаться, пока в пул вернутся все объекты. */
+void pool_wait_full(struct pool* p)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->nfree < p->count) pthread_cond_wait(&p->nonempty, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Вернуть сразу n объектов под одной блокировкой. */
+void pool_put_many(struct pool* p, void** objs, size_t n)
+{
+    size_t i;
+
+    if (!n) return;
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; i < n; i++) p->free[p->nfree++] = objs[i];
+    pthread_cond_broadcast(&p->nonempty);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Состояние соединения. Берется из conn_pool при accept() и
+ * возвращается, когда соединение закрыто (в режиме event - ячейка
+ * таблицы соединений).
+ */
+struct conn {
+    int fd;                 /* Дескриптор присоединенного сокета. */
+    unsigned long id;       /* Порядковый номер соединения. */
+    struct rng rng;         /* Генератор сообщений соединения. */
+    char* buf;              /* Буфер сообщений из buf_pool на время обслуживания. */
+};
+
+static struct pool conn_pool;   /* Объекты struct conn. */
+static struct pool buf_pool;    /* Буферы сообщений, по одному на соединение. */
+
+//Функция получает в качестве аргументов указатель на поток, переменную типа pthread_t, в которую,
+//в случае удачного завершения сохраняет id потока. pthread_attr_t – атрибуты потока.
+//В случае если используются атрибуты по умолчанию, то можно передавать NULL.
+//start_routin – это непосредственно та функция, которая будет выполняться в новом потоке.
+//arg – это аргументы, которые будут переданы функции.
+//Поток может выполнять много разных дел и получать разные аргументы.Для этого функция,
+//которая будет запущена в новом потоке, принимает аргумент типа void*.
+//За счёт этого можно обернуть все передаваемые аргументы в структуру.
+//Возвращать значение можно также через передаваемый аргумент.
+
+//В случае успешного выполнения функция возвращает 0.
+//Если произошли ошибки, то могут быть возвращены следующие значения
+//EAGAIN – у системы нет ресурсов для создания нового потока, или система не может больше создавать потоков,
+// так как количество потоков превысило значение PTHREAD_THREADS_MAX(например, на одной из машин,
+// которые используются для тестирования, это магическое число равно 2019)
+//EINVAL – неправильные атрибуты потока(переданные аргументом attr)
+//EPERM – Вызывающий поток не имеет должных прав для того, чтобы задать нужные параметры или политики планировщика.
+//
+//Чтобы сигнал остановки получал главный поток, прерывая accept(), поток создается с заблокированными
+//SIGINT и SIGTERM: маску он наследует, так что сигнал не достанется ему и до первой его инструкции.
+void Pthread_create(pthread_t* thread, pthread_attr_t* attr,
+    void* (*start_routine)(void*), void* arg)
+{
+    sigset_t set, old;
+    int rc;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    rc = pthread_create(thread, attr, start_routine, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc) {
+        errno = rc;
+        error("pthread_create()");
+    }
+}
+
+/*
+ * Чтение строки из сокета.
+ */
+ //откуда + куда + сколько 
+size_t reads(int socket, char* s, size_t size)
+{
+    char* p;
+    size_t n, rc;
+
+    /* Проверить корректность переданных аргументов. */
+    if (s == NULL) {
+        errno = EFAULT; //неверный адрес
+        error("reads()");
+    }
+    //если хотели считать 0, ничего читать не нужно, уходим
+    if (!size) return 0;
+
+    p = s;
+    size--;
+    n = 0;
+    while (n < size) {
+        //читаем по одному байту
+        rc = Read(socket, p, 1);
+        if (rc == 0) break;
+        //с новой строки не читаем
+        if (*p == '\n') {
+            p++;
+            n++;
+            break;
+        }
+        p++;
+        n++;
+    }
+    *p = 0;
+
+    return n;
+}
+
+/*
+ * Запись count байтов в сокет.
+ */
+ //куда + откуда + сколько записывать
+size_t writen(int socket, const char* buf, size_t count)
+{
+    const char* p;
+    size_t n, rc;
+
+    /* Проверить корректность переданных аргументов. */
+    if (buf == NULL) {
+        errno = EFAULT; //неверный адрес
+        error("writen()");
+    }
+
+    //теперь указываем на переданное "откуда"
+    p = buf;
+    //переданное "сколько"
+    n = count;
+    while (n) {
+        rc = Write(socket, p, n);
+        //отнимает количество байт, которое удалось записать
+        n -= rc;
+        //сдвигаем указатель на начало незаписанных байтов
+        p += rc;
+    }
+
+    return count;
+}
+
+/*
+ * Запись n частей iov одним writev() (или несколькими, если сокет
+ * принял не все). iov при этом сдвигается.
+ */
+void writevn(int socket, struct iovec* iov, int n)
+{
+    ssize_t rc;
+
+    while (n) {
+        rc = writev(socket, iov, n);
+        if (rc == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN && coro_wait_io()) continue;
+            error("writev()");
+        }
+        //пропустить отправленные части, недописанную - сдвинуть
+        while (n && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n) {
+            iov->iov_base = (char*)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+}
+
+/*
+ * Случайные числа для сообщений (генератор и длины - в message.h).
+ *
+ * У каждого соединения свой поток случайных чисел (xorshift64*), его
+ * начальное состояние выводится из --seed и номера соединения через
+ * splitmix64. Поток, который обслуживает соединение, владеет и его
+ * генератором, так что генераторы не делятся между потоками, а
+ * содержимое соединения не зависит от того, какой поток и в каком
+ * порядке его обслуживает: с тем же --seed прогон повторяется байт в байт.
+ */
+static uint64_t seed;           /* --seed; по умолчанию от времени и pid. */
+
+/* Поток stream: номер соединения (у процессов prefork - свои диапазоны). */
+void rng_init(struct rng* r, uint64_t stream)
+{
+    rng_seed(r, seed, stream);
+}
+
+/*
+ * Запись трафика (--capture PATH), формат - в capture.h.
+ *
+ * Каждый поток копит записи в своем буфере и переносит их в журнал
+ * целиком, когда буфер заполнен или соединение закрыто; на пути
+ * обслуживания остается копирование ограниченной длины (не больше
+ * --capture-payload байтов данных на событие). Сегменты журнала
+ * создаются сразу полного размера (posix_fallocate()), так что запись
+ * в отображение не выделяет блоки файловой системы; заполненный
+ * сегмент сменяется следующим.
+ *
+ * Записи соединений, открытых в момент остановки сервера, могут
+ * остаться в буферах потоков и в журнал не попасть.
+ */
+#define CAPTURE_BUF (16 << 10)          /* Буфер записей потока. */
+#define CAPTURE_MAX_PAYLOAD 4096
+
+static const char* capture_path = NULL;     /* --capture */
+static size_t capture_segment = 64 << 20;   /* Размер сегмента. */
+static size_t capture_payload = 256;        /* Длиннее - только хэш. */
+
+struct capbuf {
+    size_t used;
+    char data[CAPTURE_BUF];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct capture_file* seg;   /* Текущий сегмент. */
+    uint32_t nseg;              /* Номер следующего сегмента. */
+    uint64_t mono_start, real_start;
+} cap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct pool capbuf_pool;
+static pthread_key_t capbuf_key;    /* Сброс и возврат буфера при выходе потока. */
+static __thread struct capbuf* my_capbuf;
+
+/*
+ * Номер соединения в журнале и поток его случайных чисел: номер
+ * процесса (12 бит), его поколение (12 бит, по кругу) и номер
+ * соединения в процессе (40 бит).
+ */
+uint64_t conn_stream(struct conn* c)
+{
+    //номера соединений у процессов prefork не пересекаются, а перезапущенный
+    //рабочий не повторяет потоки своего предшественника
+    return (uint64_t)stats_proc << 52 | (uint64_t)(stats_gen & 0xfff) << 40 | c->id;
+}
+
+/*
+ * Сегменты перезапущенного рабочего prefork получают в имени его
+ * поколение: журнал упавшего предшественника остается на месте.
+ */
+void capture_open_segment(void)
+{
+    char path[PATH_MAX];
+    int fd, rc;
+
+    if (stats_gen) snprintf(path, sizeof(path), "%s.%d-%u.%04u", capture_path, stats_proc, stats_gen, cap.nseg);
+    else snprintf(path, sizeof(path), "%s.%d.%04u", capture_path, stats_proc, cap.nseg);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) error(path);
+    rc = posix_fallocate(fd, 0, capture_segment);
+    if (rc) {
+        errno = rc;
+        error("posix_fallocate()");
+    }
+    cap.seg = mmap(NULL, capture_segment, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (cap.seg == MAP_FAILED) error("mmap()");
+    Close(fd);
+
+    cap.seg->header_size = sizeof(struct capture_file);
+    cap.seg->segment = cap.nseg++;
+    cap.seg->size = capture_segment;
+    cap.seg->used = sizeof(struct capture_file);
+    cap.seg->mono_start = cap.mono_start;
+    cap.seg->real_start = cap.real_start;
+    cap.seg->version = CAPTURE_VERSION;
+    cap.seg->magic = CAPTURE_MAGIC;
+}
+
+/* Перенести записи из буфера потока в журнал. */
+void capture_flush(struct capbuf* b)
+{
+    if (b == NULL || !b->used) return;
+
+    pthread_mutex_lock(&cap.lock);
+    if (cap.seg->used + b->used > cap.seg->size) {
+        munmap(cap.seg, capture_segment);
+        capture_open_segment();
+    }
+    memcpy((char*)cap.seg + cap.seg->used, b->data, b->used);
+    cap.seg->used += b->used;
+    pthread_mutex_unlock(&cap.lock);
+    b->used = 0;
+}
+
+void capture_thread_exit(void* arg)
+{
+    capture_flush(arg);
+    pool_put(&capbuf_pool, arg);
+}
+
+/*
+ * Начать запись: буферы для nthreads потоков, обслуживающих
+ * соединения, и первый сегмент.
+ */
+void capture_init(size_t nthreads)
+{
+    struct timespec ts;
+
+    pool_init(&capbuf_pool, sizeof(struct capbuf), nthreads);
+    pthread_key_create(&capbuf_key, capture_thread_exit);
+    cap.mono_start = now_ns();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    cap.real_start = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    capture_open_segment();
+}
+
+/*
+ * Записать событие dir соединения c: len байтов из data (data == NULL -
+ * только длина).
+ */
+void capture(struct conn* c, int dir, const char* data, size_t len)
+{
+    struct capbuf* b = my_capbuf;
+    struct capture_rec r;
+    uint64_t h;
+    char* p;
+
+    //до capture_init() (и при прогреве) не пишем
+    if (cap.seg == NULL) return;
+    if (b == NULL) {
+        b = my_capbuf = pool_get(&capbuf_pool);
+        b->used = 0;
+        pthread_setspecific(capbuf_key, b);
+    }
+
+    r.ts = now_ns() - cap.mono_start;
+    r.conn = conn_stream(c);
+    r.len = len;
+    r.dir = dir;
+    r.flags = data == NULL ? 0 : len <= capture_payload ? CAP_PAYLOAD : CAP_HASH;
+    r.data_len = r.flags == CAP_PAYLOAD ? len : r.flags == CAP_HASH ? sizeof(h) : 0;
+    r.reserved = 0;
+    if (b->used + capture_rec_size(&r) > CAPTURE_BUF) capture_flush(b);
+
+    p = b->data + b->used;
+    memcpy(p, &r, sizeof(r));
+    if (r.flags == CAP_PAYLOAD) {
+        memcpy(p + sizeof(r), data, len);
+    } else if (r.flags == CAP_HASH) {
+        //хэш только начала: стоимость не зависит от длины сообщения
+        h = capture_hash(data, capture_payload);
+        memcpy(p + sizeof(r), &h, sizeof(h));
+    }
+    memset(p + sizeof(r) + r.data_len, 0, capture_rec_size(&r) - sizeof(r) - r.data_len);
+    b->used += capture_rec_size(&r);
+}
+
+/* Соединение закрыто: его записи - в журнал сразу. */
+void capture_close(struct conn* c)
+{
+    if (cap.seg == NULL) return;
+    capture(c, CAP_CLOSE, NULL, 0);
+    capture_flush(my_capbuf);
+}
+
+/*
+ * Перезапуск без простоя (--handoff / --takeover).
+ *
+ * Работающий сервер ждет новый процесс на UNIX-сокете handoff_path.
+ * Новый процесс подключается и получает через SCM_RIGHTS дескриптор
+ * прослушиваемого сокета, поэтому ничего не привязывает заново и
+ * очередь ожидающих соединений не теряется. По желанию нового процесса
+ * ему передаются и keep-alive соединения, ожидающие следующего запроса.
+ * Старый процесс перестает принимать соединения, дожидается окончания
+ * обслуживания остальных и завершается; keep-alive соединения, которые
+ * новый процесс не берет, закрываются, если простояли без запроса
+ * --drain-timeout секунд после передачи порта.
+ *
+ * Главный поток ждет соединения в poll() вместе с drain_pipe, так что
+ * передача порта будит его записью в канал, без сигналов. Прослушиваемый
+ * сокет при этом неблокирующий: флаг общий со всеми процессами, у
+ * которых этот сокет, и соединение, которое успел принять другой
+ * процесс, не оставляет accept() висеть.
+ *
+ * Сообщения канала: один байт-метка и, кроме 'E', дескриптор:
+ *      'L' - прослушиваемый сокет, 'C' - соединение, 'E' - конец передачи.
+ */
+static volatile int draining = 0;   /* Порт отдан, идет передача соединений. */
+static uint64_t drain_deadline;     /* now_ns(), после которого простой не ждут. */
+static int drain_pipe[2] = { -1, -1 };  /* Становится читаемым при draining. */
+static int handoff_chan = -1;       /* Канал к новому процессу. */
+static pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void send_fd(int chan, char tag, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+    ssize_t rc;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd != -1) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    for (;;) {
+        rc = sendmsg(chan, &msg, MSG_NOSIGNAL);
+        if (rc != -1) break;
+        if (errno == EINTR) continue;
+        error("sendmsg()");
+    }
+}
+
+/*
+ * Принять сообщение канала. Возвращает метку ('E' и при закрытии
+ * канала), дескриптор - в *fd (-1, если его нет).
+ */
+char recv_fd(int chan, int* fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+    char tag;
+    ssize_t rc;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    for (;;) {
+        rc = recvmsg(chan, &msg, MSG_CMSG_CLOEXEC);
+        if (rc != -1) break;
+        if (errno == EINTR) continue;
+        error("recvmsg()");
+    }
+    *fd = -1;
+    if (rc == 0) return 'E';
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return tag;
+}
+
+/*
+ * Дождаться следующего запроса keep-alive соединения. Возвращает 0,
+ * если соединение простаивает, а сервер передает работу новому
+ * процессу: тогда соединение нужно отдать (--takeover-conns) или,
+ * если простой дошел до drain_deadline, закрыть, а не ждать дальше.
+ * До передачи порта (draining == 0) ждет без срока.
+ */
+int wait_request(int socket)
+{
+    struct pollfd fds[2];
+    int64_t left;
+    int rc, timeout = -1;
+
+    fds[0].fd = socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = drain_pipe[0];
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (draining && fds[1].fd == -1) {
+            left = (int64_t)(drain_deadline - now_ns());
+            if (left <= 0) return 0;
+            timeout = left / 1000000 + 1;
+        }
+        rc = poll(fds, 2, timeout);
+        if (rc == -1) {
+            if (errno == EINTR) continue;
+            error("poll()");
+        }
+        //пришедший запрос важнее: данные не теряются и при передаче,
+        //но отвечать на начатое лучше самим
+        if (fds[0].revents) return 1;
+        if (!rc || !draining) continue;
+        if (takeover_conns) return 0;
+        //новый процесс соединения не берет - обслуживаем до закрытия или до срока
+        fds[1].fd = -1;
+    }
+}
+
+/*
+ * Отдать соединение новому процессу. Собственная копия дескриптора
+ * закрывается вызывающим как обычно: соединение при этом остается
+ * открытым в новом процессе.
+ */
+void handoff_conn(struct conn* c)
+{
+    pthread_mutex_lock(&handoff_lock);
+    send_fd(handoff_chan, 'C', c->fd);
+    pthread_mutex_unlock(&handoff_lock);
+}
+
+/*
+ * Запас заранее сформированных сообщений (-R). Сообщения лежат подряд
+ * в одной области памяти и после запуска не меняются; очередной ответ
+ * берется по кругу и отправляется прямо из запаса, без генерации.
+ */
+static long reserve_n = 0;      /* Число сообщений в запасе; 0 - без запаса. */
+static char* reserve_base;
+static size_t* reserve_off;     /* Смещения сообщений, reserve_n + 1 элементов. */
+
+/*
+ * Отправка запаса без копирования (--splice). vmsplice() кладет в канал
+ * (pipe) не байты, а ссылки на страницы запаса, splice() передает их
+ * сокету, и TCP отправляет прямо из этих страниц. Ссылки живут, пока
+ * данные не подтверждены клиентом, уже после возврата из splice().
+ * Поэтому так отправляется только запас: его страницы не меняются и не
+ * освобождаются до конца процесса (после заполнения они только для
+ * чтения), и следующая отправка может ссылаться на них сразу, не
+ * дожидаясь сети. Буфер соединения, буфер приема и значения KV
+ * переписываются или освобождаются сразу после ответа, поэтому они
+ * уходят как раньше, через writev().
+ *
+ * Канал у каждого потока свой и перед каждым vmsplice() пуст, поэтому
+ * vmsplice() не ждет места. Режим coro сюда не подходит: сопрограммы
+ * одного потока перемешали бы данные в общем канале.
+ */
+static int splice_send = 0;
+static pthread_key_t splice_key;        /* Закрытие канала при выходе потока. */
+static pthread_once_t splice_once = PTHREAD_ONCE_INIT;
+static __thread int splice_pipe[2] = { -1, -1 };
+
+void splice_thread_exit(void* arg)
+{
+    int* fd = arg;
+
+    Close(fd[0]);
+    Close(fd[1]);
+}
+
+void splice_key_init(void)
+{
+    if (pthread_key_create(&splice_key, splice_thread_exit)) error("pthread_key_create()");
+}
+
+/* Канал текущего потока; создается при первой отправке. */
+int* splice_pipe_get(void)
+{
+    if (splice_pipe[0] == -1) {
+        if (pipe2(splice_pipe, O_CLOEXEC) == -1) error("pipe2()");
+        pthread_once(&splice_once, splice_key_init);
+        pthread_setspecific(splice_key, splice_pipe);
+    }
+
+    return splice_pipe;
+}
+
+/*
+ * Отправить n частей iov из неизменяемой памяти через канал потока;
+ * iov при этом сдвигается, как в writevn().
+ */
+void splicen(int socket, struct iovec* iov, int n)
+{
+    int* fd = splice_pipe_get();
+    ssize_t rc, left;
+
+    while (n) {
+        rc = vmsplice(fd[1], iov, n, 0);
+        if (rc == -1) {
+            if (errno == EINTR) continue;
+            error("vmsplice()");
+        }
+        left = rc;
+        while (n && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n) {
+            iov->iov_base = (char*)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+        //канал опустошается до следующего vmsplice()
+        while (left) {
+            rc = splice(fd[0], NULL, socket, NULL, left, SPLICE_F_MOVE | (n ? SPLICE_F_MORE : 0));
+            if (rc == -1) {
+                if (errno == EINTR) continue;
+                error("splice()");
+            }
+            left -= rc;
+        }
+    }
+}
+
+/* Часть ответа лежит в запасе. */
+int in_reserve(const struct iovec* iov)
+{
+    return reserve_n && (char*)iov->iov_base >= reserve_base &&
+        (char*)iov->iov_base < reserve_base + reserve_off[reserve_n];
+}
+
+/* Отправить части ответа: из запаса - через splicen(), остальные - writev(). */
+void sendv(int socket, struct iovec* iov, int n)
+{
+    int i, j;
+
+    if (!splice_send) {
+        writevn(socket, iov, n);
+        return;
+    }
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && in_reserve(&iov[j]) == in_reserve(&iov[i]); j++)
+            ;
+        if (in_reserve(&iov[i])) splicen(socket, iov + i, j - i);
+        else writevn(socket, iov + i, j - i);
+    }
+}
+
+/*
+ * Потоковая отправка длинных сообщений. Сообщение не длиннее chunk_size
+ * формируется целиком, длиннее - частями по chunk_size байтов в один и
+ * тот же буфер соединения: каждая часть отправляется сразу, как только
+ * сформирована. write() копирует часть в буфер сокета, так что, пока
+ * формируется следующая, ядро уже отправляет предыдущую, а памяти на
+ * соединение нужно chunk_size байтов при любой длине сообщения.
+ */
+static size_t chunk_size = 64 << 10;    /* --chunk, кратно 8. */
+
+void stream_message(int socket, struct rng* r, char* buf, size_t len)
+{
+    size_t n, left = len + 1;
+
+    while (left) {
+        //части кратны 8 байтам, поэтому буквы совпадают с make_message()
+        n = left < chunk_size ? left : chunk_size;
+        make_letters(r, buf, n == left ? n - 1 : n);
+        if (n == left) buf[n - 1] = '\n';
+        writen(socket, buf, n);
+        stats_bytes(n);
+        left -= n;
+    }
+}
+
+/*
+ * Обработчики запросов (--handler и "@имя" в начале запроса).
+ *
+ * Соединение читает запросы в свой буфер приема, и обработчик получает
+ * строку запроса как представление (struct view) прямо в этом буфере,
+ * без копирования. Ответ обработчик не пишет сам, а добавляет в очередь
+ * вывода части-представления: в запас сообщений, в буфер соединения, в
+ * отображенный файл, в значение KV или обратно в буфер приема. Очередь
+ * уходит одним writev(), и только после этого буфер приема читается
+ * дальше, так что представления действительны, пока их отправляют.
+ *
+ * Обработчик прослушиваемого сокета задает --handler; запрос вида
+ * "@имя остаток" обслуживает обработчик имя, и запросом для него
+ * считается остаток.
+ */
+#define RBUF_SIZE 4096      /* Буфер приема; строка длиннее делится на запросы. */
+#define OUTQ_SEGS 4         /* Частей в одном ответе. */
+
+struct view {
+    const char* p;
+    size_t len;
+};
+
+/* Буфер приема соединения: непрочитанные байты лежат в [pos, end). */
+struct rbuf {
+    size_t pos, end;
+    char data[RBUF_SIZE];
+};
+
+/*
+ * Блок со счетчиком ссылок: часть ответа может держать ссылку на него,
+ * пока отправляется, а последняя ссылка освобождает блок (free()).
+ */
+struct ref {
+    uint32_t refs;
+};
+
+void ref_put(struct ref* r)
+{
+    if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0) free(r);
+}
+
+/* Очередь вывода: части ответа и ссылки, которые они держат. */
+struct outq {
+    struct iovec iov[OUTQ_SEGS];
+    struct ref* hold[OUTQ_SEGS];
+    int n;
+    int first;              /* Первая неотправленная часть (режим event). */
+    size_t bytes;
+};
+
+void outq_add(struct outq* q, const void* p, size_t len, struct ref* hold)
+{
+    assert(q->n < OUTQ_SEGS);
+    q->iov[q->n].iov_base = (void*)p;
+    q->iov[q->n].iov_len = len;
+    q->hold[q->n] = hold;
+    q->n++;
+    q->bytes += len;
+}
+
+#define outq_str(q, s) outq_add(q, s, sizeof(s) - 1, NULL)
+
+/* Записать ответ в журнал; до отправки, которая сдвигает iov. */
+void outq_capture(struct conn* c, struct outq* q)
+{
+    if (q->n == 1) capture(c, CAP_SEND, q->iov[0].iov_base, q->bytes);
+    else if (q->n) capture(c, CAP_SEND, NULL, q->bytes);
+}
+
+/* Ответ отправлен: отпустить ссылки и очистить очередь. */
+void outq_done(struct outq* q)
+{
+    int i;
+
+    for (i = 0; i < q->n; i++) {
+        if (q->hold[i] != NULL) ref_put(q->hold[i]);
+    }
+    q->n = 0;
+    q->first = 0;
+    q->bytes = 0;
+}
+
+/* Отправить ответ; возвращает число отправленных байтов. */
+size_t outq_flush(struct conn* c, struct outq* q)
+{
+    size_t bytes = q->bytes;
+
+    if (!q->n) return 0;
+    outq_capture(c, q);
+    sendv(c->fd, q->iov, q->n);
+    outq_done(q);
+
+    return bytes;
+}
+
+struct handler {
+    const char* name;
+    int request;            /* Без keep-alive отвечает на строку запроса, а не на соединение. */
+    void (*serve)(struct conn* c, struct view req, struct outq* q);
+};
+
+/* random: случайное сообщение, как и раньше (запрос не читается). */
+void random_serve(struct conn* c, struct view req, struct outq* q)
+{
+    unsigned long i;
+    size_t len;
+
+    if (reserve_n) {
+        i = rng_below(&c->rng, reserve_n);
+        outq_add(q, reserve_base + reserve_off[i], reserve_off[i + 1] - reserve_off[i], NULL);
+    } else if ((len = message_length(&c->rng)) < chunk_size) {
+        outq_add(q, c->buf, make_message(&c->rng, c->buf, len), NULL);
+    } else {
+        //уходит частями мимо очереди, байты учтены по частям
+        stream_message(c->fd, &c->rng, c->buf, len);
+        capture(c, CAP_SEND, NULL, len + 1);
+    }
+}
+
+/* echo: строка запроса прямо из буфера приема. */
+void echo_serve(struct conn* c, struct view req, struct outq* q)
+{
+    if (req.len) outq_add(q, req.p, req.len, NULL);
+    if (!req.len || req.p[req.len - 1] != '\n') outq_str(q, "\n");
+}
+
+/*
+ * file: содержимое файла --file, отображенного в память при запуске.
+ * Клиент server3 считает ответом строку, так что для него файл должен
+ * быть одной строкой; '\n' в конце добавляется, если его нет.
+ */
+static const char* file_path = NULL;
+static struct view file_data;
+
+void file_init(void)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) error(file_path);
+    if (fstat(fd, &st) == -1) error("fstat()");
+    file_data.len = st.st_size;
+    file_data.p = "";
+    if (st.st_size) {
+        file_data.p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+        if (file_data.p == MAP_FAILED) error("mmap()");
+    }
+    close(fd);
+}
+
+void file_serve(struct conn* c, struct view req, struct outq* q)
+{
+    if (file_path == NULL) {
+        outq_str(q, "ERR no --file\n");
+        return;
+    }
+    outq_add(q, file_data.p, file_data.len, NULL);
+    if (!file_data.len || file_data.p[file_data.len - 1] != '\n') outq_str(q, "\n");
+}
+
+/*
+ * kv: хранилище ключ-значение в памяти.
+ *      GET key         значение или пустая строка
+ *      SET key value   OK
+ *      DEL key         OK или NONE
+ * Значение хранится вместе с '\n' и не меняется: SET заменяет его
+ * целиком, а ответ GET держит ссылку на значение, так что оно
+ * отправляется без копирования и без блокировки на время отправки.
+ */
+#define KV_BUCKETS 4096
+
+struct kv_val {
+    struct ref ref;
+    size_t len;
+    char data[];
+};
+
+struct kv_entry {
+    struct kv_entry* next;
+    struct kv_val* val;
+    size_t klen;
+    char key[];
+};
+
+static struct kv_entry* kv_table[KV_BUCKETS];
+static pthread_rwlock_t kv_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Ячейка цепочки с ключом (или та, куда его добавить). */
+struct kv_entry** kv_find(struct view key)
+{
+    struct kv_entry** e;
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    //FNV-1a
+    for (i = 0; i < key.len; i++) h = (h ^ (unsigned char)key.p[i]) * 1099511628211ULL;
+    for (e = &kv_table[h % KV_BUCKETS]; *e != NULL; e = &(*e)->next) {
+        if ((*e)->klen == key.len && !memcmp((*e)->key, key.p, key.len)) break;
+    }
+
+    return e;
+}
+
+/* Отрезать от s слово до пробела; остаток - после пробела. */
+struct view next_word(struct view* s)
+{
+    struct view w = *s;
+    const char* sp = memchr(s->p, ' ', s->len);
+
+    if (sp == NULL) {
+        s->p += s->len;
+        s->len = 0;
+    } else {
+        w.len = sp - s->p;
+        s->len -= w.len + 1;
+        s->p = sp + 1;
+    }
+
+    return w;
+}
+
+void kv_serve(struct conn* c, struct view req, struct outq* q)
+{
+    struct kv_entry** e;
+    struct kv_entry* old;
+    struct kv_val *v = NULL, *prev = NULL;
+    struct view cmd, key;
+
+    //без '\n' (и '\r' от telnet)
+    while (req.len && (req.p[req.len - 1] == '\n' || req.p[req.len - 1] == '\r')) req.len--;
+    cmd = next_word(&req);
+    key = next_word(&req);
+    if (!key.len) {
+        outq_str(q, "ERR no key\n");
+        return;
+    }
+
+    if (cmd.len == 3 && !memcmp(cmd.p, "GET", 3)) {
+        pthread_rwlock_rdlock(&kv_lock);
+        e = kv_find(key);
+        if (*e != NULL) {
+            v = (*e)->val;
+            __atomic_add_fetch(&v->ref.refs, 1, __ATOMIC_RELAXED);
+        }
+        pthread_rwlock_unlock(&kv_lock);
+        if (v != NULL) outq_add(q, v->data, v->len, &v->ref);
+        else outq_str(q, "\n");
+    } else if (cmd.len == 3 && !memcmp(cmd.p, "SET", 3)) {
+        //значение - весь остаток строки, с пробелами
+        v = Malloc(sizeof(*v) + req.len + 1);
+        v->ref.refs = 1;
+        v->len = req.len + 1;
+        memcpy(v->data, req.p, req.len);
+        v->data[req.len] = '\n';
+        pthread_rwlock_wrlock(&kv_lock);
+        e = kv_find(key);
+        if (*e == NULL) {
+            *e = Malloc(sizeof(**e) + key.len);
+            (*e)->next = NULL;
+            (*e)->klen = key.len;
+            memcpy((*e)->key, key.p, key.len);
+        } else {
+            prev = (*e)->val;
+        }
+        (*e)->val = v;
+        pthread_rwlock_unlock(&kv_lock);
+        if (prev != NULL) ref_put(&prev->ref);
+        outq_str(q, "OK\n");
+    } else if (cmd.len == 3 && !memcmp(cmd.p, "DEL", 3)) {
+        pthread_rwlock_wrlock(&kv_lock);
+        e = kv_find(key);
+        old = *e;
+        if (old != NULL) *e = old->next;
+        pthread_rwlock_unlock(&kv_lock);
+        if (old == NULL) {
+            outq_str(q, "NONE\n");
+            return;
+        }
+        ref_put(&old->val->ref);
+        free(old);
+        outq_str(q, "OK\n");
+    } else {
+        outq_str(q, "ERR unknown command\n");
+    }
+}
+
+static const struct handler handlers[] = {
+    { "random", 0, random_serve },
+    { "echo",   1, echo_serve },
+    { "file",   1, file_serve },
+    { "kv",     1, kv_serve },
+};
+static const struct handler* listen_handler = &handlers[0];   /* --handler */
+
+const struct handler* handler_find(const char* name, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(handlers) / sizeof(handlers[0]); i++) {
+        if (strlen(handlers[i].name) == len && !memcmp(handlers[i].name, name, len)) return &handlers[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Следующий запрос, уже лежащий в буфере приема. Возвращает 0, если
+ * нужно дочитать сокет (место для этого в буфере есть).
+ */
+int rbuf_line(struct rbuf* b, struct view* req)
+{
+    char* nl;
+
+    for (;;) {
+        nl = memchr(b->data + b->pos, '\n', b->end - b->pos);
+        if (nl != NULL) {
+            req->p = b->data + b->pos;
+            req->len = nl + 1 - req->p;
+            b->pos += req->len;
+            return 1;
+        }
+        if (b->pos == b->end) {
+            b->pos = b->end = 0;
+            return 0;
+        }
+        if (b->end < RBUF_SIZE) return 0;
+        //место кончилось: сдвинуть начатую строку или отдать буфер как есть
+        if (b->pos) {
+            memmove(b->data, b->data + b->pos, b->end - b->pos);
+            b->end -= b->pos;
+            b->pos = 0;
+            continue;
+        }
+        req->p = b->data;
+        req->len = b->end;
+        b->pos = b->end;
+        return 1;
+    }
+}
+
+/* Конец потока: неполная последняя строка - тоже запрос. */
+int rbuf_tail(struct rbuf* b, struct view* req)
+{
+    if (b->pos == b->end) return 0;
+    req->p = b->data + b->pos;
+    req->len = b->end - b->pos;
+    b->pos = b->end;
+
+    return 1;
+}
+
+/*
+ * Следующий запрос из буфера приема, при необходимости дочитав сокет.
+ * Возвращает 0 в конце потока.
+ */
+int next_request(struct conn* c, struct rbuf* b, struct view* req)
+{
+    size_t n;
+
+    while (!rbuf_line(b, req)) {
+        n = Read(c->fd, b->data + b->end, RBUF_SIZE - b->end);
+        if (n == 0) return rbuf_tail(b, req);
+        b->end += n;
+    }
+
+    return 1;
+}
+
+/* Передать запрос обработчику; ответ остается в очереди q. */
+void handle_request(struct conn* c, struct view req, struct outq* q)
+{
+    const struct handler* h = listen_handler;
+    struct view name;
+
+    if (req.len && req.p[0] == '@') {
+        req.p++;
+        req.len--;
+        while (req.len && (req.p[req.len - 1] == '\n' || req.p[req.len - 1] == '\r')) req.len--;
+        name = next_word(&req);
+        h = handler_find(name.p, name.len);
+    }
+    if (h != NULL) h->serve(c, req, q);
+    else outq_str(q, "ERR unknown handler\n");
+}
+
+/* Обслужить запрос, полученный в момент t0. */
+void serve_request(struct conn* c, struct view req, struct outq* q, uint64_t t0)
+{
+    handle_request(c, req, q);
+    stats_request(outq_flush(c, q), now_ns() - t0);
+}
+
+/*
+ * Отложенное закрытие (--async-close). close() сокета платит за
+ * отправку FIN (или RST при SO_LINGER 0) и освобождение его буферов,
+ * а возврат буфера и struct conn - за блокировки пулов, общие с
+ * остальными потоками. С --async-close поток обслуживания только
+ * ставит соединение в очередь и сразу берется за следующее; сокеты
+ * закрывает и объекты возвращает поток закрытия, пачками: блокировка
+ * каждого пула берется один раз на пачку.
+ *
+ * Место в conn_pool освобождается после закрытия, поэтому в очереди
+ * не бывает больше max_conns соединений.
+ */
+#define TEARDOWN_BATCH 64
+
+static int async_close = 0;
+static struct {
+    struct conn** q;        /* Кольцевая очередь соединений. */
+    size_t head, len;
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+} reapq = { .lock = PTHREAD_MUTEX_INITIALIZER, .nonempty = PTHREAD_COND_INITIALIZER };
+
+void* reaper(void* arg)
+{
+    struct conn* batch[TEARDOWN_BATCH];
+    void* bufs[TEARDOWN_BATCH];
+    size_t i, n;
+
+    for (;;) {
+        pthread_mutex_lock(&reapq.lock);
+        while (!reapq.len) pthread_cond_wait(&reapq.nonempty, &reapq.lock);
+        for (n = 0; n < TEARDOWN_BATCH && reapq.len; n++) {
+            batch[n] = reapq.q[reapq.head];
+            reapq.head = (reapq.head + 1) % max_conns;
+            reapq.len--;
+        }
+        pthread_mutex_unlock(&reapq.lock);
+
+        for (i = 0; i < n; i++) {
+            Close(batch[i]->fd);
+            bufs[i] = batch[i]->buf;
+        }
+        pool_put_many(&buf_pool, bufs, n);
+        pool_put_many(&conn_pool, (void**)batch, n);
+    }
+
+    return NULL;
+}
+
+void start_reaper(void)
+{
+    pthread_t thread;
+
+    reapq.q = region_alloc(sizeof(struct conn*) * max_conns);
+    Pthread_create(&thread, NULL, reaper, NULL);
+    pthread_detach(thread);
+}
+
+/* Закрыть обслуженное соединение и вернуть его объекты в пулы. */
+void conn_teardown(struct conn* c)
+{
+    if (!async_close) {
+        pool_put(&buf_pool, c->buf);
+        Close(c->fd);
+        pool_put(&conn_pool, c);
+        return;
+    }
+
+    pthread_mutex_lock(&reapq.lock);
+    reapq.q[(reapq.head + reapq.len) % max_conns] = c;
+    //поток закрытия будится только первым соединением пачки
+    if (!reapq.len++) pthread_cond_signal(&reapq.nonempty);
+    pthread_mutex_unlock(&reapq.lock);
+}
+
+/*
+ * Обслужить одно соединение от начала до закрытия.
+ */
+void serve_conn(struct conn* c)
+{
+    struct rbuf rb;
+    struct outq q;
+    struct view req = { "", 0 };
+
+    rng_init(&c->rng, conn_stream(c));
+    //все записи соединения делает обслуживающий его поток
+    capture(c, CAP_OPEN, NULL, 0);
+
+    alloc_set_phase(PHASE_SERVE);
+
+    //буфер под самое длинное возможное сообщение
+    c->buf = pool_get(&buf_pool);
+    rb.pos = rb.end = 0;
+    q.n = q.first = 0;
+    q.bytes = 0;
+
+    if (!keepalive) {
+        //один ответ на соединение: сразу или на первую строку запроса
+        if (!listen_handler->request) serve_request(c, req, &q, now_ns());
+        else if (next_request(c, &rb, &req)) {
+            capture(c, CAP_RECV, req.p, req.len);
+            serve_request(c, req, &q, now_ns());
+        }
+    } else {
+        //один ответ на каждую строку запроса, пока клиент не закроет соединение
+        for (;;) {
+            //сервер, готовый к перезапуску, не должен застревать в read();
+            //уже прочитанные запросы обслуживаются до передачи
+            if (rb.pos == rb.end && handoff_path != NULL && !wait_request(c->fd)) {
+                if (takeover_conns) handoff_conn(c);
+                break;
+            }
+            if (!next_request(c, &rb, &req)) break;
+            capture(c, CAP_RECV, req.p, req.len);
+            serve_request(c, req, &q, now_ns());
+        }
+    }
+
+    alloc_set_phase(PHASE_CLOSE);
+    capture_close(c);
+    conn_teardown(c);
+}
+
+void* serve_client(void* arg)
+{
+    /* Перевести поток в отсоединенное (detached) состояние. */
+// когда он завершается, все занимаемые им ресурсы освобождаются и мы не можем отслеживать его завершение
+//pthread_self - получение потоком своего идентификатора
+    pthread_detach(pthread_self());
+
+    //забираем соединение из аргумента
+    serve_conn(arg);
+
+    return NULL;
+}
+
+/*
+ * Размер стека потоков обслуживания (--stack); 0 - системный по
+ * умолчанию (обычно 8 МБ адресного пространства на поток).
+ */
+static size_t stack_size = 0;
+
+pthread_attr_t* serve_attr(void)
+{
+    static pthread_attr_t attr;
+    static int ready = 0;
+
+    if (!stack_size) return NULL;
+    //потоки обслуживания создает только главный поток
+    if (!ready) {
+        pthread_attr_init(&attr);
+        if (pthread_attr_setstacksize(&attr, stack_size) != 0) {
+            errno = EINVAL;
+            error("--stack");
+        }
+        ready = 1;
+    }
+
+    return &attr;
+}
+
+/*
+ * Заранее созданные рабочие потоки (-w). Главный поток отдает принятое
+ * соединение свободному рабочему через очередь; если свободных нет,
+ * как и раньше, создается отдельный поток на клиента.
+ */
+static int nworkers = 0;
+static struct {
+    struct conn** q;        /* Кольцевая очередь соединений. */
+    size_t head, len;
+    int idle;               /* Рабочих, ожидающих соединение. */
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+} workq = { .lock = PTHREAD_MUTEX_INITIALIZER, .nonempty = PTHREAD_COND_INITIALIZER };
+
+void* worker(void* arg)
+{
+    struct conn* c;
+
+    for (;;) {
+        pthread_mutex_lock(&workq.lock);
+        workq.idle++;
+        while (!workq.len) pthread_cond_wait(&workq.nonempty, &workq.lock);
+        workq.idle--;
+        c = workq.q[workq.head];
+        workq.head = (workq.head + 1) % max_conns;
+        workq.len--;
+        pthread_mutex_unlock(&workq.lock);
+
+        serve_conn(c);
+    }
+
+    return NULL;
+}
+
+void start_workers(void)
+{
+    pthread_t thread;
+    int i;
+
+    workq.q = region_alloc(sizeof(struct conn*) * max_conns);
+    for (i = 0; i < nworkers; i++) {
+        Pthread_create(&thread, serve_attr(), worker, NULL);
+        pthread_detach(thread);
+    }
+}
+
+/*
+ * Передать соединение на обслуживание.
+ */
+void dispatch(struct conn* c)
+{
+    pthread_t thread;
+
+    pthread_mutex_lock(&workq.lock);
+    if (workq.idle > (int)workq.len) {
+        workq.q[(workq.head + workq.len) % max_conns] = c;
+        workq.len++;
+        pthread_cond_signal(&workq.nonempty);
+        pthread_mutex_unlock(&workq.lock);
+        return;
+    }
+    pthread_mutex_unlock(&workq.lock);
+
+    //указатель на поток + атрибуты потока + функция для выполнения + аргументы для функции
+    Pthread_create(&thread, serve_attr(), serve_client, c);
+}
+
+/*
+ * Размер буфера соединения: наибольшая длина сообщения вместе с '\n',
+ * но не больше части потоковой отправки.
+ */
+size_t max_message(void)
+{
+    return size_dist.max + 1 < chunk_size ? size_dist.max + 1 : chunk_size;
+}
+
+/*
+ * Порядковые номера соединений: их раздают главный цикл и поток,
+ * принимающий соединения от прежнего процесса.
+ */
+static unsigned long nconns = 0;
+
+void conn_accepted(struct conn* c, int fd)
+{
+    //keep-alive соединение закрывается после клиента, ответы уже доставлены
+    if (tune_apply(fd, tune, keepalive ? TUNE_RESET_CLOSE : 0) == -1) error("setsockopt()");
+    c->fd = fd;
+    c->id = __atomic_fetch_add(&nconns, 1, __ATOMIC_RELAXED);
+    stats_conn();
+#ifdef ALLOC_TRACE
+    alloc_conns = c->id + 1;
+#endif
+}
+
+/*
+ * Поток старого процесса: ждет новый процесс на handoff_path и отдает
+ * ему прослушиваемый сокет, затем будит главный поток (и потоки
+ * keep-alive соединений) записью в drain_pipe.
+ */
+static int handoff_lsocket;
+
+void* handoff_listener(void* arg)
+{
+    int ls = *(int*)arg, chan;
+    char req;
+
+    for (;;) {
+        chan = Accept(ls, NULL, NULL);
+        //запрос: 'L' - только порт, 'C' - порт и соединения
+        if (Read(chan, &req, 1) == 1 && (req == 'L' || req == 'C')) break;
+        Close(chan);
+    }
+    Close(ls);
+
+    takeover_conns = req == 'C';
+    send_fd(chan, 'L', handoff_lsocket);
+    handoff_chan = chan;
+    drain_deadline = now_ns() + drain_timeout * 1000000000ULL;
+    draining = 1;
+    Write(drain_pipe[1], "", 1);
+    fprintf(stderr, "handoff: listening socket passed to the new process, draining\n");
+
+    return NULL;
+}
+
+void start_handoff_listener(int lsocket)
+{
+    static int ls;
+    struct sockaddr_un addr;
+    pthread_t thread;
+
+    if (strlen(handoff_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        error("handoff");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, handoff_path);
+    //путь может остаться от предыдущего процесса, в том числе того,
+    //у которого мы только что забрали порт
+    unlink(handoff_path);
+    ls = Socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    Bind(ls, (SA*)&addr, sizeof(addr));
+    Listen(ls, 1);
+
+    handoff_lsocket = lsocket;
+    //флаг переходит к новому процессу вместе с сокетом, см. accept_handoff()
+    if (fcntl(lsocket, F_SETFL, fcntl(lsocket, F_GETFL) | O_NONBLOCK) == -1) error("fcntl()");
+    Pthread_create(&thread, NULL, handoff_listener, &ls);
+    pthread_detach(thread);
+}
+
+/*
+ * Поток нового процесса: принимает соединения, которые отдает старый,
+ * и обслуживает их так же, как принятые сами.
+ */
+void* takeover_receiver(void* arg)
+{
+    int chan = (intptr_t)arg, fd;
+    unsigned long n = 0;
+    struct conn* c;
+
+    while (recv_fd(chan, &fd) == 'C') {
+        if (fd == -1) continue;
+        c = pool_get(&conn_pool);
+        conn_accepted(c, fd);
+        dispatch(c);
+        n++;
+    }
+    Close(chan);
+    fprintf(stderr, "takeover: %lu connections received\n", n);
+
+    return NULL;
+}
+
+/*
+ * Забрать прослушиваемый сокет у процесса, ждущего на takeover_path.
+ */
+int takeover(void)
+{
+    struct sockaddr_un addr;
+    pthread_t thread;
+    int chan, fd;
+    char req = takeover_conns ? 'C' : 'L';
+
+    if (strlen(takeover_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        error("takeover");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, takeover_path);
+    chan = Socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(chan, (SA*)&addr, sizeof(addr)) == -1) error("connect(takeover)");
+    writen(chan, &req, 1);
+
+    if (recv_fd(chan, &fd) != 'L' || fd == -1) {
+        errno = EPROTO;
+        error("takeover");
+    }
+    if (takeover_conns) {
+        Pthread_create(&thread, NULL, takeover_receiver, (void*)(intptr_t)chan);
+        pthread_detach(thread);
+    } else {
+        Close(chan);
+    }
+
+    return fd;
+}
+
+/*
+ * После передачи порта: дождаться, пока все соединения будут
+ * обслужены или отданы, и сообщить новому процессу о конце передачи.
+ */
+void drain_conns(void)
+{
+    pool_wait_full(&conn_pool);
+
+    //канал нужен новому процессу, только если он забирает соединения
+    if (takeover_conns) send_fd(handoff_chan, 'E', -1);
+    Close(handoff_chan);
+    fprintf(stderr, "handoff: drained\n");
+}
+
+/*
+ * Режим coro: сопрограммы поверх epoll.
+ *
+ * Каждое соединение обслуживается сопрограммой с небольшим стеком, и
+ * serve_conn() остается прежним последовательным кодом. Сокеты
+ * неблокирующие: когда read() или write() возвращают EAGAIN, Read() и
+ * Write() (а через них reads() и writen()) не ждут в ядре, а уступают
+ * поток другим сопрограммам, пока epoll не сообщит о готовности.
+ *
+ * Сопрограммы выполняются на nprocs потоках-планировщиках (M:N), у
+ * каждого свой epoll и своя сопрограмма приема соединений; сопрограмма
+ * не переходит с потока на поток. Прослушиваемый сокет добавлен во все
+ * epoll с EPOLLEXCLUSIVE, чтобы новое соединение будило один поток.
+ *
+ * Стеки выделяются заранее одной областью; между ними - страница без
+ * доступа, так что переполнение стека дает SIGSEGV, а не порчу соседа.
+ */
+#define CORO_GUARD 4096
+
+#if defined(__x86_64__)
+/*
+ * Переключение контекста: сохранить на текущем стеке регистры, которые
+ * по соглашению о вызовах сохраняет вызываемая функция, запомнить
+ * указатель стека в *from и продолжить с сохраненного в to.
+ */
+void coro_switch(void** from, void* to);
+__asm__(
+    ".text\n"
+    ".globl coro_switch\n"
+    ".type coro_switch, @function\n"
+    "coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_switch, .-coro_switch\n");
+
+struct coro_ctx {
+    void* sp;
+};
+
+void ctx_switch(struct coro_ctx* from, struct coro_ctx* to)
+{
+    coro_switch(&from->sp, to->sp);
+}
+
+/* Новый контекст: первое переключение на него "возвращается" в entry. */
+void ctx_make(struct coro_ctx* ctx, char* stack, size_t size, void (*entry)(void))
+{
+    void** sp = (void**)(stack + size);
+    int i;
+
+    //после ret указатель стека должен быть как после call: 16n + 8
+    *--sp = NULL;
+    *--sp = (void*)entry;
+    for (i = 0; i < 6; i++) *--sp = NULL;
+    ctx->sp = sp;
+}
+#else
+/* На других архитектурах - ucontext (дороже: swapcontext() меняет маску сигналов). */
+#include <ucontext.h>
+
+struct coro_ctx {
+    ucontext_t uc;
+};
+
+void ctx_switch(struct coro_ctx* from, struct coro_ctx* to)
+{
+    swapcontext(&from->uc, &to->uc);
+}
+
+void ctx_make(struct coro_ctx* ctx, char* stack, size_t size, void (*entry)(void))
+{
+    getcontext(&ctx->uc);
+    ctx->uc.uc_stack.ss_sp = stack;
+    ctx->uc.uc_stack.ss_size = size;
+    ctx->uc.uc_link = NULL;
+    makecontext(&ctx->uc, entry, 0);
+}
+#endif
+
+struct sched;
+
+struct coro {
+    struct coro_ctx ctx;
+    char* stack;            /* Нижняя граница стека. */
+    struct sched* sched;
+    struct conn* conn;      /* Соединение; NULL - сопрограмма приема. */
+    struct coro* next;      /* Очередь готовых. */
+    int waiting;            /* Ждет события epoll. */
+};
+
+/* Поток-планировщик. */
+struct sched {
+    int epfd;
+    int lsocket;
+    struct coro_ctx ctx;    /* Контекст самого планировщика. */
+    struct coro* current;   /* Выполняемая сопрограмма. */
+    struct coro *head, *tail;   /* Очередь готовых к выполнению. */
+    struct coro* done;      /* Завершилась; стек освобождает планировщик. */
+    struct coro* acceptor;
+    int nconns, limit;      /* Соединений сейчас и наибольшее число. */
+};
+
+static struct pool coro_pool;   /* Объекты struct coro со стеками. */
+static __thread struct sched* cur_sched;
+
+int coro_active(void)
+{
+    return cur_sched != NULL && cur_sched->current != NULL;
+}
+
+/*
+ * Выделить сопрограммы и их стеки. Стеки не заполняются страницами
+ * заранее: соединению обычно хватает нескольких первых килобайт.
+ */
+void coro_pool_init(size_t count)
+{
+    size_t step = CORO_STACK + CORO_GUARD, i;
+    struct coro* co;
+    char* area;
+
+    pool_init(&coro_pool, sizeof(struct coro), count);
+    area = mmap(NULL, step * count, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) error("mmap()");
+    for (i = 0; i < count; i++) {
+        if (mprotect(area + i * step, CORO_GUARD, PROT_NONE) == -1) error("mprotect()");
+        co = (struct coro*)(coro_pool.base + i * coro_pool.size);
+        co->stack = area + i * step + CORO_GUARD;
+    }
+}
+
+void coro_ready(struct sched* s, struct coro* co)
+{
+    co->next = NULL;
+    if (s->tail != NULL) s->tail->next = co;
+    else s->head = co;
+    s->tail = co;
+}
+
+/* Отдать поток планировщику до пробуждения (coro_ready()). */
+void coro_park(void)
+{
+    struct sched* s = cur_sched;
+    struct coro* co = s->current;
+
+    co->waiting = 1;
+    ctx_switch(&co->ctx, &s->ctx);
+}
+
+/*
+ * Дескриптор не готов (EAGAIN): подождать события epoll. Возвращает 0
+ * вне сопрограммы - тогда EAGAIN настоящая ошибка.
+ */
+int coro_wait_io(void)
+{
+    if (!coro_active()) return 0;
+    coro_park();
+
+    return 1;
+}
+
+/* Прослушиваемый сокет в epoll планировщика: принимать или нет. */
+void sched_listen(struct sched* s, int on)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = s->acceptor;
+    if (epoll_ctl(s->epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, s->lsocket, &ev) == -1)
+        error("epoll_ctl()");
+}
+
+void coro_main(void);
+
+struct coro* coro_spawn(struct sched* s, struct conn* c)
+{
+    struct coro* co = pool_get(&coro_pool);
+
+    co->sched = s;
+    co->conn = c;
+    co->waiting = 0;
+    ctx_make(&co->ctx, co->stack, CORO_STACK, coro_main);
+    coro_ready(s, co);
+
+    return co;
+}
+
+/*
+ * Сопрограмма приема соединений планировщика s.
+ */
+void coro_acceptor(struct sched* s)
+{
+    struct epoll_event ev;
+    struct conn* c;
+    int fd;
+
+    for (;;) {
+        //все места заняты: не принимать, пока не завершится одно из соединений
+        if (s->nconns >= s->limit) {
+            sched_listen(s, 0);
+            while (s->nconns >= s->limit) coro_park();
+            sched_listen(s, 1);
+        }
+
+        alloc_set_phase(PHASE_ACCEPT);
+        fd = Accept(s->lsocket, NULL, NULL);
+        c = pool_get(&conn_pool);
+        conn_accepted(c, fd);
+
+        //события сокета - по фронту: сопрограмма ждет их только после EAGAIN
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = coro_spawn(s, c);
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) error("epoll_ctl()");
+        s->nconns++;
+    }
+}
+
+/* Точка входа сопрограммы; не возвращается. */
+void coro_main(void)
+{
+    struct sched* s = cur_sched;
+    struct coro* co = s->current;
+
+    if (co->conn != NULL) serve_conn(co->conn);
+    else coro_acceptor(s);
+
+    s->done = co;
+    ctx_switch(&co->ctx, &s->ctx);
+}
+
+void* sched_thread(void* arg)
+{
+    struct sched* s = arg;
+    struct epoll_event evs[64];
+    struct coro* co;
+    int i, n;
+
+    cur_sched = s;
+
+    s->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epfd == -1) error("epoll_create1()");
+    s->acceptor = coro_spawn(s, NULL);
+    sched_listen(s, 1);
+
+    for (;;) {
+        while ((co = s->head) != NULL) {
+            s->head = co->next;
+            if (s->head == NULL) s->tail = NULL;
+            s->current = co;
+            ctx_switch(&s->ctx, &co->ctx);
+            s->current = NULL;
+
+            if (s->done != NULL) {
+                //сокет уже закрыт и из epoll удален
+                pool_put(&coro_pool, s->done);
+                s->done = NULL;
+                s->nconns--;
+                if (s->acceptor->waiting) {
+                    s->acceptor->waiting = 0;
+                    coro_ready(s, s->acceptor);
+                }
+            }
+        }
+
+        n = epoll_wait(s->epfd, evs, 64, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            error("epoll_wait()");
+        }
+        //лишние события безвредны: сопрограмма повторит вызов и
+        //при EAGAIN снова будет ждать
+        for (i = 0; i < n; i++) {
+            co = evs[i].data.ptr;
+            if (co->waiting) {
+                co->waiting = 0;
+                coro_ready(s, co);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Запустить планировщики и ждать сигнала остановки.
+ */
+void coro_run(int lsocket)
+{
+    struct sched* scheds;
+    pthread_t thread;
+    sigset_t set, old;
+    int i;
+
+    if (fcntl(lsocket, F_SETFL, fcntl(lsocket, F_GETFL) | O_NONBLOCK) == -1) error("fcntl()");
+
+    //места делятся поровну, так что pool_get() в сопрограмме не ждет
+    scheds = region_alloc(sizeof(struct sched) * nprocs);
+    memset(scheds, 0, sizeof(struct sched) * nprocs);
+    for (i = 0; i < nprocs; i++) {
+        scheds[i].lsocket = lsocket;
+        scheds[i].limit = max_conns / nprocs;
+        Pthread_create(&thread, serve_attr(), sched_thread, &scheds[i]);
+        pthread_detach(thread);
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    while (!stop) sigsuspend(&old);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Режим event: соединения без собственных потоков, стеков и буферов.
+ *
+ * nprocs потоков, у каждого свой epoll; прослушиваемый сокет добавлен
+ * во все с EPOLLEXCLUSIVE, как у coro. Простаивающее соединение - это
+ * только его ячейки в таблице соединений и сокет в epoll. Буфер приема,
+ * очередь вывода и буфер сообщений (struct io) соединение берет из
+ * общего пула, когда приходят данные, и возвращает, как только все
+ * запросы разобраны, а ответы отправлены. Пул - стек LIFO, страницы
+ * которого заранее не заполняются, так что память занимают только
+ * объекты, которые хоть раз были заняты одновременно. Если запросы
+ * начинает клиент, принятое соединение сразу приходит с запросом
+ * (TCP_DEFER_ACCEPT).
+ *
+ * Обработчики те же, что и у остальных режимов; потоковой отправки
+ * длинных сообщений (--chunk) здесь нет.
+ */
+#define EVENT_STACK (64UL << 10)    /* Стек потока цикла по умолчанию. */
+#define DEFER_ACCEPT_SEC 10         /* Сколько ядро ждет первого запроса. */
+#define EV_SPARE_FDS 64             /* Дескрипторов сверх соединений: сокеты, epoll, файлы. */
+#define EV_LISTENER UINT64_MAX      /* Данные события прослушиваемого сокета. */
+
+struct io {
+    struct rbuf rb;
+    struct outq q;
+    uint64_t t0;            /* Получение запроса, ответ на который в очереди. */
+    char buf[];             /* Буфер сообщений соединения (c->buf). */
+};
+
+static struct pool io_pool;
+
+/*
+ * Таблица соединений, индекс - номер дескриптора. Горячая часть - то,
+ * что цикл смотрит на каждом событии и при обходе сроков: состояние,
+ * срок и буферы с очередью вывода, по 24 байта на соединение подряд.
+ * Ячейку трогает только цикл, принявший соединение; сроки он обходит
+ * по своему списку дескрипторов, а не по всей таблице, так что ячейки
+ * чужих циклов, которые те в это время закрывают и заполняют заново,
+ * он не читает.
+ * Холодная - struct conn (номер, генератор, буфер сообщений), она
+ * нужна только обработчику запроса и журналу.
+ *
+ * В данных события epoll вместе с дескриптором лежит поколение ячейки.
+ * Оно растет при каждом закрытии, поэтому событие, полученное до того,
+ * как соединение закрыли по сроку, не достанется новому соединению с
+ * тем же дескриптором. Поколение - единственное, что может прочесть
+ * другой цикл: событие, полученное до закрытия, проверяется уже после
+ * того, как дескриптор достался чужому соединению.
+ */
+enum { EV_FREE, EV_IDLE, EV_READ, EV_SEND, EV_BLOCKED };
+
+struct ev_slot {
+    struct io* io;          /* Буферы на время обмена; NULL - простаивает. */
+    uint32_t gen;           /* Поколение ячейки. */
+    uint32_t deadline;      /* Закрыть в эту секунду часов цикла (--idle-timeout). */
+    int pos;                /* Место дескриптора в списке цикла (evloop.fds). */
+    int state;              /* EV_IDLE: без буферов; EV_READ: запрос не дочитан;
+                               EV_SEND: ответ в очереди; EV_BLOCKED: ждем EPOLLOUT. */
+};
+
+static struct ev_slot* ev_hot;
+static struct conn* ev_cold;
+static int ev_table_size;
+static int idle_timeout = 0;        /* --idle-timeout, с; 0 - не закрывать. */
+
+/*
+ * Дескрипторов не больше, чем ячеек в таблице: предел RLIMIT_NOFILE
+ * опускается до ее размера, и accept() сверх него получает EMFILE.
+ */
+void ev_table_init(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) error("getrlimit()");
+    ev_table_size = max_conns + nprocs + EV_SPARE_FDS;
+    if (rl.rlim_cur < (rlim_t)ev_table_size) ev_table_size = rl.rlim_cur;
+    rl.rlim_cur = ev_table_size;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) error("setrlimit()");
+
+    ev_hot = region_alloc(sizeof(struct ev_slot) * ev_table_size);
+    ev_cold = region_alloc(sizeof(struct conn) * ev_table_size);
+    memset(ev_hot, 0, sizeof(struct ev_slot) * ev_table_size);
+    memset(ev_cold, 0, sizeof(struct conn) * ev_table_size);
+}
+
+/* Часы цикла: секунды, для сроков соединений. */
+uint32_t ev_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/* Поток цикла событий. */
+struct evloop {
+    int index;
+    int epfd;
+    int lsocket;
+    int listening;
+    int nconns, limit;      /* Соединений сейчас и наибольшее число. */
+    int* fds;               /* Дескрипторы соединений цикла, nconns штук. */
+    uint32_t now;           /* ev_clock() после последнего epoll_wait(). */
+    uint32_t swept;         /* Когда сроки проверялись в последний раз. */
+    int fd_wait;            /* accept() получил EMFILE: прием выключен до retry, */
+    uint32_t retry;         /* если раньше не закроется свое соединение. */
+};
+
+void ev_listen(struct evloop* l, int on)
+{
+    struct epoll_event ev;
+
+    if (l->listening == on) return;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.u64 = EV_LISTENER;
+    if (epoll_ctl(l->epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, l->lsocket, &ev) == -1)
+        error("epoll_ctl()");
+    l->listening = on;
+}
+
+void ev_watch(struct evloop* l, int fd, int op, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.u64 = (uint64_t)__atomic_load_n(&ev_hot[fd].gen, __ATOMIC_RELAXED) << 32 | (uint32_t)fd;
+    if (epoll_ctl(l->epfd, op, fd, &ev) == -1) error("epoll_ctl()");
+}
+
+/* Взять буферы на время обмена. */
+struct io* ev_borrow(struct ev_slot* s, struct conn* c)
+{
+    struct io* io = s->io;
+
+    if (io == NULL) {
+        io = s->io = pool_get(&io_pool);
+        io->rb.pos = io->rb.end = 0;
+        io->q.n = io->q.first = 0;
+        io->q.bytes = 0;
+        s->state = EV_READ;
+        c->buf = io->buf;
+    }
+
+    return io;
+}
+
+void ev_release(struct ev_slot* s, struct conn* c)
+{
+    pool_put(&io_pool, s->io);
+    s->io = NULL;
+    s->state = EV_IDLE;
+    c->buf = NULL;
+}
+
+void ev_close(struct evloop* l, int fd)
+{
+    struct ev_slot* s = &ev_hot[fd];
+    struct conn* c = &ev_cold[fd];
+    int last;
+
+    capture_close(c);
+    if (s->io != NULL) {
+        outq_done(&s->io->q);
+        ev_release(s, c);
+    }
+    s->state = EV_FREE;
+    //поколение растет до того, как дескриптор может достаться другому циклу
+    __atomic_store_n(&s->gen, s->gen + 1, __ATOMIC_RELEASE);
+    last = l->fds[--l->nconns];
+    l->fds[s->pos] = last;
+    ev_hot[last].pos = s->pos;
+    //закрытие удаляет сокет и из epoll
+    Close(fd);
+    ev_listen(l, 1);
+}
+
+/*
+ * Отправить ответ из очереди, не дожидаясь места в сокете. Возвращает
+ * 1, когда ответ ушел целиком, 0 - если сокет заполнен, -1 - если
+ * клиент закрыл соединение, не дочитав.
+ */
+int ev_send(struct conn* c, struct io* io)
+{
+    struct outq* q = &io->q;
+    ssize_t rc;
+
+    while (q->first < q->n) {
+        rc = writev(c->fd, q->iov + q->first, q->n - q->first);
+        if (rc == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            if (errno == EPIPE || errno == ECONNRESET) return -1;
+            error("writev()");
+        }
+        while (q->first < q->n && (size_t)rc >= q->iov[q->first].iov_len) {
+            rc -= q->iov[q->first].iov_len;
+            q->first++;
+        }
+        if (q->first < q->n) {
+            q->iov[q->first].iov_base = (char*)q->iov[q->first].iov_base + rc;
+            q->iov[q->first].iov_len -= rc;
+        }
+    }
+    stats_request(q->bytes, now_ns() - io->t0);
+    outq_done(q);
+
+    return 1;
+}
+
+/* Передать запрос обработчику; ответ уходит в ev_serve(). */
+void ev_request(struct ev_slot* s, struct conn* c, struct view req)
+{
+    s->io->t0 = now_ns();
+    handle_request(c, req, &s->io->q);
+    outq_capture(c, &s->io->q);
+    s->state = EV_SEND;
+}
+
+/*
+ * Соединение готово: дописать начатый ответ, затем разбирать запросы
+ * и читать сокет, пока в нем есть данные.
+ */
+void ev_serve(struct evloop* l, int fd)
+{
+    struct ev_slot* s = &ev_hot[fd];
+    struct conn* c = &ev_cold[fd];
+    struct io* io = ev_borrow(s, c);
+    struct view req;
+    ssize_t n;
+    int rc;
+
+    alloc_set_phase(PHASE_SERVE);
+    s->deadline = l->now + idle_timeout;
+    for (;;) {
+        if (s->state >= EV_SEND) {
+            rc = ev_send(c, io);
+            if (rc < 0) break;
+            if (rc == 0) {
+                //пока ответ не ушел, новые запросы не читаются
+                if (s->state != EV_BLOCKED) ev_watch(l, fd, EPOLL_CTL_MOD, EPOLLOUT);
+                s->state = EV_BLOCKED;
+                return;
+            }
+            if (s->state == EV_BLOCKED) ev_watch(l, fd, EPOLL_CTL_MOD, EPOLLIN);
+            s->state = EV_READ;
+            if (!keepalive) break;
+        }
+        if (rbuf_line(&io->rb, &req)) {
+            capture(c, CAP_RECV, req.p, req.len);
+            ev_request(s, c, req);
+            continue;
+        }
+        n = read(fd, io->rb.data + io->rb.end, RBUF_SIZE - io->rb.end);
+        if (n > 0) {
+            io->rb.end += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) {
+            //все разобрано и отправлено: соединение снова ничего не держит
+            if (io->rb.pos == io->rb.end) ev_release(s, c);
+            return;
+        }
+        if (n == -1 && errno != ECONNRESET) error("read()");
+        if (n == -1 || !rbuf_tail(&io->rb, &req)) break;
+        capture(c, CAP_RECV, req.p, req.len);
+        ev_request(s, c, req);
+    }
+    ev_close(l, fd);
+}
+
+/* Принять все ожидающие соединения, пока есть места. */
+void ev_accept(struct evloop* l)
+{
+    struct ev_slot* s;
+    struct conn* c;
+    int fd;
+
+    while (l->nconns < l->limit) {
+        fd = accept4(l->lsocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN) return;
+            //дескрипторы кончились, в том числе из-за соединений других циклов:
+            //принимать снова после своего закрытия или через секунду
+            if (errno == EMFILE || errno == ENFILE) {
+                l->fd_wait = 1;
+                l->retry = l->now + 1;
+                break;
+            }
+            error("accept()");
+        }
+
+        alloc_set_phase(PHASE_ACCEPT);
+        s = &ev_hot[fd];
+        c = &ev_cold[fd];
+        conn_accepted(c, fd);
+        c->buf = NULL;
+        rng_init(&c->rng, conn_stream(c));
+        capture(c, CAP_OPEN, NULL, 0);
+        s->io = NULL;
+        s->state = EV_IDLE;
+        s->deadline = l->now + idle_timeout;
+        s->pos = l->nconns;
+        l->fds[l->nconns++] = fd;
+        ev_watch(l, fd, EPOLL_CTL_ADD, EPOLLIN);
+        //ответ на само соединение
+        if (!keepalive && !listen_handler->request) {
+            ev_borrow(s, c);
+            ev_request(s, c, (struct view){ "", 0 });
+            ev_serve(l, fd);
+        }
+    }
+    ev_listen(l, 0);
+}
+
+/*
+ * Закрыть соединения цикла, молчащие дольше --idle-timeout. Обход
+ * идет по списку цикла с конца: ev_close() переносит на место
+ * закрытого последний, уже проверенный дескриптор.
+ */
+void ev_expire(struct evloop* l)
+{
+    int i, fd;
+
+    for (i = l->nconns - 1; i >= 0; i--) {
+        fd = l->fds[i];
+        if ((int32_t)(ev_hot[fd].deadline - l->now) <= 0) ev_close(l, fd);
+    }
+}
+
+void* ev_thread(void* arg)
+{
+    struct evloop* l = arg;
+    struct epoll_event evs[64];
+    uint64_t data;
+    int i, n, fd;
+
+    l->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (l->epfd == -1) error("epoll_create1()");
+    l->now = l->swept = ev_clock();
+    ev_listen(l, 1);
+
+    for (;;) {
+        n = epoll_wait(l->epfd, evs, 64, idle_timeout || l->fd_wait ? 1000 : -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            error("epoll_wait()");
+        }
+        l->now = ev_clock();
+        if (idle_timeout && l->now != l->swept) {
+            ev_expire(l);
+            l->swept = l->now;
+        }
+        if (l->fd_wait && (int32_t)(l->now - l->retry) >= 0) {
+            l->fd_wait = 0;
+            ev_listen(l, 1);
+        }
+        for (i = 0; i < n; i++) {
+            data = evs[i].data.u64;
+            if (data == EV_LISTENER) {
+                ev_accept(l);
+                continue;
+            }
+            //соединение уже закрыто по сроку, а дескриптор, может быть,
+            //достался новому, принятому в этой же пачке
+            fd = (uint32_t)data;
+            if (__atomic_load_n(&ev_hot[fd].gen, __ATOMIC_ACQUIRE) == data >> 32) ev_serve(l, fd);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Запустить циклы событий и ждать сигнала остановки.
+ */
+void ev_run(int lsocket)
+{
+    struct evloop* loops;
+    pthread_t thread;
+    sigset_t set, old;
+    int i;
+
+    if (fcntl(lsocket, F_SETFL, fcntl(lsocket, F_GETFL) | O_NONBLOCK) == -1) error("fcntl()");
+    //клиент, ушедший не дочитав, закрывает свое соединение, а не сервер
+    signal(SIGPIPE, SIG_IGN);
+
+    loops = region_alloc(sizeof(struct evloop) * nprocs);
+    memset(loops, 0, sizeof(struct evloop) * nprocs);
+    for (i = 0; i < nprocs; i++) {
+        loops[i].index = i;
+        loops[i].lsocket = lsocket;
+        //остаток - первым циклам, чтобы вместе они держали ровно -c
+        loops[i].limit = max_conns / nprocs + (i < max_conns % nprocs);
+        loops[i].fds = region_alloc(sizeof(int) * (loops[i].limit + 1));
+        Pthread_create(&thread, serve_attr(), ev_thread, &loops[i]);
+        pthread_detach(thread);
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    while (!stop) sigsuspend(&old);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Рассылка в группу multicast (-m multicast).
+ *
+ * Сервер не ждет запросов, а сам шлет поток сообщений в группу --group
+ * на порт -p; его получают все подписчики сегмента сразу, и отправка не
+ * растет с числом получателей. Датаграммы собираются пачками по
+ * --mc-batch и уходят одним sendmmsg(). Заголовок и текст лежат в
+ * разных iovec, так что сообщения из запаса (-R) не копируются.
+ * Формат датаграмм - в mcast.h.
+ */
+static struct in_addr mc_group;     /* --group */
+static struct in_addr mc_if;        /* --mc-if; INADDR_ANY - по таблице маршрутов. */
+static double mc_rate = 0;          /* Датаграмм в секунду; 0 - без ограничения. */
+static int mc_batch = 32;           /* Датаграмм на один sendmmsg(). */
+
+/* Текущее время по часам реального времени, нс (метка в заголовке). */
+uint64_t realtime_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int mc_open(void)
+{
+    struct sockaddr_in addr;
+    unsigned char ttl = 1;
+    int fd;
+
+    fd = Socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    //TTL 1: поток не выходит за пределы сегмента
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1) error("setsockopt()");
+    if (mc_if.s_addr != htonl(INADDR_ANY) &&
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mc_if, sizeof(mc_if)) == -1) error("setsockopt()");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = mc_group;
+    //адрес группы задан раз и навсегда, sendmmsg() обходится без msg_name
+    if (connect(fd, (SA*)&addr, sizeof(addr)) == -1) error("connect()");
+
+    return fd;
+}
+
+/*
+ * Рассылать, пока не запрошена остановка. Время обслуживания в
+ * статистике - от формирования пачки до ее отправки.
+ */
+void multicast_run(void)
+{
+    struct mmsghdr* msgs;
+    struct mc_header* hdrs;
+    struct iovec* iov;
+    struct timespec next;
+    struct rng r;
+    char* bufs;
+    uint64_t session, seq = 0, t0, ts, ns, step, dropped = 0, unsent = 0;
+    unsigned long k;
+    size_t len;
+    int fd, i, n, sent;
+
+    fd = mc_open();
+    msgs = region_alloc(sizeof(*msgs) * mc_batch);
+    hdrs = region_alloc(sizeof(*hdrs) * mc_batch);
+    iov = region_alloc(sizeof(*iov) * 2 * mc_batch);
+    bufs = reserve_n ? NULL : region_alloc(size_dist.max * mc_batch + 1);
+    memset(msgs, 0, sizeof(*msgs) * mc_batch);
+    for (i = 0; i < mc_batch; i++) {
+        iov[2 * i].iov_base = &hdrs[i];
+        iov[2 * i].iov_len = sizeof(hdrs[i]);
+        iov[2 * i + 1].iov_base = bufs + size_dist.max * i;
+        msgs[i].msg_hdr.msg_iov = &iov[2 * i];
+        msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    //свой поток, не совпадающий с потоками соединений и запаса
+    rng_init(&r, ~1ULL);
+    //новый сеанс при каждом запуске: получатель отличает перезапуск от потерь
+    session = splitmix64(seed ^ realtime_ns());
+    fprintf(stderr, "multicast: group %s:%d, session %016llx\n",
+        inet_ntoa(mc_group), port, (unsigned long long)session);
+
+    step = mc_rate > 0 ? mc_batch * 1e9 / mc_rate : 0;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (!stop) {
+        t0 = now_ns();
+        ts = realtime_ns();
+        for (i = 0; i < mc_batch; i++) {
+            if (reserve_n) {
+                k = rng_below(&r, reserve_n);
+                iov[2 * i + 1].iov_base = reserve_base + reserve_off[k];
+                //'\n' не нужен: границу задает датаграмма
+                len = reserve_off[k + 1] - reserve_off[k] - 1;
+            } else {
+                len = message_length(&r);
+                make_letters(&r, iov[2 * i + 1].iov_base, len);
+            }
+            iov[2 * i + 1].iov_len = len;
+            hdrs[i].magic = MC_MAGIC;
+            hdrs[i].len = len;
+            hdrs[i].session = session;
+            hdrs[i].seq = seq++;
+            hdrs[i].ts = ts;
+            //sendmmsg() заполняет длину только отправленным
+            msgs[i].msg_len = 0;
+        }
+
+        for (sent = 0; sent < mc_batch && !stop; sent += n) {
+            n = sendmmsg(fd, msgs + sent, mc_batch - sent, 0);
+            if (n >= 0) continue;
+            n = 0;
+            if (errno == EINTR) continue;
+            //очередь интерфейса переполнена: датаграмма пропадает, как в сети
+            if (errno != ENOBUFS) error("sendmmsg()");
+            dropped++;
+            n = 1;
+        }
+        //остановка посреди пачки: номера остатка выданы, но не ушли
+        unsent += mc_batch - sent;
+
+        ns = now_ns() - t0;
+        for (i = 0; i < sent; i++)
+            if (msgs[i].msg_len) stats_request(msgs[i].msg_len, ns);
+
+        if (!step) continue;
+        next.tv_nsec += step;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        //отставание не копится в сон: пачки догоняют расписание подряд
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    fprintf(stderr, "multicast: %llu datagrams, %llu dropped by ENOBUFS\n",
+        (unsigned long long)(seq - unsent), (unsigned long long)dropped);
+    Close(fd);
+}
+
+/*
+ * Прогрев перед началом приема соединений.
+ */
+
+/* Обратиться к каждой странице пула, чтобы ядро выделило их сейчас. */
+void pool_prefault(struct pool* p)
+{
+    volatile char* m = p->base;
+    size_t i, size = p->size * p->count;
+
+    for (i = 0; i < size; i += 4096) m[i] = 0;
+}
+
+void reserve_init(void)
+{
+    long i;
+    size_t total = 0, page, size = 0;
+    struct rng r;
+
+    //свой поток, не совпадающий с потоками соединений
+    rng_init(&r, ~0ULL);
+
+    reserve_off = region_alloc(sizeof(size_t) * (reserve_n + 1));
+    for (i = 0; i < reserve_n; i++) {
+        reserve_off[i] = total;
+        total += message_length(&r) + 1;
+    }
+    reserve_off[reserve_n] = total;
+    if (!splice_send) {
+        reserve_base = region_alloc(total ? total : 1);
+    } else {
+        //запас с границы страницы, чтобы закрыть его от записи
+        page = hugepages ? HUGE_PAGE : 4096;
+        size = (total + page - 1) & ~(page - 1);
+        reserve_base = (char*)(((uintptr_t)region_alloc(size + page) + page - 1) & ~(page - 1));
+    }
+    for (i = 0; i < reserve_n; i++) {
+        make_message(&r, reserve_base + reserve_off[i], reserve_off[i + 1] - reserve_off[i] - 1);
+    }
+    //на страницы запаса ссылаются еще не подтвержденные отправки
+    if (splice_send && mprotect(reserve_base, size, PROT_READ) == -1) error("mprotect()");
+}
+
+/*
+ * Прогнать n запросов через обычный путь обслуживания по паре
+ * сокетов (socketpair), пока сервер еще не слушает порт.
+ */
+void self_test(long n)
+{
+    struct conn* c;
+    char s[MAXLINE];
+    int sv[2];
+    long i;
+
+    for (i = 0; i < n; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) error("socketpair()");
+        c = pool_get(&conn_pool);
+        c->fd = sv[0];
+        c->id = 0;
+        dispatch(c);
+        if (keepalive || listen_handler->request) writen(sv[1], "\n", 1);
+        reads(sv[1], s, MAXLINE);
+        Close(sv[1]);
+    }
+    //ответ прочитан, но поток мог еще не учесть его в статистике:
+    //прогрев кончается, когда все соединения вернулись в пул
+    if (n) pool_wait_full(&conn_pool);
+}
+
+/*
+ * Сообщить о готовности: строка в stderr и, если сервер запущен под
+ * systemd (Type=notify), уведомление READY=1 в NOTIFY_SOCKET.
+ */
+void notify_ready(double ms)
+{
+    const char* path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un addr;
+    int fd;
+
+    ready_ns = now_ns();
+    fprintf(stderr, "ready in %.1f ms (workers %d, reserve %ld messages, seed %llu)\n",
+        ms, nworkers, reserve_n, (unsigned long long)seed);
+    if (path == NULL || (path[0] != '/' && path[0] != '@')) return;
+    if (strlen(path) >= sizeof(addr.sun_path)) return;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (path[0] == '@') addr.sun_path[0] = 0;
+    fd = Socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    sendto(fd, "READY=1", 7, 0, (SA*)&addr,
+        offsetof(struct sockaddr_un, sun_path) + strlen(path));
+    Close(fd);
+}
+
+void on_signal(int sig)
+{
+    stop = 1;
+}
+
+void show_usage(void)
+{
+    puts("Usage: server3 [-p port] [-b backlog] [-m mode] [-n procs] [-s size] [-k] [-c conns] [-H] [-P]\n"
+        "               [-w workers] [-R messages] [-T requests]\n"
+        "               [--handoff path [--drain-timeout sec]] [--takeover path [--takeover-conns]]\n"
+        "               [--stats name] [--tune profile] [--seed n] [--chunk bytes]\n"
+        "               [--capture path [--capture-segment bytes] [--capture-payload bytes]]\n"
+        "               [--group addr [--mc-if addr] [--mc-rate n] [--mc-batch n]]\n"
+        "               [--handler name] [--file path] [--stack bytes] [--idle-timeout sec]\n"
+        "               [--async-close] [--splice]\n"
+        "  -p, --port PORT        listening port (default 1027)\n"
+        "  -b, --backlog N        listen() backlog (default 5)\n"
+        "  -m, --mode MODE        serving mode: thread (default), prefork, coro, event, multicast\n"
+        "  -n, --procs N          prefork worker processes or coro scheduler threads\n"
+        "                         (default: one per CPU)\n"
+        "  -s, --size DIST        message length in letters (default uniform:0:10):\n"
+        "                         N, uniform:A:B, lognormal:MEDIAN:SIGMA[:MAX], hist:FILE\n"
+        "  -k, --keepalive        answer every request line instead of once per connection\n"
+        "  -c, --max-conns N      connections served at once (default 1024)\n"
+        "  -H, --hugepages        back pools with 2MB pages (hugetlb, else THP)\n"
+        "  -P, --perf-counters    count dTLB misses, report them on exit\n"
+        "  -w, --workers N        pre-spawn N worker threads (default 0)\n"
+        "  -R, --reserve N        pre-generate N messages and serve from them\n"
+        "  -T, --self-test N      push N requests through the server before listening\n"
+        "  --handoff PATH         hand the port to a new process connecting to PATH\n"
+        "  --takeover PATH        take the port over from the process waiting on PATH\n"
+        "  --takeover-conns       also take over its idle keep-alive connections\n"
+        "  --drain-timeout SEC    after a handoff, close keep-alive connections idle\n"
+        "                         for SEC seconds (default 10)\n"
+        "  --stats NAME           publish counters in /dev/shm/NAME (see shmstat)\n"
+        "  --tune PROFILE         socket options: default, latency, throughput, churn\n"
+        "  --seed N               seed message contents and lengths (default: from time)\n"
+        "  --chunk BYTES          send longer messages in chunks of BYTES (default 65536)\n"
+        "  --capture PATH         record traffic to PATH.<proc>.<segment> (see capture.h)\n"
+        "  --capture-segment N    log segment size (default 64MB)\n"
+        "  --capture-payload N    store payloads up to N bytes, hash longer (default 256, max 4096)\n"
+        "  --group ADDR           multicast group for -m multicast (port is -p)\n"
+        "  --mc-if ADDR           send through the interface with ADDR (default: by route)\n"
+        "  --mc-rate N            datagrams per second (default 0: as fast as possible)\n"
+        "  --mc-batch N           datagrams per sendmmsg() (default 32)\n"
+        "  --handler NAME         reply with: random (default), echo, file, kv;\n"
+        "                         a request \"@NAME rest\" picks the handler per request\n"
+        "  --file PATH            file served by the file handler\n"
+        "  --stack BYTES          stack size of serving threads (default: system, 64K for event)\n"
+        "  --idle-timeout SEC     event mode: close connections silent for SEC seconds\n"
+        "  --async-close          close sockets and recycle buffers on a background thread\n"
+        "                         (thread and prefork modes)\n"
+        "  --splice               send -R messages with vmsplice()/splice(), without copying\n"
+        "                         (thread and prefork modes)");
+    exit(-1);
+}
+
+/* Длинные ключи без однобуквенной формы. */
+enum { OPT_HANDOFF = 256, OPT_TAKEOVER, OPT_TAKEOVER_CONNS, OPT_STATS, OPT_TUNE, OPT_SEED, OPT_CHUNK,
+    OPT_CAPTURE, OPT_CAPTURE_SEGMENT, OPT_CAPTURE_PAYLOAD, OPT_GROUP, OPT_MC_IF, OPT_MC_RATE,
+    OPT_MC_BATCH, OPT_HANDLER, OPT_FILE, OPT_STACK, OPT_IDLE_TIMEOUT,
+    OPT_ASYNC_CLOSE, OPT_SPLICE, OPT_DRAIN_TIMEOUT };
+
+/*
+ * Разбор аргументов командной строки.
+ */
+void parse_args(int argc, char** argv)
+{
+    static const struct option opts[] = {
+        { "port",      required_argument, NULL, 'p' },
+        { "backlog",   required_argument, NULL, 'b' },
+        { "mode",      required_argument, NULL, 'm' },
+        { "procs",     required_argument, NULL, 'n' },
+        { "size",      required_argument, NULL, 's' },
+        { "keepalive", no_argument,       NULL, 'k' },
+        { "max-conns", required_argument, NULL, 'c' },
+        { "hugepages", no_argument,       NULL, 'H' },
+        { "perf-counters", no_argument,   NULL, 'P' },
+        { "workers",   required_argument, NULL, 'w' },
+        { "reserve",   required_argument, NULL, 'R' },
+        { "self-test", required_argument, NULL, 'T' },
+        { "handoff",   required_argument, NULL, OPT_HANDOFF },
+        { "takeover",  required_argument, NULL, OPT_TAKEOVER },
+        { "takeover-conns", no_argument,  NULL, OPT_TAKEOVER_CONNS },
+        { "drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT },
+        { "stats",     required_argument, NULL, OPT_STATS },
+        { "tune",      required_argument, NULL, OPT_TUNE },
+        { "seed",      required_argument, NULL, OPT_SEED },
+        { "chunk",     required_argument, NULL, OPT_CHUNK },
+        { "capture",   required_argument, NULL, OPT_CAPTURE },
+        { "capture-segment", required_argument, NULL, OPT_CAPTURE_SEGMENT },
+        { "capture-payload", required_argument, NULL, OPT_CAPTURE_PAYLOAD },
+        { "group",     required_argument, NULL, OPT_GROUP },
+        { "mc-if",     required_argument, NULL, OPT_MC_IF },
+        { "mc-rate",   required_argument, NULL, OPT_MC_RATE },
+        { "mc-batch",  required_argument, NULL, OPT_MC_BATCH },
+        { "handler",   required_argument, NULL, OPT_HANDLER },
+        { "file",      required_argument, NULL, OPT_FILE },
+        { "stack",     required_argument, NULL, OPT_STACK },
+        { "idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT },
+        { "async-close", no_argument,     NULL, OPT_ASYNC_CLOSE },
+        { "splice",    no_argument,       NULL, OPT_SPLICE },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c, seeded = 0;
+
+    while ((c = getopt_long(argc, argv, "p:b:m:n:s:kc:HPw:R:T:h", opts, NULL)) != -1) {
+        switch (c) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "thread")) mode = MODE_THREAD;
+            else if (!strcmp(optarg, "prefork")) mode = MODE_PREFORK;
+            else if (!strcmp(optarg, "coro")) mode = MODE_CORO;
+            else if (!strcmp(optarg, "event")) mode = MODE_EVENT;
+            else if (!strcmp(optarg, "multicast")) mode = MODE_MULTICAST;
+            else show_usage();
+            break;
+        case 'n':
+            nprocs = atoi(optarg);
+            if (nprocs < 1) show_usage();
+            break;
+        case 's':
+            if (size_parse(optarg) == -1) show_usage();
+            break;
+        case 'k':
+            keepalive = 1;
+            break;
+        case 'c':
+            max_conns = atoi(optarg);
+            if (max_conns < 1) show_usage();
+            break;
+        case 'H':
+            hugepages = 1;
+            break;
+        case 'P':
+            perf_counters = 1;
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            if (nworkers < 0) show_usage();
+            break;
+        case 'R':
+            reserve_n = atol(optarg);
+            if (reserve_n < 0) show_usage();
+            break;
+        case 'T':
+            self_requests = atol(optarg);
+            if (self_requests < 0) show_usage();
+            break;
+        case OPT_HANDOFF:
+            handoff_path = optarg;
+            break;
+        case OPT_TAKEOVER:
+            takeover_path = optarg;
+            break;
+        case OPT_TAKEOVER_CONNS:
+            takeover_conns = 1;
+            break;
+        case OPT_DRAIN_TIMEOUT:
+            drain_timeout = atoi(optarg);
+            if (drain_timeout < 0) show_usage();
+            break;
+        case OPT_STATS:
+            stats_name = optarg;
+            break;
+        case OPT_SEED:
+            seed = strtoull(optarg, NULL, 0);
+            seeded = 1;
+            break;
+        case OPT_CHUNK:
+            chunk_size = strtoul(optarg, NULL, 0) & ~7UL;
+            if (!chunk_size) show_usage();
+            break;
+        case OPT_CAPTURE:
+            capture_path = optarg;
+            break;
+        case OPT_CAPTURE_SEGMENT:
+            //в сегмент должен помещаться хотя бы один буфер потока
+            capture_segment = strtoul(optarg, NULL, 0);
+            if (capture_segment < sizeof(struct capture_file) + CAPTURE_BUF) show_usage();
+            break;
+        case OPT_CAPTURE_PAYLOAD:
+            capture_payload = strtoul(optarg, NULL, 0);
+            if (capture_payload > CAPTURE_MAX_PAYLOAD) show_usage();
+            break;
+        case OPT_GROUP:
+            if (inet_pton(AF_INET, optarg, &mc_group) != 1 || !IN_MULTICAST(ntohl(mc_group.s_addr)))
+                show_usage();
+            break;
+        case OPT_MC_IF:
+            if (inet_pton(AF_INET, optarg, &mc_if) != 1) show_usage();
+            break;
+        case OPT_MC_RATE:
+            mc_rate = atof(optarg);
+            if (mc_rate < 0) show_usage();
+            break;
+        case OPT_MC_BATCH:
+            mc_batch = atoi(optarg);
+            //больше ядро за один sendmmsg() не отправит (UIO_MAXIOV)
+            if (mc_batch < 1 || mc_batch > 1024) show_usage();
+            break;
+        case OPT_HANDLER:
+            listen_handler = handler_find(optarg, strlen(optarg));
+            if (listen_handler == NULL) show_usage();
+            break;
+        case OPT_FILE:
+            file_path = optarg;
+            break;
+        case OPT_STACK:
+            stack_size = strtoul(optarg, NULL, 0);
+            if (stack_size < PTHREAD_STACK_MIN) show_usage();
+            break;
+        case OPT_IDLE_TIMEOUT:
+            idle_timeout = atoi(optarg);
+            if (idle_timeout < 0) show_usage();
+            break;
+        case OPT_ASYNC_CLOSE:
+            async_close = 1;
+            break;
+        case OPT_SPLICE:
+            splice_send = 1;
+            break;
+        case OPT_TUNE:
+            tune = tune_find(optarg);
+            if (tune == NULL) show_usage();
+            break;
+        default:
+            show_usage();
+        }
+    }
+    if (optind != argc) show_usage();
+    //без --seed прогон не повторяется, но seed сообщается в notify_ready()
+    if (!seeded) seed = (uint64_t)time(NULL) << 22 ^ getpid();
+    //передача порта рассчитана на один процесс с потоками на соединения
+    if (mode != MODE_THREAD && (handoff_path != NULL || takeover_path != NULL)) show_usage();
+    //рассылке нужна группа, сообщение целиком в датаграмме, а соединений у нее нет
+    if (mode == MODE_MULTICAST && (!mc_group.s_addr || size_dist.max > MC_PAYLOAD_MAX ||
+        self_requests || capture_path != NULL)) show_usage();
+    if (listen_handler->serve == file_serve && file_path == NULL) show_usage();
+    //в цикле событий отправка не ждет: сообщение целиком в буфере, без потоковой
+    if (mode == MODE_EVENT && (size_dist.max + 1 >= chunk_size || self_requests)) show_usage();
+    if (mode == MODE_EVENT && !stack_size) stack_size = EVENT_STACK;
+    if (mode != MODE_EVENT && idle_timeout) show_usage();
+    //цикл событий и планировщик сопрограмм закрывают соединения сами:
+    //отложенный close() потребовал бы еще и отдельного удаления сокета из
+    //epoll, а пулы, ждущие потока закрытия, останавливали бы планировщик
+    if (mode != MODE_THREAD && mode != MODE_PREFORK && async_close) show_usage();
+    //splice() ждет места в сокете, а канал у потока один
+    if (splice_send && (!reserve_n || (mode != MODE_THREAD && mode != MODE_PREFORK))) show_usage();
+    if (!nprocs) nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nprocs < 1) nprocs = 1;
+    //у каждого планировщика и цикла событий хотя бы одно место под соединение
+    if ((mode == MODE_CORO || mode == MODE_EVENT) && nprocs > max_conns) nprocs = max_conns;
+}
+
+/*
+ * Создать прослушиваемый сокет и привязать его к порту.
+ */
+int open_listener(void)
+{
+    //прослушивающий сокет ждет запроса на соединение, ни с кем не соединен
+    int lsocket;    /* Дескриптор прослушиваемого сокета. */
+
+    //adress_family + sin_port + sin_addr + sin_zero (не используется)
+    struct sockaddr_in servaddr;
+
+    /* Создать сокет. */
+//PF_INET - IP версии 4 (PF_UNIX, PF_LOCAL - протокол Unix для локального взаимодействия)
+//SOCK_STREAM - надежный двусторонний обмен потоками байтов 
+//(SOCK_DGRAM - ненадежный обмен на основе передачи датаграмм без установления соединения)
+//Третий параметр указывает номер конкретного протокола в рамках указанного семейства для указанного типа сокета. 
+//Как правило, существует единственный протокол для каждого типа сокета внутри каждого семейства.
+
+//Вернет дескриптор сокета (некоторый идентификатор, например, номер записи в системной таблице)
+    //PF_INET - Протоколы Интернет IPv4
+    //SOCK_STREAM - jбеспечивает создание двусторонних, надёжных потоков байтов на основе установления соединения.
+    //Может также поддерживаться механизм внепоточных данных.
+    lsocket = Socket(PF_INET, SOCK_STREAM, 0);
+
+    //параметры, которые наследуют присоединенные сокеты, задаются до bind() и listen()
+    if (tune_apply(lsocket, tune, TUNE_LISTEN) == -1) error("setsockopt()");
+    //первым пишет клиент: соединение принимается вместе с запросом
+    if (mode == MODE_EVENT && (keepalive || listen_handler->request) &&
+        tune_set(lsocket, IPPROTO_TCP, TCP_DEFER_ACCEPT, DEFER_ACCEPT_SEC) == -1) error("setsockopt()");
+
+    /* Инициализировать структуру адреса сокета сервера. */
+//заполняем нулями
+    memset(&servaddr, 0, sizeof(servaddr));
+    //AF_INET соответствует Internet-домену (AF -> address family) 
+    //(AF_UNIX для передачи данных используется файловая система ввода/вывода Unix)
+    servaddr.sin_family = AF_INET;
+    //htons преобразует u_short из хоста в сетевой порядок байтов TCP/IP (сетевой - человеческий, в памяти - обратный).
+    servaddr.sin_port = htons(port);
+    //аналогично для целого
+    //INADDR_ANY - любой локальный интерфейс (= 0)
+    //если нужен конкретный адрес = inet_addr ("192.168.78.2")
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    /* Связать сокет с локальным адресом протокола. */
+//После создания с помощью socket(2), сокет появляется в адресном пространстве (семействе адресов), но без назначенного адреса. 
+//bind() назначает адрес, заданный в addr, сокету, указываемому дескриптором файла sockfd.
+    Bind(lsocket, (SA*)&servaddr, sizeof(servaddr));
+
+    return lsocket;
+}
+
+/*
+ * Подготовка процесса к обслуживанию: вся память выделяется заранее,
+ * затем прогрев, чтобы первые клиенты не платили за создание потоков,
+ * первое обращение к страницам пулов и холодные кэши.
+ */
+void warm_up(void)
+{
+    //счетчики открываются до создания потоков, чтобы те их унаследовали
+    if (perf_counters) tlb_counters_open();
+    stats_mark();
+
+    /* Вся память для обслуживания соединений выделяется заранее. */
+    //в режиме event буферы занимают только соединения с данными,
+    //поэтому их страницы заранее не заполняются
+    if (mode == MODE_EVENT) {
+        ev_table_init();
+        pool_init(&io_pool, (sizeof(struct io) + max_message() + 63) & ~63, max_conns);
+    } else {
+        pool_init(&conn_pool, sizeof(struct conn), max_conns);
+        pool_init(&buf_pool, max_message(), max_conns);
+    }
+
+    start_workers();
+    if (async_close) start_reaper();
+    if (mode != MODE_EVENT) {
+        pool_prefault(&conn_pool);
+        pool_prefault(&buf_pool);
+    }
+    if (reserve_n) reserve_init();
+    if (file_path != NULL) file_init();
+    //по сопрограмме на соединение и на прием в каждом планировщике
+    if (mode == MODE_CORO) coro_pool_init(max_conns + nprocs);
+    self_test(self_requests);
+
+    //запросы прогрева в статистику и журнал не входят
+    stats_reset();
+    if (capture_path != NULL) capture_init(max_conns + nworkers + nprocs);
+}
+
+/* Соединений может быть больше, чем дескрипторов по умолчанию. */
+void raise_nofile(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*
+ * SIGINT и SIGTERM завершают сервер штатно: без SA_RESTART сигнал
+ * прерывает accept() (или waitpid() в режиме prefork), и цикл выходит.
+ */
+void catch_stop_signals(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+/*
+ * Место под соединение, как pool_get(conn_pool), или NULL, если,
+ * пока все места заняты, запрошена остановка. Сигнал не прерывает
+ * pthread_cond_wait(), поэтому ожидание проверяет stop по таймеру.
+ */
+struct conn* conn_get(void)
+{
+    struct pool* p = &conn_pool;
+    struct timespec ts;
+    struct conn* c = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->nfree && !stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_nsec -= 1000000000;
+            ts.tv_sec++;
+        }
+        pthread_cond_timedwait(&p->nonempty, &p->lock, &ts);
+    }
+    if (p->nfree) c = p->free[--p->nfree];
+    pthread_mutex_unlock(&p->lock);
+
+    return c;
+}
+
+/*
+ * Принять соединение при перезапуске без простоя (см. выше): ждать
+ * его в poll() вместе с drain_pipe. -1 - порт передан или запрошена
+ * остановка.
+ */
+int accept_handoff(int lsocket)
+{
+    struct pollfd fds[2];
+    int fd;
+
+    fds[0].fd = lsocket;
+    fds[0].events = POLLIN;
+    fds[1].fd = drain_pipe[0];
+    fds[1].events = POLLIN;
+    while (!stop && !draining) {
+        fd = accept(lsocket, NULL, NULL);
+        if (fd != -1) return fd;
+        if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) error("accept()");
+        if (errno == EAGAIN && poll(fds, 2, -1) == -1 && errno != EINTR) error("poll()");
+    }
+
+    return -1;
+}
+
+/*
+ * Принимать соединения, пока не запрошена остановка.
+ */
+void accept_loop(int lsocket)
+{
+    //активный сокет, соединен с удаленным активным сокетом через открытое соединение данных
+    //уничтожится при закрытии соединения
+    int csocket;    /* Дескриптор присоединенного сокета. */
+
+    struct conn* c;
+
+    while (!stop) {
+        alloc_set_phase(PHASE_ACCEPT);
+
+        //ждем свободное место под соединение, если все заняты
+        c = conn_get();
+        if (c == NULL) break;
+
+        //извлекает первый запрос на соединение из очереди ожидающих соединений прослушивающего сокета,
+        //создаёт новый подключенный сокет и и возвращает новый файловый дескриптор, указывающий на сокет
+        if (handoff_path != NULL || takeover_path != NULL) csocket = accept_handoff(lsocket);
+        else csocket = Accept(lsocket, NULL, 0);
+        if (csocket == -1) {
+            pool_put(&conn_pool, c);
+            break;
+        }
+
+        conn_accepted(c, csocket);
+        dispatch(c);
+    }
+}
+
+/*
+ * Режим prefork: главный процесс привязывает и слушает порт, затем
+ * запускает nprocs рабочих процессов, каждый со своим циклом accept()
+ * и потоками обслуживания. Фатальная ошибка (error() -> exit(-1))
+ * завершает только один рабочий процесс, главный запускает его заново.
+ * Статистика рабочих собирается в общей памяти (см. stats_init()).
+ */
+static pid_t* children;
+
+/*
+ * Запустить рабочий процесс в ячейке slot. Рабочий сообщает о
+ * готовности байтом в ready_fd.
+ */
+void spawn_worker(int slot, int lsocket, int ready_fd)
+{
+    pid_t pid;
+
+    fflush(NULL);
+    pid = fork();
+    if (pid == -1) error("fork()");
+    if (pid) {
+        children[slot] = pid;
+        stats_procs(stats)[slot].pid = pid;
+        return;
+    }
+
+    stats_proc = slot;
+    stats_gen = stats_procs(stats)[slot].restarts;
+    catch_stop_signals();
+    warm_up();
+    Write(ready_fd, "", 1);
+    Close(ready_fd);
+
+    accept_loop(lsocket);
+    exit(0);
+}
+
+int prefork(int lsocket, struct timespec* t0)
+{
+    struct timespec t1, born[nprocs];
+    int ready[2], status, i, alive;
+    char buf[64];
+    size_t n;
+    ssize_t rc;
+    pid_t pid;
+    struct stats_counters total;
+    unsigned long restarts = 0;
+
+    stats_init(nprocs, nworkers ? nworkers : STATS_SLOTS);
+    children = Malloc(sizeof(pid_t) * nprocs);
+    catch_stop_signals();
+
+    /* Преобразовать неприсоединенный сокет в пассивный. */
+    Listen(lsocket, backlog);
+
+    //готовность - когда прогреты все рабочие; до этого соединения ждут в очереди
+    if (pipe(ready) == -1) error("pipe()");
+    for (i = 0; i < nprocs; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &born[i]);
+        spawn_worker(i, lsocket, ready[1]);
+    }
+    for (n = 0; n < (size_t)nprocs; n += rc) {
+        rc = read(ready[0], buf, sizeof(buf));
+        if (rc > 0) continue;
+        if (rc == -1 && errno == EINTR && !stop) {
+            rc = 0;
+            continue;
+        }
+        break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    notify_ready((t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6);
+
+    while (!stop) {
+        pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            error("waitpid()");
+        }
+        for (i = 0; i < nprocs && children[i] != pid; i++)
+            ;
+        if (i == nprocs || stop) continue;
+
+        fprintf(stderr, "prefork: worker %d (pid %d) exited with status %d, restarting\n",
+            i, pid, WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+        //не перезапускать чаще раза в секунду процесс, падающий сразу после старта
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (t1.tv_sec - born[i].tv_sec < 1) sleep(1);
+        clock_gettime(CLOCK_MONOTONIC, &born[i]);
+        stats_procs(stats)[i].restarts++;
+        spawn_worker(i, lsocket, ready[1]);
+    }
+
+    /* Остановить рабочих и подвести итог по всем процессам. */
+    for (i = 0; i < nprocs; i++) kill(children[i], SIGTERM);
+    for (alive = nprocs; alive > 0; ) {
+        if (waitpid(-1, &status, 0) != -1) alive--;
+        else if (errno != EINTR) break;
+    }
+    stats_total(&total);
+    for (i = 0; i < nprocs; i++) restarts += stats_procs(stats)[i].restarts;
+    fprintf(stderr, "prefork: %d workers, %llu connections, %llu requests, %llu bytes, %lu restarts\n",
+        nprocs, (unsigned long long)total.conns, (unsigned long long)total.requests,
+        (unsigned long long)total.bytes, restarts);
+    traffic_report();
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    struct timespec t0, t1;
+
+    //время до готовности отсчитывается от самого начала
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    parse_args(argc, argv);
+
+    //прослушивающий сокет ждет запроса на соединение, ни с кем не соединен
+    int lsocket = -1;   /* Дескриптор прослушиваемого сокета. */
+
+    raise_nofile();
+
+    //при перезапуске порт забирается у прежнего процесса, а не привязывается
+    if (takeover_path == NULL && mode != MODE_MULTICAST) lsocket = open_listener();
+
+    if (mode == MODE_PREFORK) return prefork(lsocket, &t0);
+
+    stats_init(1, nworkers ? nworkers : STATS_SLOTS);
+    stats_procs(stats)[0].pid = getpid();
+
+    //канал нужен до первых соединений - и самопроверки, и принятых
+    //от прежнего процесса: их потоки ждут в wait_request() и его
+    if (handoff_path != NULL && pipe(drain_pipe) == -1) error("pipe()");
+
+    /*
+     * Прогрев: до listen() клиенты получают отказ, поэтому первые из них
+     * не ждут, пока сервер подготовится.
+     */
+    warm_up();
+
+    catch_stop_signals();
+
+    if (takeover_path != NULL) {
+        //полученный сокет уже слушает порт
+        lsocket = takeover();
+    } else if (mode != MODE_MULTICAST) {
+    /* Преобразовать неприсоединенный сокет в пассивный. */
+//Вызов listen() помечает сокет, указанный в sockfd как пассивный,
+//то есть как сокет, который будет использоваться для приёма запросов входящих соединений
+        Listen(lsocket, backlog);
+    }
+    if (handoff_path != NULL) start_handoff_listener(lsocket);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    notify_ready((t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+    if (mode == MODE_MULTICAST) {
+        multicast_run();
+        traffic_report();
+        return 0;
+    }
+    if (mode == MODE_CORO) coro_run(lsocket);
+    else if (mode == MODE_EVENT) ev_run(lsocket);
+    else accept_loop(lsocket);
+
+    if (draining) drain_conns();
+
+    traffic_report();
+    report(nconns);
+
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Чтение статистики server3 из файла в /dev/shm (server3 --stats NAME).
+ *
+ * Файл отображается в память только для чтения; показания снимаются
+ * прямо из памяти сервера, без сокетов и без системных вызовов в
+ * сторону server3, так что частый опрос не мешает ему под нагрузкой.
+ *
+ * Компиляция:
+ *      cc -Wall -O2 -o shmstat shmstat.c
+ * (или просто make, см. Makefile)
+ *
+ * Запуск:
+ *      shmstat [-f hz] [-i ms] [-n count] [-j] NAME
+ *
+ * Раз в интервал (-i) печатается строка: время от запуска shmstat,
+ * темп соединений, запросов и байтов, пиковый темп запросов между
+ * соседними выборками (выборки делаются с частотой -f) и перцентили
+ * времени обслуживания запросов за интервал по гистограмме сервера.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmstats.h"
+
+static double hz = 1000;        /* Частота выборок. */
+static double interval = 1000;  /* Интервал вывода, мс. */
+static long count = 0;          /* Число строк; 0 - без ограничения. */
+static int json = 0;
+
+void error(const char* s)
+{
+    perror(s);
+    exit(-1);
+}
+
+static void show_usage(void)
+{
+    fprintf(stderr, "Usage: shmstat [-f hz] [-i ms] [-n count] [-j] NAME\n"
+        "  -f HZ     sampling frequency (default 1000)\n"
+        "  -i MS     reporting interval (default 1000)\n"
+        "  -n COUNT  stop after COUNT reports\n"
+        "  -j        print JSON lines\n"
+        "  NAME      stats file, /dev/shm/NAME unless it contains '/'\n");
+    exit(-1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Отобразить файл и проверить, что его раскладка нам понятна.
+ */
+static struct stats_header* attach(const char* name)
+{
+    char path[PATH_MAX];
+    struct stats_header* h;
+    struct stat st;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", strchr(name, '/') ? "" : "/dev/shm/", name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) error(path);
+    if (fstat(fd, &st) == -1) error("fstat()");
+    if ((size_t)st.st_size < sizeof(*h)) {
+        fprintf(stderr, "%s: file too short\n", path);
+        exit(-1);
+    }
+    h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) error("mmap()");
+    close(fd);
+
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC) {
+        fprintf(stderr, "%s: not a server3 stats file\n", path);
+        exit(-1);
+    }
+    if (h->version != STATS_VERSION || h->header_size != sizeof(struct stats_header) ||
+        h->proc_size != sizeof(struct stats_proc) || h->slot_size != sizeof(struct stats_slot) ||
+        h->hist_buckets != STATS_HIST_BUCKETS) {
+        fprintf(stderr, "%s: layout version %u, expected %u\n", path, h->version, STATS_VERSION);
+        exit(-1);
+    }
+    if ((size_t)st.st_size < stats_file_size(h->nprocs, h->slots_per_proc)) {
+        fprintf(stderr, "%s: file too short\n", path);
+        exit(-1);
+    }
+
+    return h;
+}
+
+static void sample(struct stats_header* h, struct stats_counters* sum)
+{
+    struct stats_slot* s = stats_slots(h);
+    struct stats_counters c;
+    uint32_t i;
+
+    memset(sum, 0, sizeof(*sum));
+    for (i = 0; i < h->nprocs * h->slots_per_proc; i++) {
+        stats_snapshot(&s[i], &c);
+        stats_accumulate(sum, &c);
+    }
+}
+
+/*
+ * Перцентиль по разности гистограмм, мкс: верхняя граница корзины.
+ */
+static double percentile(const uint64_t* hist, uint64_t n, double q)
+{
+    uint64_t seen = 0, rank = (uint64_t)(q * n);
+    int i;
+
+    if (!n) return 0;
+    for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) break;
+    }
+    if (i == STATS_HIST_BUCKETS) i--;
+    return (double)(2ULL << i) / 1e3;
+}
+
+int main(int argc, char** argv)
+{
+    struct stats_header* h;
+    struct stats_counters prev, cur, last;
+    struct timespec next;
+    uint64_t tstart, t0, t1, step, hist[STATS_HIST_BUCKETS], tl, ts;
+    double dt, peak, rate;
+    long printed = 0;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "f:i:n:j")) != -1) {
+        switch (c) {
+        case 'f': hz = atof(optarg); break;
+        case 'i': interval = atof(optarg); break;
+        case 'n': count = atol(optarg); break;
+        case 'j': json = 1; break;
+        default: show_usage();
+        }
+    }
+    if (optind != argc - 1 || hz <= 0 || interval <= 0) show_usage();
+
+    h = attach(argv[optind]);
+    step = 1e9 / hz;
+    sample(h, &prev);
+    last = prev;
+    tstart = t0 = tl = now_ns();
+    peak = 0;
+    if (!json) {
+        printf("%8s %10s %12s %10s %12s %9s %9s %9s\n", "time_s", "conn/s", "req/s", "MB/s",
+            "peak_req/s", "p50_us", "p99_us", "p999_us");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (;;) {
+        next.tv_nsec += step;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+
+        sample(h, &cur);
+        ts = now_ns();
+        if (ts > tl) {
+            rate = (cur.requests - last.requests) * 1e9 / (ts - tl);
+            if (rate > peak) peak = rate;
+        }
+        last = cur;
+        tl = ts;
+
+        t1 = ts;
+        if (t1 - t0 < interval * 1e6) continue;
+
+        dt = (t1 - t0) / 1e9;
+        for (i = 0; i < STATS_HIST_BUCKETS; i++) hist[i] = cur.hist[i] - prev.hist[i];
+        if (json) {
+            printf("{\"time_s\":%.3f,\"conns_per_s\":%.1f,\"requests_per_s\":%.1f,"
+                "\"mbytes_per_s\":%.3f,\"peak_requests_per_s\":%.1f,"
+                "\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f}\n",
+                (t1 - tstart) / 1e9, (cur.conns - prev.conns) / dt, (cur.requests - prev.requests) / dt,
+                (cur.bytes - prev.bytes) / dt / 1e6, peak,
+                percentile(hist, cur.requests - prev.requests, 0.50),
+                percentile(hist, cur.requests - prev.requests, 0.99),
+                percentile(hist, cur.requests - prev.requests, 0.999));
+        } else {
+            printf("%8.3f %10.1f %12.1f %10.3f %12.1f %9.3f %9.3f %9.3f\n",
+                (t1 - tstart) / 1e9, (cur.conns - prev.conns) / dt, (cur.requests - prev.requests) / dt,
+                (cur.bytes - prev.bytes) / dt / 1e6, peak,
+                percentile(hist, cur.requests - prev.requests, 0.50),
+                percentile(hist, cur.requests - prev.requests, 0.99),
+                percentile(hist, cur.requests - prev.requests, 0.999));
+        }
+        fflush(stdout);
+        prev = cur;
+        t0 = t1;
+        peak = 0;
+        if (count && ++printed >= count) break;
+    }
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Формат файла статистики server3 (--stats), общий для сервера и
+ * программы чтения shmstat.
+ *
+ * Файл отображается в память обоими процессами, так что читатель
+ * снимает показания без единого обращения к серверу. Раскладка:
+ *
+ *      struct stats_header             версия и размеры частей
+ *      struct stats_proc  [nprocs]     процессы (в режиме prefork - рабочие)
+ *      struct stats_slot  [nprocs * slots_per_proc]
+ *
+ * Ячейки stats_slot выровнены по строке кэша: каждый рабочий поток
+ * пишет в свою, не мешая остальным. Ячейка защищена seqlock: писатель
+ * делает seq нечетным на время обновления, читатель повторяет чтение,
+ * пока не получит одинаковое четное seq до и после копирования.
+ *
+ * При несовместимом изменении раскладки увеличивается STATS_VERSION.
+ */
+
+#ifndef SHMSTATS_H
+#define SHMSTATS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define STATS_MAGIC 0x54535333          /* "S3ST" */
+#define STATS_VERSION 1
+#define STATS_HIST_BUCKETS 40           /* Корзины по степеням двойки, нс. */
+
+struct stats_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;               /* sizeof(struct stats_header) */
+    uint32_t proc_size;                 /* sizeof(struct stats_proc) */
+    uint32_t slot_size;                 /* sizeof(struct stats_slot) */
+    uint32_t hist_buckets;
+    uint32_t nprocs;
+    uint32_t slots_per_proc;
+    uint64_t start_time;                /* Запуск сервера, нс от эпохи (CLOCK_REALTIME). */
+    int32_t pid;                        /* Главный процесс сервера. */
+} __attribute__((aligned(64)));
+
+struct stats_proc {
+    int32_t pid;
+    uint32_t restarts;                  /* Перезапусков процесса в этой ячейке. */
+} __attribute__((aligned(64)));
+
+/*
+ * Счетчики ячейки. Гистограмма - время обслуживания запроса
+ * (от получения запроса до отправки ответа): корзина i считает
+ * запросы длительностью [2^i, 2^(i+1)) нс.
+ */
+struct stats_counters {
+    uint64_t conns;                     /* Принято соединений. */
+    uint64_t requests;                  /* Отправлено сообщений. */
+    uint64_t bytes;                     /* Отправлено байтов. */
+    uint64_t hist[STATS_HIST_BUCKETS];
+};
+
+struct stats_slot {
+    uint32_t seq;
+    struct stats_counters c;
+} __attribute__((aligned(64)));
+
+#define STATS_NCOUNTERS (sizeof(struct stats_counters) / sizeof(uint64_t))
+
+static inline void stats_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline struct stats_proc* stats_procs(struct stats_header* h)
+{
+    return (struct stats_proc*)((char*)h + h->header_size);
+}
+
+static inline struct stats_slot* stats_slots(struct stats_header* h)
+{
+    return (struct stats_slot*)((char*)stats_procs(h) + (size_t)h->proc_size * h->nprocs);
+}
+
+static inline size_t stats_file_size(uint32_t nprocs, uint32_t slots_per_proc)
+{
+    return sizeof(struct stats_header) + sizeof(struct stats_proc) * nprocs +
+        sizeof(struct stats_slot) * nprocs * slots_per_proc;
+}
+
+/*
+ * Согласованный снимок ячейки (сторона читателя seqlock).
+ */
+static inline void stats_snapshot(const struct stats_slot* s, struct stats_counters* out)
+{
+    const uint64_t* src = (const uint64_t*)&s->c;
+    uint64_t* dst = (uint64_t*)out;
+    uint32_t seq0, seq1;
+    size_t i;
+
+    do {
+        while ((seq0 = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+            stats_cpu_relax();
+        for (i = 0; i < STATS_NCOUNTERS; i++) dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq1 = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    } while (seq0 != seq1);
+}
+
+/* Прибавить снимок ячейки к сумме. */
+static inline void stats_accumulate(struct stats_counters* sum, const struct stats_counters* c)
+{
+    uint64_t* d = (uint64_t*)sum;
+    const uint64_t* s = (const uint64_t*)c;
+    size_t i;
+
+    for (i = 0; i < STATS_NCOUNTERS; i++) d[i] += s[i];
+}
+
+#endif
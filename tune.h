@@ -0,0 +1,102 @@
+/*
+ * Профили настройки сокетов (--tune), общие для server3 и client.
+ *
+ *      default     настройки ядра, ни одного setsockopt()
+ *      latency     TCP_NODELAY, TCP_QUICKACK и маленький TCP_NOTSENT_LOWAT:
+ *                  ответ уходит сразу и не копится в очереди отправки
+ *      throughput  большие SO_SNDBUF/SO_RCVBUF и SO_RCVLOWAT: меньше
+ *                  пробуждений и подтверждений на тот же объем данных
+ *      churn       SO_REUSEADDR и закрытие со сбросом (SO_LINGER 0):
+ *                  поток коротких соединений не копит TIME_WAIT
+ *
+ * SO_RCVLOWAT задерживает read() до прихода стольких байтов, поэтому он
+ * ставится только на сокеты, которые читаются до конца потока
+ * (TUNE_READ_EOF): короткий ответ keep-alive ждал бы напрасно.
+ * Закрытие сбросом теряет неотправленные данные, поэтому SO_LINGER 0
+ * ставится только там, где к закрытию обмен уже закончен (TUNE_RESET_CLOSE):
+ * у клиента, прочитавшего ответ, и у сервера keep-alive, закрывающего
+ * соединение после клиента. Сервер без keep-alive закрывает первым; TIME_WAIT
+ * у него не остается, если клиент ответит на FIN сбросом.
+ * TCP_QUICKACK ядро со временем сбрасывает; он ставится один раз, на
+ * новом соединении, где задержка подтверждения заметнее всего.
+ */
+
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
+/* Флаги tune_apply(). */
+#define TUNE_LISTEN 1           /* Прослушиваемый сокет, до bind(). */
+#define TUNE_READ_EOF 2         /* Сокет читается до конца потока. */
+#define TUNE_RESET_CLOSE 4      /* Закрытию не предшествует недоставленный ответ. */
+
+struct tune_profile {
+    const char* name;
+    int nodelay;
+    int quickack;
+    int notsent_lowat;          /* 0 - не задавать. */
+    int sndbuf, rcvbuf;         /* 0 - не задавать. */
+    int rcvlowat;               /* 0 - не задавать. */
+    int reuseaddr;
+    int linger;                 /* SO_LINGER, с; -1 - не задавать. */
+};
+
+static const struct tune_profile tune_profiles[] = {
+    { .name = "default", .linger = -1 },
+    { .name = "latency", .nodelay = 1, .quickack = 1, .notsent_lowat = 16 << 10, .linger = -1 },
+    { .name = "throughput", .sndbuf = 4 << 20, .rcvbuf = 4 << 20, .rcvlowat = 64 << 10, .linger = -1 },
+    { .name = "churn", .reuseaddr = 1, .linger = 0 },
+};
+
+static inline const struct tune_profile* tune_find(const char* name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(tune_profiles) / sizeof(tune_profiles[0]); i++) {
+        if (!strcmp(tune_profiles[i].name, name)) return &tune_profiles[i];
+    }
+
+    return NULL;
+}
+
+static inline int tune_set(int fd, int level, int name, int val)
+{
+    return setsockopt(fd, level, name, &val, sizeof(val));
+}
+
+/*
+ * Применить профиль к сокету. Большинство параметров присоединенный
+ * сокет наследует от прослушиваемого, но они ставятся и на нем: сокет
+ * мог прийти от прежнего процесса (--takeover) с другим профилем.
+ * Возвращает -1 (и errno) при ошибке setsockopt().
+ */
+static inline int tune_apply(int fd, const struct tune_profile* p, int flags)
+{
+    struct linger lg;
+
+    if (p->reuseaddr && (flags & TUNE_LISTEN) && tune_set(fd, SOL_SOCKET, SO_REUSEADDR, 1) == -1)
+        return -1;
+    //буферы - до listen()/connect(): от них зависит масштаб окна TCP
+    if (p->sndbuf && tune_set(fd, SOL_SOCKET, SO_SNDBUF, p->sndbuf) == -1) return -1;
+    if (p->rcvbuf && tune_set(fd, SOL_SOCKET, SO_RCVBUF, p->rcvbuf) == -1) return -1;
+    if (p->rcvlowat && (flags & TUNE_READ_EOF) &&
+        tune_set(fd, SOL_SOCKET, SO_RCVLOWAT, p->rcvlowat) == -1) return -1;
+    if (p->nodelay && tune_set(fd, IPPROTO_TCP, TCP_NODELAY, 1) == -1) return -1;
+    if (p->quickack && !(flags & TUNE_LISTEN) && tune_set(fd, IPPROTO_TCP, TCP_QUICKACK, 1) == -1)
+        return -1;
+    if (p->notsent_lowat && tune_set(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p->notsent_lowat) == -1)
+        return -1;
+    if (p->linger >= 0 && (flags & TUNE_RESET_CLOSE)) {
+        lg.l_onoff = 1;
+        lg.l_linger = p->linger;
+        if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)) == -1) return -1;
+    }
+
+    return 0;
+}
+
+#endif